@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# bench.sh - throughput and latency of the proxy on loopback
+#
+#     Writes a synthetic corpus into a scratch directory, serves it with
+#     tiny, starts the proxy and points loadgen at both. Nothing leaves
+#     the machine.
+#
+#     usage: ./bench.sh [loadgen options]     (default: -c 32 -d 10 -n 2000)
+#     PROXY_ARGS in the environment are passed to the proxy.
+#
+
+HOME_DIR=`pwd`
+BENCH_ARGS=${@:-"-c 32 -d 10 -n 2000"}
+MAX_RAND=12000
+PORT_START=20000
+MAX_TRIES=50
+
+# the -n the loadgen will use, for the corpus
+NFILES=1000
+set -- ${BENCH_ARGS}
+while [ $# -gt 0 ]; do
+    [ "$1" = "-n" ] && NFILES=$2
+    shift
+done
+
+#
+# wait_for_port - wait until something listens on localhost:port
+# usage: wait_for_port <port>
+#
+function wait_for_port {
+    for i in `seq 1 ${MAX_TRIES}`; do
+        (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "Error: nothing listens on port $1"
+    return 1
+}
+
+#
+# pick_port - a port nothing listens on yet
+#
+function pick_port {
+    while true; do
+        port=$((PORT_START + RANDOM % MAX_RAND))
+        (exec 3<>/dev/tcp/127.0.0.1/${port}) 2>/dev/null || { echo ${port}; return; }
+    done
+}
+
+function cleanup {
+    kill ${PROXY_PID} ${TINY_PID} 2>/dev/null
+    wait 2>/dev/null
+    rm -rf ${CORPUS}
+}
+
+CORPUS=`mktemp -d /tmp/proxybench.XXXXXX`
+trap cleanup EXIT
+
+./loadgen -g ${CORPUS} -n ${NFILES} || exit 1
+cp tiny/tiny ${CORPUS}/
+
+TINY_PORT=`pick_port`
+(cd ${CORPUS} && exec ./tiny ${TINY_PORT} >/dev/null 2>&1) &
+TINY_PID=$!
+PROXY_PORT=`pick_port`
+while [ ${PROXY_PORT} = ${TINY_PORT} ]; do
+    PROXY_PORT=`pick_port`
+done
+./proxy ${PROXY_ARGS} ${PROXY_PORT} >/dev/null 2>&1 &
+PROXY_PID=$!
+wait_for_port ${TINY_PORT} || exit 1
+wait_for_port ${PROXY_PORT} || exit 1
+
+echo "proxy ${PROXY_ARGS} on ${PROXY_PORT}, tiny on ${TINY_PORT}"
+./loadgen ${BENCH_ARGS} localhost:${PROXY_PORT} localhost:${TINY_PORT}
@@ -0,0 +1,149 @@
+/*
+ * blocks.c - large objects cached in fixed-size blocks
+ *
+ * Block tags are "tag#gen.index": process_client() turns away a URL with
+ * a '#' anywhere in it, so they never collide with the tag of a URL.
+ */
+#include <stdatomic.h>
+
+#include "blocks.h"
+
+static atomic_long blocks_made;     // header objects, for their generation
+
+static int line_is(const char *line, const char *eol, const char *name);
+static void block_tag(char *dst, const char *tag, const cache_obj_t *head,
+                      long index);
+
+cache_obj_t *create_blocks_head(const char *head, size_t hdrlen, long total) {
+    const char *end = head + hdrlen;
+    const char *line = memchr(head, '\n', hdrlen);
+    if (line == NULL || hdrlen < 12) {
+        return NULL;
+    }
+    line++;
+    cache_obj_t *obj = create_object(hdrlen + 64);
+
+    // the status line of a 206 turns into a 200, keeping its version
+    int rc;
+    if (memcmp(head + 8, " 200", 4) == 0) {
+        rc = append_object(&obj, head, line - head);
+    } else if ((rc = append_object(&obj, head, 8)) == 0) {
+        rc = append_object(&obj, " 200 OK\r\n", 9);
+    }
+    while (rc == 0 && line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL || eol - line <= 1) {
+            break;  // the blank line
+        }
+        if (!line_is(line, eol, "Content-Length") &&
+            !line_is(line, eol, "Content-Range")) {
+            rc = append_object(&obj, line, eol + 1 - line);
+        }
+        line = eol + 1;
+    }
+    if (rc < 0) {
+        return NULL;    // append_object() released it
+    }
+    char length[64];
+    int n = snprintf(length, sizeof(length),
+                     "Content-Length: %ld\r\n\r\n", total);
+    if (append_object(&obj, length, n) < 0) {
+        return NULL;
+    }
+
+    // from the wall clock, so that blocks an earlier run left on the disk
+    // tier are not taken for this body's
+    obj->total = total;
+    obj->gen = wall_ms() << 16 | (atomic_fetch_add(&blocks_made, 1) & 0xffff);
+    return obj;
+}
+
+long block_len(const cache_obj_t *head, long index) {
+    long left = head->total - index * BLOCK_SIZE;
+    return left < BLOCK_SIZE ? left : BLOCK_SIZE;
+}
+
+cache_obj_t *find_block(cache_t *cache, const char *tag,
+                        const cache_obj_t *head, long index) {
+    char btag[BLOCK_TAG_LEN];
+    block_tag(btag, tag, head, index);
+    cache_obj_t *block = find_cache(cache, btag);
+    if (block != NULL && block->size != block_len(head, index)) {
+        release_object(block);
+        return NULL;
+    }
+    return block;
+}
+
+void insert_block(cache_t *cache, const char *tag, const cache_obj_t *head,
+                  long index, cache_obj_t *block, long cost) {
+    char btag[BLOCK_TAG_LEN];
+    block_tag(btag, tag, head, index);
+    insert_cache(cache, btag, block, cost);
+}
+
+void write_range_head(outvec_t *v, const char *head, size_t hdrlen,
+                      long total, long first, long last, int partial,
+                      long age, const char *xcache) {
+    const char *end = head + hdrlen;
+    const char *line = memchr(head, '\n', hdrlen);
+    if (line == NULL) {
+        return ;
+    }
+    line++;
+    if (partial) {
+        printf_outvec(v, "%.8s 206 Partial Content\r\n", head);
+    } else {
+        ref_outvec(v, head, line - head);
+    }
+
+    // unchanged lines go out from head, runs of them in one piece; an
+    // Age from an origin that is a cache itself adds to ours
+    const char *run = line;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL || eol - line <= 1) {
+            break;
+        }
+        int age_line = line_is(line, eol, "Age");
+        if (age_line || line_is(line, eol, "Content-Length") ||
+            line_is(line, eol, "Content-Range")) {
+            if (line > run) {
+                ref_outvec(v, run, line - run);
+            }
+            if (age_line) {
+                age += atol(memchr(line, ':', eol - line) + 1);
+            }
+            run = eol + 1;
+        }
+        line = eol + 1;
+    }
+    if (line > run) {
+        ref_outvec(v, run, line - run);
+    }
+
+    printf_outvec(v, "Content-Length: %ld\r\n", last - first + 1);
+    if (partial) {
+        printf_outvec(v, "Content-Range: bytes %ld-%ld/%ld\r\n",
+                      first, last, total);
+    }
+    printf_outvec(v, "Age: %ld\r\nX-Cache: %s\r\n\r\n", age, xcache);
+}
+
+void write_unsatisfiable(outvec_t *v, long total) {
+    printf_outvec(v, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                  "Content-Range: bytes */%ld\r\nContent-Length: 0\r\n"
+                  "X-Cache: HIT\r\n\r\n", total);
+}
+
+
+/* the header line [line, eol] is called name */
+int line_is(const char *line, const char *eol, const char *name) {
+    size_t n = strlen(name);
+    return eol - line > n && line[n] == ':' && !strncasecmp(line, name, n);
+}
+
+void block_tag(char *dst, const char *tag, const cache_obj_t *head,
+               long index) {
+    snprintf(dst, BLOCK_TAG_LEN, "%s#%lx.%ld", tag, head->gen, index);
+}
@@ -0,0 +1,51 @@
+/*
+ * blocks.h - large objects cached in fixed-size blocks
+ *
+ * A response too big for one cache object is cached as its header, under
+ * the URL's tag like any object, and its body as BLOCK_SIZE blocks, each
+ * an object of its own under the URL's tag, the header's generation and
+ * the block's index. Blocks are cached as a fetch passes over them and
+ * evicted one by one, so a client that reads part of a large file, or
+ * seeks in a video, leaves just those blocks behind. A later request is
+ * served from the blocks present, the others are fetched with a Range
+ * request. A new header (the object changed, or expired) comes with a
+ * new generation, so blocks of an older body are never mixed in.
+ */
+#ifndef __BLOCKS_H__
+#define __BLOCKS_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "outvec.h"
+
+#define BLOCK_SIZE 32768    /* more than an origin response header */
+#define BLOCK_TAG_LEN (MAXLINE + 48)
+
+/* the header object of a body of total bytes kept in blocks, made from
+ * an origin's 200 or 206 header (hdrlen bytes): a 200 for the whole body,
+ * with a new generation. The caller owns the only reference */
+cache_obj_t *create_blocks_head(const char *head, size_t hdrlen, long total);
+
+/* bytes in block index of the body */
+long block_len(const cache_obj_t *head, long index);
+
+/* pinned block index of the body of head, the object cached under tag;
+ * NULL if it is not cached */
+cache_obj_t *find_block(cache_t *cache, const char *tag,
+                        const cache_obj_t *head, long index);
+
+/* hand a block of block_len() bytes over to the cache, as insert_cache() */
+void insert_block(cache_t *cache, const char *tag, const cache_obj_t *head,
+                  long index, cache_obj_t *block, long cost);
+
+/* header of a cached response (hdrlen bytes of head, a 200 for a body of
+ * total bytes) sending body bytes [first, last] only: a 206 if partial,
+ * else the 200 itself. Gets Age and X-Cache: xcache; head stays put */
+void write_range_head(outvec_t *v, const char *head, size_t hdrlen,
+                      long total, long first, long last, int partial,
+                      long age, const char *xcache);
+
+/* the 416 for a range of a body of total bytes that starts past its end */
+void write_unsatisfiable(outvec_t *v, long total);
+
+#endif /* __BLOCKS_H__ */
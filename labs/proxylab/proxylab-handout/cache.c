@@ -0,0 +1,705 @@
+/*
+ * cache.c - sharded, hash-indexed CLOCK cache for the proxy
+ *
+ * A tag is hashed once; the hash picks the shard and the bucket inside
+ * that shard, so a lookup only walks one short chain instead of the whole
+ * cache. Every shard keeps its own share of MAX_CACHE_SIZE and is guarded
+ * by its own reader-writer lock.
+ *
+ * Replacement is CLOCK (second chance), which approximates LRU without
+ * reordering anything on a hit: readers only set node->referenced, and
+ * the writer's hand clears the bit once before a node may be evicted.
+ * Hits therefore stay on the reader side of the lock.
+ *
+ * GDSF keeps the same ring but evicts the node of lowest priority
+ * L + hits * cost / size among GDSF_SAMPLES nodes at the hand, where L is
+ * the shard's inflation, the priority of the last victim, so that objects
+ * that were popular long ago age out. A hit only bumps the node's counter
+ * and restamps its base with L, both plain atomic stores.
+ *
+ * TinyLFU admission counts every lookup, hit or miss, in a count-min
+ * sketch per shard, halved every SKETCH_RESET lookups. When an insert
+ * needs room, the victims are picked first and the new object only gets
+ * in if its estimated hits times its size, the bytes it would serve,
+ * beat those of the victims together; otherwise they all stay.
+ *
+ * The node owns one reference to its object and every hit takes another
+ * one before the reader lock is released. The last reference gives the
+ * object's chunk back to the arena, so victims that are still being sent
+ * hold on to their memory; an insert that finds no room in the arena
+ * keeps evicting until there is, or the shard is empty. The copy an
+ * insert replaces only goes once the new one has its chunk, so an insert
+ * that fails leaves the tag cached.
+ */
+#include "cache.h"
+#include "disk.h"
+
+#if SHARD_ARENA_SIZE < MAX_OBJECT_SIZE + SLAB_PAGE_SIZE
+#error "SHARD_CACHE_SIZE must be able to hold MAX_OBJECT_SIZE"
+#endif
+#if SHARD_ARENA_SIZE + SHARD_SPILL_SIZE > SLAB_MAX_PAGES * SLAB_PAGE_SIZE
+#error "SHARD_CACHE_SIZE is too large for a slab arena"
+#endif
+
+static cache_shard_t *get_shard(cache_t *cache, unsigned long hash);
+
+static void init_shard(cache_shard_t *shard, size_t arena);
+static void free_shard(cache_shard_t *shard);
+
+static cache_node_t *create_node(const char *tag, unsigned long hash,
+                                 size_t need, long cost);
+static void delete_node(cache_node_t *node);
+
+static cache_node_t *lookup_node(cache_shard_t *shard,
+                                 const char *tag, unsigned long hash);
+static void insert_node(cache_shard_t *shard, cache_node_t *node);
+static void remove_node(cache_shard_t *shard, cache_node_t *node);
+static cache_obj_t *place_node(cache_t *cache, cache_shard_t *shard,
+                               cache_node_t *node, size_t need);
+
+// choose the next victim of shard, skipping those already chosen
+static cache_node_t *choose_victim(cache_t *cache, cache_shard_t *shard);
+static void evict_node(cache_t *cache, cache_shard_t *shard,
+                       cache_node_t *node);
+static cache_node_t *choose_clock(cache_shard_t *shard);
+static cache_node_t *choose_gdsf(cache_shard_t *shard);
+static long node_priority(cache_node_t *node);
+
+// frequency sketch
+static void record_sketch(cache_shard_t *shard, unsigned long hash);
+static int estimate_sketch(cache_shard_t *shard, unsigned long hash);
+
+// writer model
+static void writer_prelogue(cache_shard_t *shard);
+static void writer_epilogue(cache_shard_t *shard);
+
+// reader model
+static void reader_prelogue(cache_shard_t *shard);
+static void reader_epilogue(cache_shard_t *shard);
+
+
+void init_cache(cache_t *cache, int eviction, int admission,
+                struct disk_t *disk) {
+    for (int i = 0; i < CACHE_SHARDS; ++i) {
+        init_shard(&cache->shards[i], disk != NULL ?
+                   SHARD_ARENA_SIZE + SHARD_SPILL_SIZE : SHARD_ARENA_SIZE);
+    }
+    cache->disk = disk;
+    cache->eviction = eviction;
+    cache->admission = admission;
+    atomic_init(&cache->lookups, 0);
+    atomic_init(&cache->hits, 0);
+    atomic_init(&cache->hit_bytes, 0);
+    atomic_init(&cache->inserts, 0);
+    atomic_init(&cache->insert_bytes, 0);
+    atomic_init(&cache->rejects, 0);
+    atomic_init(&cache->reject_bytes, 0);
+    atomic_init(&cache->evictions, 0);
+}
+
+void free_cache(cache_t *cache) {
+    for (int i = 0; i < CACHE_SHARDS; ++i) {
+        free_shard(&cache->shards[i]);
+    }
+}
+
+// reader
+cache_obj_t *find_cache(cache_t *cache, const char *tag) {
+    unsigned long hash = hash_tag(tag, strlen(tag));
+    cache_shard_t *shard = get_shard(cache, hash);
+    cache_obj_t *obj = NULL;
+
+    if (cache->admission) {
+        record_sketch(shard, hash);
+    }
+    atomic_fetch_add_explicit(&cache->lookups, 1, memory_order_relaxed);
+
+    reader_prelogue(shard);
+
+    cache_node_t *node = lookup_node(shard, tag, hash);
+    if (node != NULL) {
+        if (cache->eviction == EVICT_GDSF) {
+            atomic_fetch_add_explicit(&node->hits, 1, memory_order_relaxed);
+            atomic_store_explicit(&node->base, atomic_load_explicit(
+                &shard->inflation, memory_order_relaxed),
+                memory_order_relaxed);
+        } else if (!atomic_load_explicit(&node->referenced,
+                                         memory_order_relaxed)) {
+            // give it a second chance, skip the store if already set so
+            // hot objects don't bounce their cache line between cores
+            atomic_store_explicit(&node->referenced, 1, memory_order_relaxed);
+        }
+        // pin it, the node may be evicted as soon as we unlock
+        obj = node->obj;
+        atomic_fetch_add_explicit(&obj->refcnt, 1, memory_order_relaxed);
+    }
+
+    // release lock
+    reader_epilogue(shard);
+
+    if (obj == NULL && cache->disk != NULL) {
+        obj = find_disk(cache->disk, cache, tag);   // back into memory
+    }
+
+    if (obj != NULL) {
+        atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&cache->hit_bytes, obj->size,
+                                  memory_order_relaxed);
+    }
+    return obj;
+}
+
+void release_object(cache_obj_t *obj) {
+    if (atomic_fetch_sub_explicit(&obj->refcnt, 1,
+                                  memory_order_acq_rel) == 1) {
+        if (obj->slab != NULL) {
+            slab_free(obj->slab, obj, sizeof(cache_obj_t) + obj->capacity);
+        } else {
+            free(obj);
+        }
+    }
+}
+
+cache_obj_t *create_object(int capacity) {
+    if (capacity > MAX_OBJECT_SIZE) {
+        capacity = MAX_OBJECT_SIZE;
+    }
+    cache_obj_t *obj = (cache_obj_t*) Malloc(sizeof(cache_obj_t) + capacity);
+    atomic_init(&obj->refcnt, 1);
+    obj->size = 0;
+    obj->capacity = capacity;
+    obj->slab = NULL;
+    atomic_init(&obj->expires, 0);
+    atomic_init(&obj->date, 0);
+    obj->ttl = -1;
+    obj->swr = 0;
+    atomic_init(&obj->refreshing, 0);
+    obj->total = obj->gen = 0;
+    return obj;
+}
+
+int reserve_object(cache_obj_t **objp, int need) {
+    cache_obj_t *obj = *objp;
+    if (need <= obj->capacity) {
+        return 0;
+    }
+    if (need > MAX_OBJECT_SIZE || need < 0) {
+        release_object(obj);
+        return -1;
+    }
+    // grow geometrically so that appending stays cheap
+    int capacity = 2 * obj->capacity;
+    if (capacity < need) {
+        capacity = need;
+    }
+    if (capacity > MAX_OBJECT_SIZE) {
+        capacity = MAX_OBJECT_SIZE;
+    }
+    // nobody else sees the object before it is inserted
+    obj = (cache_obj_t*) Realloc(obj, sizeof(cache_obj_t) + capacity);
+    obj->capacity = capacity;
+    *objp = obj;
+    return 0;
+}
+
+int append_object(cache_obj_t **objp, const char *buf, int n) {
+    if (reserve_object(objp, (*objp)->size + n) < 0) {
+        return -1;
+    }
+    memcpy((*objp)->data + (*objp)->size, buf, n);
+    (*objp)->size += n;
+    return 0;
+}
+
+// writer
+void insert_cache(cache_t *cache, const char *tag, cache_obj_t *obj,
+                  long cost) {
+    // whether or not the new version fits, the disk's is out of date
+    if (cache->disk != NULL) {
+        forget_disk(cache->disk, tag);
+    }
+    cache_obj_t *copy = copy_cache(cache, tag, obj, obj->data, obj->size,
+                                   cost);
+    if (copy != NULL) {
+        release_object(copy);
+    } else if (cache->disk != NULL) {
+        // no room while victims wait for the disk: the object follows
+        // them there from the heap, a later miss promotes it
+        spill_disk(cache->disk, tag, obj, cost);
+    }
+    release_object(obj);
+}
+
+cache_obj_t *copy_cache(cache_t *cache, const char *tag,
+                        const cache_obj_t *meta, const char *data, int size,
+                        long cost) {
+    unsigned long hash = hash_tag(tag, strlen(tag));
+    cache_shard_t *shard = get_shard(cache, hash);
+    if (size > MAX_OBJECT_SIZE) {
+        return NULL;
+    }
+    size_t need = sizeof(cache_obj_t) + size;
+    cache_node_t *node = create_node(tag, hash, need, cost);
+
+    writer_prelogue(shard);
+
+    // filled in before readers can see it
+    cache_obj_t *copy = place_node(cache, shard, node, need);
+    if (copy != NULL) {
+        copy->size = size;
+        atomic_store(&copy->expires, atomic_load(&meta->expires));
+        atomic_store(&copy->date, atomic_load(&meta->date));
+        copy->ttl = meta->ttl;
+        copy->swr = meta->swr;
+        copy->total = meta->total;
+        copy->gen = meta->gen;
+        memcpy(copy->data, data, size);
+        atomic_fetch_add(&copy->refcnt, 1);     // the caller's
+    }
+
+    writer_epilogue(shard);
+
+    if (copy != NULL) {
+        atomic_fetch_add_explicit(&cache->inserts, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&cache->insert_bytes, size,
+                                  memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&cache->rejects, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&cache->reject_bytes, size,
+                                  memory_order_relaxed);
+        free(node->tag);
+        free(node);
+    }
+    return copy;
+}
+
+// writer
+void remove_cache(cache_t *cache, const char *tag) {
+    unsigned long hash = hash_tag(tag, strlen(tag));
+    cache_shard_t *shard = get_shard(cache, hash);
+
+    writer_prelogue(shard);
+    cache_node_t *node = lookup_node(shard, tag, hash);
+    if (node != NULL) {
+        remove_node(shard, node);
+        delete_node(node);
+    }
+    writer_epilogue(shard);
+
+    // after the shard's lock, which comes second to the disk's
+    if (cache->disk != NULL) {
+        forget_disk(cache->disk, tag);
+    }
+}
+
+long wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+void print_cache_stats(cache_t *cache) {
+    long lookups = atomic_load(&cache->lookups);
+    long hits = atomic_load(&cache->hits);
+    long hit_bytes = atomic_load(&cache->hit_bytes);
+    long fetched = atomic_load(&cache->insert_bytes) +
+        atomic_load(&cache->reject_bytes);
+
+    fprintf(stderr, "cache (%s%s): %ld lookups, %ld hits (%.1f%%), "
+            "%ld bytes hit (%.1f%% of cacheable bytes)\n",
+            cache->eviction == EVICT_GDSF ? "gdsf" : "clock",
+            cache->admission ? "+tinylfu" : "",
+            lookups, hits, lookups ? 100.0 * hits / lookups : 0.0,
+            hit_bytes, hit_bytes + fetched ?
+            100.0 * hit_bytes / (hit_bytes + fetched) : 0.0);
+    fprintf(stderr, "cache: %ld inserted, %ld rejected, %ld evicted\n",
+            atomic_load(&cache->inserts), atomic_load(&cache->rejects),
+            atomic_load(&cache->evictions));
+
+    slab_stats_t stats[SLAB_CLASSES + 1];
+    memset(stats, 0, sizeof(stats));
+    long pages = 0;
+    for (int i = 0; i < CACHE_SHARDS; ++i) {
+        sum_slab_stats(&cache->shards[i].slab, stats);
+    }
+    for (int i = 0; i <= SLAB_CLASSES; ++i) {
+        pages += stats[i].pages;
+    }
+    if (cache->disk != NULL) {
+        print_disk_stats(cache->disk);
+    }
+    fprintf(stderr, "cache memory: %ld of %ld pages in use\n",
+            pages, (long)CACHE_SHARDS * cache->shards[0].slab.npages);
+    for (int i = 0; i <= SLAB_CLASSES; ++i) {
+        if (stats[i].pages == 0) {
+            continue;
+        }
+        if (i == SLAB_RUN) {
+            fprintf(stderr, "  page runs: ");
+        } else {
+            fprintf(stderr, "  %9zu: ", slab_class_size(i));
+        }
+        fprintf(stderr, "%ld objects, %ld pages, %ld bytes in %ld\n",
+                stats[i].live, stats[i].pages, stats[i].bytes,
+                stats[i].footprint);
+    }
+}
+
+
+/* FNV-1a, then mixed so that the high bits choosing the shard depend
+ * on the end of the tag too; URLs often differ only there */
+unsigned long hash_tag(const char *tag, size_t len) {
+    unsigned long hash = 14695981039346656037UL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)tag[i];
+        hash *= 1099511628211UL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdUL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+cache_shard_t *get_shard(cache_t *cache, unsigned long hash) {
+    // high bits choose the shard, low bits the bucket
+    return &cache->shards[(hash >> 32) % CACHE_SHARDS];
+}
+
+void init_shard(cache_shard_t *shard, size_t arena) {
+    memset(shard->buckets, 0, sizeof(shard->buckets));
+    shard->sentinel = (cache_node_t*) Malloc(sizeof(cache_node_t));
+    shard->sentinel->next = shard->sentinel;
+    shard->sentinel->prev = shard->sentinel;
+    shard->hand = shard->sentinel;
+    shard->total_size = 0;
+    init_slab(&shard->slab, arena);
+    atomic_init(&shard->inflation, 0);
+    for (int i = 0; i < SKETCH_DEPTH; ++i) {
+        for (int j = 0; j < SKETCH_WIDTH; ++j) {
+            atomic_init(&shard->sketch[i][j], 0);
+        }
+    }
+    atomic_init(&shard->samples, 0);
+    shard->rcnt = 0;
+    shard->wcnt = 0;
+    Sem_init(&shard->rlock, 0, 1);
+    Sem_init(&shard->rcntlock, 0, 1);
+    Sem_init(&shard->wlock, 0, 1);
+    Sem_init(&shard->wcntlock, 0, 1);
+}
+
+void free_shard(cache_shard_t *shard) {
+    writer_prelogue(shard);
+    while (shard->sentinel->next != shard->sentinel) {
+        cache_node_t *node = shard->sentinel->next;
+        remove_node(shard, node);
+        delete_node(node);
+    }
+    writer_epilogue(shard);
+    free(shard->sentinel);
+}
+
+// a node for an object of need bytes, which place_node() gives it
+cache_node_t *create_node(const char *tag, unsigned long hash,
+                          size_t need, long cost) {
+    cache_node_t *node = (cache_node_t*) Malloc(sizeof(cache_node_t));
+    node->obj = NULL;
+    node->size = slab_footprint(need);
+    node->tag = (char*) Malloc(strlen(tag) + 1);
+    strcpy(node->tag, tag);
+    node->hash = hash;
+    node->next = NULL;
+    node->prev = NULL;
+    node->hnext = NULL;
+    atomic_init(&node->referenced, 0);
+    atomic_init(&node->hits, 1);
+    atomic_init(&node->base, 0);
+    node->cost = cost > 0 ? cost : 1;
+    node->vnext = NULL;
+    node->victim = 0;
+    return node;
+}
+
+void delete_node(cache_node_t *node) {
+    release_object(node->obj);  // readers may still hold it
+    free(node->tag);
+    free(node);
+}
+
+cache_node_t *lookup_node(cache_shard_t *shard,
+                          const char *tag, unsigned long hash) {
+    cache_node_t *node = shard->buckets[hash % CACHE_BUCKETS];
+    while (node != NULL) {
+        if (node->hash == hash && !strcmp(node->tag, tag)) {
+            return node;
+        }
+        node = node->hnext;
+    }
+    return NULL;
+}
+
+// add node to hash index, just behind the CLOCK hand so that it is
+// the last one to be considered for eviction
+void insert_node(cache_shard_t *shard, cache_node_t *node) {
+    cache_node_t **bucket = &shard->buckets[node->hash % CACHE_BUCKETS];
+    node->hnext = *bucket;
+    *bucket = node;
+
+    node->next = shard->hand;
+    node->prev = shard->hand->prev;
+    shard->hand->prev->next = node;
+    shard->hand->prev = node;
+    shard->total_size += node->size;
+}
+
+// drop node from hash index and CLOCK ring
+void remove_node(cache_shard_t *shard, cache_node_t *node) {
+    cache_node_t **pp = &shard->buckets[node->hash % CACHE_BUCKETS];
+    while (*pp != node) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = node->hnext;
+
+    if (shard->hand == node) {
+        shard->hand = node->next;
+    }
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    shard->total_size -= node->size;
+}
+
+// caller holds the writer lock; the node goes in the shard with an object
+// in the arena, of need bytes with only its header set, which it returns;
+// NULL if the node is not admitted
+cache_obj_t *place_node(cache_t *cache, cache_shard_t *shard,
+                        cache_node_t *node, size_t need) {
+    // a newer copy replaces the cached one, which stays until the new one
+    // has its memory; its room counts as free, it is no victim
+    cache_node_t *old = lookup_node(shard, node->tag, node->hash);
+    long freed = 0;
+    if (old != NULL) {
+        old->victim = 1;
+        freed = old->size;
+    }
+
+    // pick as many victims as it takes to make room
+    cache_node_t *victims = NULL;
+    long victim_weight = 0;
+    while (shard->total_size - freed + node->size > SHARD_ARENA_SIZE) {
+        cache_node_t *v = choose_victim(cache, shard);
+        v->victim = 1;
+        v->vnext = victims;
+        victims = v;
+        freed += v->size;
+        if (cache->admission) {
+            victim_weight += (long)estimate_sketch(shard, v->hash) * v->size;
+        }
+    }
+
+    int admit = victims == NULL || !cache->admission || old != NULL ||
+        (long)estimate_sketch(shard, node->hash) * node->size > victim_weight;
+    while (victims != NULL) {
+        cache_node_t *v = victims;
+        victims = v->vnext;
+        v->victim = 0;
+        if (admit) {
+            evict_node(cache, shard, v);
+        }
+    }
+
+    // victims still being sent or spilled keep their chunks, and the free
+    // pages may not be in one run: evict more until the arena has room.
+    // The old copy goes first if nobody else holds it, its chunk is what
+    // the new one takes the place of
+    cache_obj_t *obj = NULL;
+    while (admit && (obj = slab_alloc(&shard->slab, need)) == NULL) {
+        if (old != NULL && atomic_load(&old->obj->refcnt) == 1) {
+            remove_node(shard, old);
+            delete_node(old);
+            old = NULL;
+        } else if (shard->total_size > (old != NULL ? old->size : 0)) {
+            evict_node(cache, shard, choose_victim(cache, shard));
+        } else {
+            break;
+        }
+    }
+    if (old != NULL) {
+        old->victim = 0;
+        if (obj != NULL) {
+            remove_node(shard, old);
+            delete_node(old);
+        }
+    }
+    if (obj == NULL) {
+        return NULL;
+    }
+    atomic_init(&obj->refcnt, 1);
+    obj->size = 0;
+    obj->capacity = need - sizeof(cache_obj_t);
+    obj->slab = &shard->slab;
+    atomic_init(&obj->expires, 0);
+    atomic_init(&obj->date, 0);
+    obj->ttl = -1;
+    obj->swr = 0;
+    atomic_init(&obj->refreshing, 0);
+    obj->total = obj->gen = 0;
+
+    node->obj = obj;
+    atomic_init(&node->base, atomic_load_explicit(&shard->inflation,
+                                                  memory_order_relaxed));
+    insert_node(shard, node);
+    return obj;
+}
+
+// caller holds the writer lock and the shard has a node not chosen yet
+cache_node_t *choose_victim(cache_t *cache, cache_shard_t *shard) {
+    return cache->eviction == EVICT_GDSF ?
+        choose_gdsf(shard) : choose_clock(shard);
+}
+
+void evict_node(cache_t *cache, cache_shard_t *shard, cache_node_t *node) {
+    if (cache->eviction == EVICT_GDSF) {
+        long prio = node_priority(node);
+        if (prio > atomic_load_explicit(&shard->inflation,
+                                        memory_order_relaxed)) {
+            atomic_store_explicit(&shard->inflation, prio,
+                                  memory_order_relaxed);
+        }
+    }
+    if (cache->disk != NULL) {
+        spill_disk(cache->disk, node->tag, node->obj, node->cost);
+    }
+    remove_node(shard, node);
+    delete_node(node);
+    atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+}
+
+cache_node_t *choose_clock(cache_shard_t *shard) {
+    while (1) {
+        cache_node_t *node = shard->hand;
+        shard->hand = node->next;
+        if (node == shard->sentinel || node->victim) {
+            continue;
+        }
+        if (atomic_load_explicit(&node->referenced, memory_order_relaxed)) {
+            // used since the hand last passed, second chance
+            atomic_store_explicit(&node->referenced, 0, memory_order_relaxed);
+            continue;
+        }
+        return node;
+    }
+}
+
+// lowest priority of the next GDSF_SAMPLES nodes at the hand, which moves
+// past them so that the following victim is sampled elsewhere
+cache_node_t *choose_gdsf(cache_shard_t *shard) {
+    cache_node_t *best = NULL;
+    long best_prio = 0;
+    cache_node_t *start = shard->hand;
+    int sampled = 0;
+    do {
+        cache_node_t *node = shard->hand;
+        shard->hand = node->next;
+        if (node == shard->sentinel || node->victim) {
+            continue;
+        }
+        long prio = node_priority(node);
+        if (best == NULL || prio < best_prio) {
+            best = node;
+            best_prio = prio;
+        }
+        ++sampled;
+    } while (sampled < GDSF_SAMPLES && shard->hand != start);
+    return best;
+}
+
+long node_priority(cache_node_t *node) {
+    long hits = atomic_load_explicit(&node->hits, memory_order_relaxed);
+    long size = node->size > 0 ? node->size : 1;
+    return atomic_load_explicit(&node->base, memory_order_relaxed) +
+        hits * node->cost * GDSF_SCALE / size;
+}
+
+// one counter per row, rows indexed by double hashing
+#define SKETCH_INDEX(hash, i) \
+    (((hash) + (i) * (((hash) >> 17) | 1)) % SKETCH_WIDTH)
+
+void record_sketch(cache_shard_t *shard, unsigned long hash) {
+    for (int i = 0; i < SKETCH_DEPTH; ++i) {
+        atomic_uchar *ctr = &shard->sketch[i][SKETCH_INDEX(hash, i)];
+        unsigned char v = atomic_load_explicit(ctr, memory_order_relaxed);
+        // a lost update under a race only makes the estimate a bit low
+        if (v < SKETCH_MAX) {
+            atomic_store_explicit(ctr, v + 1, memory_order_relaxed);
+        }
+    }
+    if (atomic_fetch_add_explicit(&shard->samples, 1, memory_order_relaxed)
+        + 1 == SKETCH_RESET) {
+        // age: halve everything so old popularity fades
+        for (int i = 0; i < SKETCH_DEPTH; ++i) {
+            for (int j = 0; j < SKETCH_WIDTH; ++j) {
+                atomic_uchar *ctr = &shard->sketch[i][j];
+                atomic_store_explicit(ctr, atomic_load_explicit(
+                    ctr, memory_order_relaxed) / 2, memory_order_relaxed);
+            }
+        }
+        atomic_store_explicit(&shard->samples, 0, memory_order_relaxed);
+    }
+}
+
+int estimate_sketch(cache_shard_t *shard, unsigned long hash) {
+    int est = SKETCH_MAX;
+    for (int i = 0; i < SKETCH_DEPTH; ++i) {
+        int v = atomic_load_explicit(&shard->sketch[i][SKETCH_INDEX(hash, i)],
+                                     memory_order_relaxed);
+        if (v < est) {
+            est = v;
+        }
+    }
+    return est;
+}
+
+
+void writer_prelogue(cache_shard_t *shard) {
+    P(&shard->wcntlock); // get lock for wcnt
+    if (shard->wcnt == 0) { // first writer
+        P(&shard->rlock); // block later reader
+    }
+    shard->wcnt++;
+    V(&shard->wcntlock); // release wcntlock for next writer enter
+
+    P(&shard->wlock); // single writer can write
+}
+
+void writer_epilogue(cache_shard_t *shard) {
+    V(&shard->wlock); // writer done
+
+    P(&shard->wcntlock);
+    shard->wcnt--;
+    if (shard->wcnt == 0) { // last writer, release lock for reader
+        V(&shard->rlock);
+    }
+    V(&shard->wcntlock);
+}
+
+void reader_prelogue(cache_shard_t *shard) {
+    P(&shard->rlock); // first get rlock, if there exist one or more
+                     // writer, blocked
+
+    P(&shard->rcntlock);
+    if (shard->rcnt == 0) {  // first reader, block writing
+        P(&shard->wlock);
+    }
+    shard->rcnt++;
+    V(&shard->rcntlock);
+    V(&shard->rlock); // release rlock for reading
+}
+
+void reader_epilogue(cache_shard_t *shard) {
+    P(&shard->rcntlock);
+    shard->rcnt--;
+    if (shard->rcnt == 0) { // last reader, release wlock for writing
+        V(&shard->wlock);
+    }
+    V(&shard->rcntlock);
+}
@@ -0,0 +1,180 @@
+/*
+ * cache.h - web object cache used by the proxy
+ *
+ * Objects are keyed by their request tag (host:port/path). The cache is
+ * split into CACHE_SHARDS independently locked shards, each with its own
+ * hash index and its own CLOCK ring, so workers hitting different objects
+ * don't contend on a single lock. A hit only sets the object's reference
+ * bit, so lookups never modify the shard structure.
+ *
+ * Cached objects are immutable and reference counted: a hit pins the
+ * object and the caller releases it after sending, so eviction only drops
+ * the cache's reference and never frees a buffer that is still being sent.
+ * Objects are built on the heap and copied into the shard's slab arena
+ * when inserted, and a shard is charged what the arena gives up for them.
+ * With a disk tier, victims go there and misses look there before the
+ * origin; victims waiting to be written take the arena's spill room.
+ *
+ * The policy is chosen at startup: eviction by CLOCK or by GDSF (greedy
+ * dual size frequency, weighing hits, size and refetch cost), optionally
+ * behind a TinyLFU admission filter that only lets in objects more
+ * popular than the ones they would push out.
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdatomic.h>
+
+#include "csapp.h"
+#include "slab.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+#define CACHE_SHARDS 8      /* number of independently locked shards */
+#define CACHE_BUCKETS 64    /* hash chains per shard */
+
+/* every shard must be able to hold the largest cacheable object */
+#define SHARD_CACHE_SIZE (MAX_CACHE_SIZE / CACHE_SHARDS)
+#define SHARD_ARENA_SIZE (SHARD_CACHE_SIZE / SLAB_PAGE_SIZE * SLAB_PAGE_SIZE)
+/* with a disk tier, victims keep their chunks until they are written:
+ * the arena has this much room on top for them, so the cache takes up to
+ * 5/4 of MAX_CACHE_SIZE. An insert that finds no room meanwhile goes to
+ * the disk from the heap instead */
+#define SHARD_SPILL_SIZE (SHARD_ARENA_SIZE / 4 / SLAB_PAGE_SIZE * SLAB_PAGE_SIZE)
+
+#define SKETCH_DEPTH 4      /* rows of the frequency sketch */
+#define SKETCH_WIDTH 4096   /* counters per row, per shard */
+#define SKETCH_MAX 15       /* counters saturate here */
+#define SKETCH_RESET (8 * SKETCH_WIDTH)  /* lookups before counters halve */
+#define GDSF_SAMPLES 8      /* eviction candidates compared per victim */
+#define GDSF_SCALE 1000000L /* fixed point for cost / size */
+
+enum cache_eviction {
+    EVICT_CLOCK,
+    EVICT_GDSF,
+};
+
+/* length-prefixed cached response, immutable once inserted except for
+ * its freshness, which a revalidation extends */
+struct cache_obj_t {
+    atomic_int refcnt;
+    int size;       // bytes of data in use
+    int capacity;   // bytes of data allocated
+    slab_t *slab;   // arena it lives in, NULL while on the heap
+
+    atomic_long expires;    // wall clock ms it is fresh until, 0: for good
+    atomic_long date;       // wall clock ms the origin last vouched for it
+    long ttl;               // ms of freshness a revalidation gives
+    long swr;               // ms it may be served stale while refreshed
+    atomic_int refreshing;  // a background revalidation is on its way
+
+    // a header whose body is kept in blocks, see blocks.h, else 0
+    long total;             // bytes of the body
+    long gen;               // what the tags of its blocks carry
+    char data[];
+};
+typedef struct cache_obj_t cache_obj_t;
+
+struct cache_node_t {
+    struct cache_node_t *next;   // CLOCK ring
+    struct cache_node_t *prev;
+    struct cache_node_t *hnext;  // hash chain
+    cache_obj_t *obj;
+    char *tag;
+    unsigned long hash;
+    int size;                    // bytes of the arena it takes
+    atomic_int referenced;       // second-chance bit, set by readers
+
+    // GDSF: priority is base + hits * cost / size
+    atomic_int hits;
+    atomic_long base;            // shard's inflation at the last hit
+    long cost;                   // ms it took to fetch
+
+    struct cache_node_t *vnext;  // victims chosen for an insert
+    int victim;
+};
+typedef struct cache_node_t cache_node_t;
+
+struct cache_shard_t {
+    cache_node_t *buckets[CACHE_BUCKETS];
+    cache_node_t *sentinel;
+    cache_node_t *hand;          // next eviction candidate of the CLOCK
+    int total_size;
+    slab_t slab;                 // where the objects live
+    atomic_long inflation;       // GDSF: priority of the last victim
+
+    // TinyLFU: count-min sketch of recent lookups
+    atomic_uchar sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+    atomic_int samples;
+
+    // used for reader-writer model, writer preference
+    int rcnt;
+    int wcnt;
+    sem_t rlock;
+    sem_t rcntlock;
+    sem_t wlock;
+    sem_t wcntlock;
+};
+typedef struct cache_shard_t cache_shard_t;
+
+struct disk_t;
+
+struct cache_t {
+    cache_shard_t shards[CACHE_SHARDS];
+    struct disk_t *disk;         // second tier, or NULL
+    int eviction;                // enum cache_eviction
+    int admission;               // TinyLFU filter in front
+
+    // to compare policies, hit bytes against fetched cacheable bytes
+    atomic_long lookups, hits, hit_bytes;
+    atomic_long inserts, insert_bytes;
+    atomic_long rejects, reject_bytes;
+    atomic_long evictions;
+};
+typedef struct cache_t cache_t;
+
+void init_cache(cache_t *cache, int eviction, int admission,
+                struct disk_t *disk);
+void free_cache(cache_t *cache);
+
+/* return the pinned object of tag, or NULL on a miss; the caller must
+ * release_object() it when done. A hit on the disk tier is promoted */
+cache_obj_t *find_cache(cache_t *cache, const char *tag);
+void release_object(cache_obj_t *obj);
+
+/* build an object while the response arrives; the caller owns the only
+ * reference. reserve_object() makes room for need bytes in total; both
+ * return -1 and release the object once it would exceed MAX_OBJECT_SIZE */
+cache_obj_t *create_object(int capacity);
+int reserve_object(cache_obj_t **objp, int need);
+int append_object(cache_obj_t **objp, const char *buf, int n);
+
+/* insert (or replace) the object of tag, evicting objects of its shard;
+ * cost is what a refetch would take (ms). The caller's reference is handed
+ * over to the cache, which may also decline the object */
+void insert_cache(cache_t *cache, const char *tag, cache_obj_t *obj,
+                  long cost);
+
+/* as insert_cache(), with the object copied from size bytes of data and
+ * the freshness and blocks fields of meta, whose own data is not read:
+ * the cached copy, pinned for the caller, or NULL if it is declined */
+cache_obj_t *copy_cache(cache_t *cache, const char *tag,
+                        const cache_obj_t *meta, const char *data, int size,
+                        long cost);
+
+/* drop the object of tag, from the disk tier too: the origin no longer
+ * lets it be kept */
+void remove_cache(cache_t *cache, const char *tag);
+
+/* hash of len bytes of tag, for the cache's index and the others */
+unsigned long hash_tag(const char *tag, size_t len);
+
+/* ms since the epoch; freshness must survive a restart in the disk tier */
+long wall_ms(void);
+
+/* policy and memory counters to stderr */
+void print_cache_stats(cache_t *cache);
+
+#endif /* __CACHE_H__ */
@@ -64,7 +64,7 @@ extern char **environ; /* Defined by libc */
 void unix_error(char *msg);
 void posix_error(int code, char *msg);
 void dns_error(char *msg);
-void gai_error(int code, char *msg);
+void getaddrinfo_error(int code, char *msg);
 void app_error(char *msg);
 
 /* Process control wrappers */
@@ -0,0 +1,452 @@
+/*
+ * disk.c - second cache tier in memory-mapped segment files
+ *
+ * Only the writer thread appends, so the current segment and offset are
+ * its own. Before a segment is started over, its entries leave the index
+ * under the lock; a lookup copies its record while holding the lock, so
+ * no record is overwritten while it is being read. Lock order: disk->lock
+ * before the writer lock of a cache shard, which a hit copies itself into,
+ * and before qlock, which forget_disk() takes to reach queued spills.
+ */
+#include "disk.h"
+
+#define REC_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+static uint32_t checksum(const char *tag, size_t taglen,
+                         const char *data, size_t len);
+static disk_entry_t *lookup_entry(disk_t *disk, const char *tag,
+                                  unsigned long hash);
+static void put_entry(disk_t *disk, const char *tag, size_t taglen,
+                      int seg, size_t off, const disk_rec_t *rec);
+static int drop_entry(disk_t *disk, const char *tag, size_t taglen);
+static void drop_segment(disk_t *disk, int seg);
+static size_t scan_segment(disk_t *disk, int seg);
+static void start_segment(disk_t *disk, int seg);
+static void *writer_func(void *arg);
+static void write_spill(disk_t *disk, disk_spill_t *s);
+static void write_deletion(disk_t *disk, const char *tag);
+static void entry_freshness(cache_obj_t *obj, const disk_entry_t *e);
+
+void init_disk(disk_t *disk, const char *dir) {
+    memset(disk->buckets, 0, sizeof(disk->buckets));
+    disk->nentries = 0;
+    Sem_init(&disk->lock, 0, 1);
+    disk->queue_head = disk->queue_tail = NULL;
+    disk->queued_cnt = 0;
+    disk->writing = NULL;
+    Sem_init(&disk->qlock, 0, 1);
+    Sem_init(&disk->queued, 0, 0);
+    atomic_init(&disk->hits, 0);
+    atomic_init(&disk->misses, 0);
+    atomic_init(&disk->written, 0);
+    atomic_init(&disk->dropped, 0);
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        unix_error("mkdir error");
+    }
+    int order[DISK_SEGMENTS];
+    for (int i = 0; i < DISK_SEGMENTS; ++i) {
+        char path[MAXLINE];
+        snprintf(path, sizeof(path), "%s/segment-%02d", dir, i);
+        disk_seg_t *seg = &disk->segs[i];
+        seg->fd = Open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct stat st;
+        Fstat(seg->fd, &st);
+        if (st.st_size < DISK_SEGMENT_SIZE &&
+            ftruncate(seg->fd, DISK_SEGMENT_SIZE) < 0) {
+            unix_error("ftruncate error");
+        }
+        seg->map = Mmap(NULL, DISK_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, seg->fd, 0);
+        disk_seg_header_t *hdr = (disk_seg_header_t*)seg->map;
+        seg->seq = hdr->magic == DISK_SEG_MAGIC ? hdr->seq : 0;
+
+        // keep order sorted by seq, oldest first
+        int j = i;
+        while (j > 0 && disk->segs[order[j - 1]].seq > seg->seq) {
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = i;
+    }
+
+    // replay oldest first so that newer copies of a tag win; the newest
+    // segment is where appending resumes
+    disk->cur = -1;
+    disk->seq = 0;
+    for (int i = 0; i < DISK_SEGMENTS; ++i) {
+        int s = order[i];
+        if (disk->segs[s].seq == 0) {
+            continue;
+        }
+        disk->woff = scan_segment(disk, s);
+        disk->cur = s;
+        disk->seq = disk->segs[s].seq;
+    }
+    if (disk->cur < 0) {
+        start_segment(disk, 0);
+    }
+    fprintf(stderr, "disk cache: %d objects in %s\n", disk->nentries, dir);
+
+    pthread_t tid;
+    Pthread_create(&tid, NULL, writer_func, disk);
+}
+
+void spill_disk(disk_t *disk, const char *tag, cache_obj_t *obj, long cost) {
+    P(&disk->qlock);
+    if (disk->queued_cnt >= DISK_MAX_QUEUE) {
+        // the disk can't keep up, don't hold ever more memory for it
+        V(&disk->qlock);
+        atomic_fetch_add(&disk->dropped, 1);
+        return ;
+    }
+    // pinned, not copied under the shard's lock: the writer copies it
+    // into the mapping and lets go of its chunk
+    disk_spill_t *s = (disk_spill_t*) Malloc(sizeof(disk_spill_t));
+    s->tag = strdup(tag);
+    s->obj = obj;
+    atomic_fetch_add(&obj->refcnt, 1);
+    s->cost = cost;
+    s->forgotten = 0;
+    s->next = NULL;
+    if (disk->queue_tail != NULL) {
+        disk->queue_tail->next = s;
+    } else {
+        disk->queue_head = s;
+    }
+    disk->queue_tail = s;
+    disk->queued_cnt++;
+    V(&disk->qlock);
+    V(&disk->queued);
+}
+
+void forget_disk(disk_t *disk, const char *tag) {
+    P(&disk->lock);
+    int indexed = drop_entry(disk, tag, strlen(tag));
+
+    // older copies on their way to the disk stay out of the index, and
+    // the log gets a record that voids what it holds of the tag. That one
+    // holds no memory, the queue takes it when full too
+    P(&disk->qlock);
+    for (disk_spill_t *s = disk->queue_head; s != NULL; s = s->next) {
+        if (s->obj != NULL && !strcmp(s->tag, tag)) {
+            s->forgotten = 1;
+        }
+    }
+    if (disk->writing != NULL && !strcmp(disk->writing->tag, tag)) {
+        disk->writing->forgotten = 1;
+    }
+    if (indexed) {
+        disk_spill_t *s = (disk_spill_t*) Malloc(sizeof(disk_spill_t));
+        s->tag = strdup(tag);
+        s->obj = NULL;
+        s->cost = 0;
+        s->forgotten = 0;
+        s->next = NULL;
+        if (disk->queue_tail != NULL) {
+            disk->queue_tail->next = s;
+        } else {
+            disk->queue_head = s;
+        }
+        disk->queue_tail = s;
+        disk->queued_cnt++;
+    }
+    V(&disk->qlock);
+    V(&disk->lock);
+    if (indexed) {
+        V(&disk->queued);
+    }
+}
+
+cache_obj_t *find_disk(disk_t *disk, cache_t *cache, const char *tag) {
+    unsigned long hash = hash_tag(tag, strlen(tag));
+
+    P(&disk->lock);
+    disk_entry_t *e = lookup_entry(disk, tag, hash);
+    if (e == NULL) {
+        V(&disk->lock);
+        atomic_fetch_add(&disk->misses, 1);
+        return NULL;
+    }
+    const disk_rec_t *rec =
+        (const disk_rec_t*)(disk->segs[e->seg].map + e->off);
+    const char *data = (const char*)(rec + 1) + rec->taglen;
+
+    // straight from the mapping into the cache's arena
+    cache_obj_t meta;
+    entry_freshness(&meta, e);
+    cache_obj_t *obj = copy_cache(cache, tag, &meta, data, e->len, e->cost);
+    if (obj == NULL) {
+        // declined, the client gets a copy of its own
+        obj = create_object(e->len);
+        memcpy(obj->data, data, e->len);
+        obj->size = e->len;
+        entry_freshness(obj, e);
+    }
+    V(&disk->lock);
+
+    atomic_fetch_add(&disk->hits, 1);
+    return obj;
+}
+
+void print_disk_stats(disk_t *disk) {
+    P(&disk->lock);
+    int n = disk->nentries;
+    V(&disk->lock);
+    fprintf(stderr, "disk cache: %d objects, %ld hits, %ld misses, "
+            "%ld written, %ld dropped\n", n, atomic_load(&disk->hits),
+            atomic_load(&disk->misses), atomic_load(&disk->written),
+            atomic_load(&disk->dropped));
+}
+
+
+void entry_freshness(cache_obj_t *obj, const disk_entry_t *e) {
+    atomic_init(&obj->expires, e->expires);
+    atomic_init(&obj->date, e->date);
+    obj->ttl = e->ttl;
+    obj->swr = e->swr;
+    obj->total = e->total;
+    obj->gen = e->gen;
+}
+
+uint32_t checksum(const char *tag, size_t taglen,
+                  const char *data, size_t len) {
+    uint32_t sum = 2166136261U;
+    for (size_t i = 0; i < taglen; ++i) {
+        sum = (sum ^ (unsigned char)tag[i]) * 16777619U;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        sum = (sum ^ (unsigned char)data[i]) * 16777619U;
+    }
+    return sum;
+}
+
+// caller holds disk->lock
+disk_entry_t *lookup_entry(disk_t *disk, const char *tag,
+                           unsigned long hash) {
+    disk_entry_t *e = disk->buckets[hash % DISK_BUCKETS];
+    while (e != NULL) {
+        if (e->hash == hash && !strcmp(e->tag, tag)) {
+            return e;
+        }
+        e = e->next;
+    }
+    return NULL;
+}
+
+// caller holds disk->lock; the record is the newest copy of its tag
+void put_entry(disk_t *disk, const char *tag, size_t taglen,
+               int seg, size_t off, const disk_rec_t *rec) {
+    unsigned long hash = hash_tag(tag, taglen);
+    disk_entry_t **bucket = &disk->buckets[hash % DISK_BUCKETS];
+    disk_entry_t *e;
+    for (e = *bucket; e != NULL; e = e->next) {
+        if (e->hash == hash && strlen(e->tag) == taglen &&
+            !memcmp(e->tag, tag, taglen)) {
+            break;
+        }
+    }
+    if (e == NULL) {
+        e = (disk_entry_t*) Malloc(sizeof(disk_entry_t));
+        e->tag = strndup(tag, taglen);
+        e->hash = hash;
+        e->next = *bucket;
+        *bucket = e;
+        disk->nentries++;
+    }
+    e->seg = seg;
+    e->off = off;
+    e->len = rec->len;
+    e->sum = rec->sum;
+    e->cost = rec->cost;
+    e->expires = rec->expires;
+    e->date = rec->date;
+    e->ttl = rec->ttl;
+    e->swr = rec->swr;
+    e->total = rec->total;
+    e->gen = rec->gen;
+}
+
+// caller holds disk->lock; 1 if tag was in the index
+int drop_entry(disk_t *disk, const char *tag, size_t taglen) {
+    unsigned long hash = hash_tag(tag, taglen);
+    disk_entry_t **ep = &disk->buckets[hash % DISK_BUCKETS];
+    for (; *ep != NULL; ep = &(*ep)->next) {
+        disk_entry_t *e = *ep;
+        if (e->hash == hash && strlen(e->tag) == taglen &&
+            !memcmp(e->tag, tag, taglen)) {
+            *ep = e->next;
+            free(e->tag);
+            free(e);
+            disk->nentries--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// caller holds disk->lock
+void drop_segment(disk_t *disk, int seg) {
+    for (int i = 0; i < DISK_BUCKETS; ++i) {
+        disk_entry_t **ep = &disk->buckets[i];
+        while (*ep != NULL) {
+            disk_entry_t *e = *ep;
+            if (e->seg != seg) {
+                ep = &e->next;
+                continue;
+            }
+            *ep = e->next;
+            free(e->tag);
+            free(e);
+            disk->nentries--;
+        }
+    }
+}
+
+// index the valid records of seg, returns where the first invalid one
+// (or the free space) begins
+size_t scan_segment(disk_t *disk, int seg) {
+    disk_seg_t *s = &disk->segs[seg];
+    size_t off = sizeof(disk_seg_header_t);
+    while (off + sizeof(disk_rec_t) <= DISK_SEGMENT_SIZE) {
+        const disk_rec_t *rec = (const disk_rec_t*)(s->map + off);
+        size_t n = REC_ALIGN(sizeof(disk_rec_t) + rec->taglen + rec->len);
+        const char *tag = (const char*)(rec + 1);
+        // a record left over from before the segment was started over,
+        // or one cut short by a crash, ends the log
+        if ((rec->magic != DISK_REC_MAGIC && rec->magic != DISK_DEL_MAGIC) ||
+            rec->seq != s->seq ||
+            n > DISK_SEGMENT_SIZE - off || rec->len > MAX_OBJECT_SIZE ||
+            rec->sum != checksum(tag, rec->taglen,
+                                 tag + rec->taglen, rec->len)) {
+            break;
+        }
+        P(&disk->lock);
+        if (rec->magic == DISK_DEL_MAGIC) {
+            drop_entry(disk, tag, rec->taglen);
+        } else {
+            put_entry(disk, tag, rec->taglen, seg, off, rec);
+        }
+        V(&disk->lock);
+        off += n;
+    }
+    return off;
+}
+
+// forget what seg holds and append to it from the start
+void start_segment(disk_t *disk, int seg) {
+    P(&disk->lock);
+    drop_segment(disk, seg);
+    V(&disk->lock);
+
+    disk_seg_t *s = &disk->segs[seg];
+    s->seq = ++disk->seq;
+    disk_seg_header_t *hdr = (disk_seg_header_t*)s->map;
+    hdr->magic = DISK_SEG_MAGIC;
+    hdr->seq = s->seq;
+    disk->cur = seg;
+    disk->woff = sizeof(disk_seg_header_t);
+}
+
+void *writer_func(void *arg) {
+    Pthread_detach(Pthread_self());
+    disk_t *disk = (disk_t*)arg;
+
+    while (1) {
+        P(&disk->queued);
+        P(&disk->qlock);
+        disk_spill_t *s = disk->queue_head;
+        disk->queue_head = s->next;
+        if (disk->queue_head == NULL) {
+            disk->queue_tail = NULL;
+        }
+        disk->queued_cnt--;
+        disk->writing = s;
+        V(&disk->qlock);
+
+        if (s->obj != NULL) {
+            write_spill(disk, s);
+            release_object(s->obj);
+        } else {
+            write_deletion(disk, s->tag);
+        }
+        P(&disk->qlock);
+        disk->writing = NULL;
+        V(&disk->qlock);
+        free(s->tag);
+        free(s);
+    }
+    return NULL;
+}
+
+void write_spill(disk_t *disk, disk_spill_t *s) {
+    size_t taglen = strlen(s->tag);
+    size_t len = s->obj->size;
+    size_t n = REC_ALIGN(sizeof(disk_rec_t) + taglen + len);
+    uint32_t sum = checksum(s->tag, taglen, s->obj->data, len);
+
+    // an object promoted from the disk comes back unchanged, unless a
+    // revalidation moved its expiry
+    long expires = atomic_load(&s->obj->expires);
+    P(&disk->lock);
+    disk_entry_t *e = lookup_entry(disk, s->tag, hash_tag(s->tag, taglen));
+    int same = e != NULL && e->len == len && e->sum == sum &&
+        e->expires == expires;
+    int forgotten = s->forgotten;
+    V(&disk->lock);
+    if (same || forgotten) {
+        return ;
+    }
+
+    if (disk->woff + n > DISK_SEGMENT_SIZE) {
+        start_segment(disk, (disk->cur + 1) % DISK_SEGMENTS);
+    }
+    disk_seg_t *seg = &disk->segs[disk->cur];
+    disk_rec_t *rec = (disk_rec_t*)(seg->map + disk->woff);
+    char *tag = (char*)(rec + 1);
+    memcpy(tag, s->tag, taglen);
+    memcpy(tag + taglen, s->obj->data, len);
+    rec->taglen = taglen;
+    rec->len = len;
+    rec->sum = sum;
+    rec->seq = seg->seq;
+    rec->cost = s->cost;
+    rec->expires = expires;
+    rec->date = atomic_load(&s->obj->date);
+    rec->ttl = s->obj->ttl;
+    rec->swr = s->obj->swr;
+    rec->total = s->obj->total;
+    rec->gen = s->obj->gen;
+    rec->magic = DISK_REC_MAGIC;
+
+    P(&disk->lock);
+    forgotten = s->forgotten;
+    if (!forgotten) {
+        put_entry(disk, s->tag, taglen, disk->cur, disk->woff, rec);
+    }
+    V(&disk->lock);
+    disk->woff += n;
+    atomic_fetch_add(&disk->written, 1);
+    if (forgotten) {
+        // replaced while it was written, a restart must not find it
+        write_deletion(disk, s->tag);
+    }
+}
+
+// a record that voids the older ones of tag
+void write_deletion(disk_t *disk, const char *tag) {
+    size_t taglen = strlen(tag);
+    size_t n = REC_ALIGN(sizeof(disk_rec_t) + taglen);
+    if (disk->woff + n > DISK_SEGMENT_SIZE) {
+        start_segment(disk, (disk->cur + 1) % DISK_SEGMENTS);
+    }
+    disk_seg_t *seg = &disk->segs[disk->cur];
+    disk_rec_t *rec = (disk_rec_t*)(seg->map + disk->woff);
+    memset(rec, 0, sizeof(disk_rec_t));
+    memcpy(rec + 1, tag, taglen);
+    rec->taglen = taglen;
+    rec->sum = checksum(tag, taglen, NULL, 0);
+    rec->seq = seg->seq;
+    rec->magic = DISK_DEL_MAGIC;
+    disk->woff += n;
+}
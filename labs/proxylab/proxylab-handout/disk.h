@@ -0,0 +1,116 @@
+/*
+ * disk.h - second cache tier in memory-mapped segment files
+ *
+ * Objects evicted from the memory cache are appended to a log of
+ * DISK_SEGMENTS fixed-size segment files; when the log is full the
+ * oldest segment is started over. An index in memory maps each tag to
+ * its newest record, and a hit is copied out of the mapping, i.e. out of
+ * the page cache, straight into the memory cache. Victims are written
+ * from where they are in memory, pinned until then. The records carry
+ * their segment's sequence number and a checksum, so a restart rebuilds
+ * the index by replaying the segments oldest first and the proxy starts
+ * warm. A tag inserted anew in memory is forgotten on the disk, with a
+ * deletion record in the log so that a restart doesn't bring it back.
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "csapp.h"
+#include "cache.h"
+
+#define DISK_SEGMENTS 8
+#define DISK_SEGMENT_SIZE (8 << 20)
+#define DISK_BUCKETS 1024
+#define DISK_MAX_QUEUE 64       /* evicted objects waiting to be written */
+
+#define DISK_SEG_MAGIC 0x3147455359585250UL    /* "PRXYSEG1" */
+#define DISK_REC_MAGIC 0x4f424a34U             /* "OBJ4" */
+#define DISK_DEL_MAGIC 0x44454c34U             /* "DEL4", no object */
+
+/* at the start of every segment file */
+typedef struct {
+    uint64_t magic;
+    uint64_t seq;           // bumped whenever a segment is started over
+} disk_seg_header_t;
+
+/* followed by the tag and the object, padded to 8 bytes */
+typedef struct {
+    uint32_t magic;
+    uint32_t taglen;
+    uint32_t len;
+    uint32_t sum;           // FNV-1a of tag and object
+    uint64_t seq;           // of the segment when written
+    int64_t cost;           // ms, for the memory cache's policy
+    int64_t expires, date, ttl, swr;    // freshness, as in cache_obj_t
+    int64_t total, gen;     // of a header kept in blocks, as there
+} disk_rec_t;
+
+typedef struct disk_entry_t disk_entry_t;
+struct disk_entry_t {
+    char *tag;
+    unsigned long hash;
+    int seg;
+    size_t off;             // of the record
+    uint32_t len, sum;
+    long cost;
+    long expires, date, ttl, swr;
+    long total, gen;
+    disk_entry_t *next;     // hash chain
+};
+
+typedef struct disk_spill_t disk_spill_t;
+struct disk_spill_t {
+    char *tag;
+    cache_obj_t *obj;       // pinned victim, NULL: a deletion record
+    long cost;
+    int forgotten;          // a newer version came, don't index this one
+    disk_spill_t *next;
+};
+
+typedef struct {
+    int fd;
+    char *map;
+    uint64_t seq;
+} disk_seg_t;
+
+typedef struct disk_t disk_t;
+struct disk_t {
+    disk_seg_t segs[DISK_SEGMENTS];
+    int cur;                // segment being appended to, writer only
+    size_t woff;
+    uint64_t seq;
+
+    disk_entry_t *buckets[DISK_BUCKETS];
+    int nentries;
+    sem_t lock;             // index, and records while copied out
+
+    disk_spill_t *queue_head, *queue_tail;
+    int queued_cnt;
+    disk_spill_t *writing;  // taken off the queue, not indexed yet
+    sem_t qlock;
+    sem_t queued;
+
+    atomic_long hits, misses, written, dropped;
+};
+
+/* open or create the segments under dir, rebuild the index from them
+ * and start the writer thread */
+void init_disk(disk_t *disk, const char *dir);
+
+/* queue an evicted object to be written, pinned until it is */
+void spill_disk(disk_t *disk, const char *tag, cache_obj_t *obj, long cost);
+
+/* a new version of tag is being cached, or none may be: drop the disk's
+ * copy, and those still waiting to be written */
+void forget_disk(disk_t *disk, const char *tag);
+
+/* tag's object inserted into cache and pinned, or a copy on the heap if
+ * the cache declines it; NULL if there is none */
+cache_obj_t *find_disk(disk_t *disk, cache_t *cache, const char *tag);
+
+void print_disk_stats(disk_t *disk);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,167 @@
+/*
+ * dns.c - resolver cache and resolver threads
+ *
+ * An entry that is being resolved collects the lookups that ask for it
+ * meanwhile, so one name is never resolved twice at the same time. The
+ * resolver threads take entries from a queue and run the blocking
+ * getaddrinfo() outside the lock.
+ */
+#include "dns.h"
+#include "pool.h"
+#include "log.h"
+
+static dns_entry_t *get_entry(dns_cache_t *dns, const char *host,
+                              const char *port);
+static void *resolver_func(void *arg);
+static void resolve_entry(dns_entry_t *e, dns_addrs_t *addrs);
+
+void init_dns(dns_cache_t *dns) {
+    memset(dns->buckets, 0, sizeof(dns->buckets));
+    Sem_init(&dns->lock, 0, 1);
+    dns->queue_head = dns->queue_tail = NULL;
+    Sem_init(&dns->queued, 0, 0);
+
+    for (int i = 0; i < DNS_THREADS; ++i) {
+        pthread_t tid;
+        Pthread_create(&tid, NULL, resolver_func, dns);
+    }
+}
+
+int dns_lookup(dns_cache_t *dns, const char *host, const char *port,
+               dns_addrs_t *addrs, dns_req_t *req) {
+    long now = now_ms();
+
+    P(&dns->lock);
+    dns_entry_t *e = get_entry(dns, host, port);
+    if (!e->resolving && now < e->expires) {
+        int rc = e->addrs.n > 0 ? DNS_OK : DNS_FAIL;
+        if (rc == DNS_OK) {
+            *addrs = e->addrs;
+        }
+        V(&dns->lock);
+        return rc;
+    }
+
+    req->next = e->waiters;
+    e->waiters = req;
+    if (!e->resolving) {
+        // new or expired, queue it for a resolver thread
+        e->resolving = 1;
+        e->qnext = NULL;
+        if (dns->queue_tail != NULL) {
+            dns->queue_tail->qnext = e;
+        } else {
+            dns->queue_head = e;
+        }
+        dns->queue_tail = e;
+        V(&dns->queued);
+    }
+    V(&dns->lock);
+    return DNS_WAIT;
+}
+
+void sweep_dns(dns_cache_t *dns) {
+    long now = now_ms();
+    P(&dns->lock);
+    for (int i = 0; i < DNS_BUCKETS; ++i) {
+        dns_entry_t **ep = &dns->buckets[i];
+        while (*ep != NULL) {
+            dns_entry_t *e = *ep;
+            if (e->resolving || now < e->expires) {
+                ep = &e->next;
+                continue;
+            }
+            *ep = e->next;
+            free(e->host);
+            free(e->port);
+            free(e);
+        }
+    }
+    V(&dns->lock);
+}
+
+
+// caller holds dns->lock; a new entry starts out expired
+dns_entry_t *get_entry(dns_cache_t *dns, const char *host, const char *port) {
+    unsigned long hash = 5381;
+    for (const unsigned char *p = (const unsigned char *)host; *p; ++p) {
+        hash = hash * 33 + tolower(*p);
+    }
+    for (const unsigned char *p = (const unsigned char *)port; *p; ++p) {
+        hash = hash * 33 + *p;
+    }
+    dns_entry_t **bucket = &dns->buckets[hash % DNS_BUCKETS];
+    for (dns_entry_t *e = *bucket; e != NULL; e = e->next) {
+        if (!strcasecmp(e->host, host) && !strcmp(e->port, port)) {
+            return e;
+        }
+    }
+
+    dns_entry_t *e = (dns_entry_t*) Calloc(1, sizeof(dns_entry_t));
+    e->host = strdup(host);
+    e->port = strdup(port);
+    e->next = *bucket;
+    *bucket = e;
+    return e;
+}
+
+void *resolver_func(void *arg) {
+    Pthread_detach(Pthread_self());
+    dns_cache_t *dns = (dns_cache_t*)arg;
+
+    while (1) {
+        P(&dns->queued);
+        P(&dns->lock);
+        dns_entry_t *e = dns->queue_head;
+        dns->queue_head = e->qnext;
+        if (dns->queue_head == NULL) {
+            dns->queue_tail = NULL;
+        }
+        V(&dns->lock);
+
+        // host and port never change and the entry stays while resolving
+        dns_addrs_t addrs;
+        resolve_entry(e, &addrs);
+
+        P(&dns->lock);
+        e->addrs = addrs;
+        e->expires = now_ms() + (addrs.n > 0 ? DNS_TTL : DNS_NEG_TTL);
+        e->resolving = 0;
+        dns_req_t *waiters = e->waiters;
+        e->waiters = NULL;
+        V(&dns->lock);
+
+        while (waiters != NULL) {
+            dns_req_t *req = waiters;
+            waiters = req->next;
+            req->addrs = addrs;
+            req->done(req);
+        }
+    }
+    return NULL;
+}
+
+void resolve_entry(dns_entry_t *e, dns_addrs_t *addrs) {
+    struct addrinfo hints, *list;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+
+    addrs->n = 0;
+    int rc = getaddrinfo(e->host, e->port, &hints, &list);
+    if (rc != 0) {
+        log_msg(LOG_WARN, "getaddrinfo failed (%s:%s): %s",
+                e->host, e->port, gai_strerror(rc));
+        return ;
+    }
+    for (struct addrinfo *p = list; p && addrs->n < DNS_MAX_ADDRS;
+         p = p->ai_next) {
+        dns_addr_t *a = &addrs->addr[addrs->n++];
+        a->family = p->ai_family;
+        a->socktype = p->ai_socktype;
+        a->protocol = p->ai_protocol;
+        a->addrlen = p->ai_addrlen;
+        memcpy(&a->addr, p->ai_addr, p->ai_addrlen);
+    }
+    freeaddrinfo(list);
+}
@@ -0,0 +1,77 @@
+/*
+ * dns.h - resolver cache for upstream host names
+ *
+ * Lookups are answered from a table keyed by host:port. A name that is
+ * not in the table (or has expired) is resolved by a resolver thread, so
+ * a slow name server never blocks a reactor; the caller is told through
+ * a callback when the answer is in. Failures are remembered too, for a
+ * shorter time.
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+#define DNS_BUCKETS 256
+#define DNS_MAX_ADDRS 8
+#define DNS_TTL 60000       /* ms a resolved address list is reused */
+#define DNS_NEG_TTL 5000    /* ms a failed lookup is remembered */
+#define DNS_THREADS 2       /* lookups that may block at the same time */
+
+/* what getaddrinfo returned, flattened so it can be copied around */
+typedef struct {
+    int family, socktype, protocol;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+} dns_addr_t;
+
+typedef struct {
+    int n;
+    dns_addr_t addr[DNS_MAX_ADDRS];
+} dns_addrs_t;
+
+/* a lookup waiting for a resolver thread */
+typedef struct dns_req_t dns_req_t;
+struct dns_req_t {
+    dns_addrs_t addrs;              // result, n is 0 if it failed
+    void (*done)(dns_req_t *req);   // called on the resolver thread
+    void *owner, *data;             // for the callback
+    dns_req_t *next;
+};
+
+enum dns_result {
+    DNS_OK,     // addrs filled from the cache
+    DNS_FAIL,   // the name recently failed to resolve
+    DNS_WAIT,   // req->done will be called with the result
+};
+
+typedef struct dns_entry_t dns_entry_t;
+struct dns_entry_t {
+    char *host, *port;
+    int resolving;
+    long expires;           // ms, monotonic
+    dns_addrs_t addrs;
+    dns_req_t *waiters;     // while resolving
+    dns_entry_t *next;      // hash chain
+    dns_entry_t *qnext;     // resolver queue
+};
+
+typedef struct {
+    dns_entry_t *buckets[DNS_BUCKETS];
+    sem_t lock;
+    dns_entry_t *queue_head, *queue_tail;
+    sem_t queued;
+} dns_cache_t;
+
+/* set up the table and start the resolver threads */
+void init_dns(dns_cache_t *dns);
+
+/* resolve host:port. On DNS_WAIT the resolver keeps req until it calls
+ * req->done, otherwise the caller still owns it */
+int dns_lookup(dns_cache_t *dns, const char *host, const char *port,
+               dns_addrs_t *addrs, dns_req_t *req);
+
+/* drop expired entries */
+void sweep_dns(dns_cache_t *dns);
+
+#endif /* __DNS_H__ */
@@ -0,0 +1,176 @@
+/*
+ * flight.c - single-flight table for cache misses
+ *
+ * The table lock only guards attaching and detaching. Response bytes are
+ * published by storing the new size after the block is written, so a
+ * waiter that loads the size may read everything before it.
+ */
+#include <sys/eventfd.h>
+
+#include "flight.h"
+
+static void unlist_flight(flight_table_t *table, flight_t *f);
+static void notify_flight(flight_t *f);
+static void release_flight(flight_t *f);
+
+void init_flights(flight_table_t *table) {
+    memset(table->buckets, 0, sizeof(table->buckets));
+    Sem_init(&table->lock, 0, 1);
+}
+
+flight_t *join_flight(flight_table_t *table, const char *tag, int http11,
+                      int *leader) {
+    unsigned long hash = hash_tag(tag, strlen(tag));
+    flight_t **bucket = &table->buckets[hash % FLIGHT_BUCKETS];
+
+    P(&table->lock);
+    for (flight_t *f = *bucket; f != NULL; f = f->next) {
+        if (f->hash == hash && f->http11 == http11 && !strcmp(f->tag, tag)) {
+            atomic_fetch_add(&f->refcnt, 1);
+            atomic_fetch_add(&f->nwaiters, 1);
+            V(&table->lock);
+            *leader = 0;
+            return f;
+        }
+    }
+
+    flight_t *f = (flight_t*) Calloc(1, sizeof(flight_t));
+    f->tag = strdup(tag);
+    f->hash = hash;
+    f->http11 = http11;
+    f->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (f->efd < 0) {
+        unix_error("eventfd error");
+    }
+    f->head = f->tail = (flight_block_t*) Calloc(1, sizeof(flight_block_t));
+    atomic_init(&f->refcnt, 1);
+    atomic_init(&f->nwaiters, 0);
+    atomic_init(&f->size, 0);
+    atomic_init(&f->state, FLIGHT_RUNNING);
+    f->listed = 1;
+    f->next = *bucket;
+    *bucket = f;
+    V(&table->lock);
+
+    *leader = 1;
+    return f;
+}
+
+void feed_flight(flight_table_t *table, flight_t *f, const char *buf, size_t n) {
+    if (f->abandoned || n == 0) {
+        return ;
+    }
+    size_t size = atomic_load(&f->size);
+    if (size + n > FLIGHT_MAX_BUFFER) {
+        // a body of unknown length got too big to keep, waiters are cut
+        // short as if the leader had failed
+        abandon_flight(table, f);
+        return ;
+    }
+
+    size_t end = size + n;
+    while (size < end) {
+        size_t off = size % FLIGHT_BLOCK_SIZE;
+        if (off == 0 && size > 0) {
+            flight_block_t *b = (flight_block_t*) Malloc(sizeof(flight_block_t));
+            b->next = NULL;
+            f->tail->next = b;
+            f->tail = b;
+        }
+        size_t cnt = FLIGHT_BLOCK_SIZE - off;
+        if (cnt > end - size) {
+            cnt = end - size;
+        }
+        memcpy(f->tail->data + off, buf, cnt);
+        buf += cnt;
+        size += cnt;
+    }
+    atomic_store(&f->size, end);
+    notify_flight(f);
+}
+
+void abandon_flight(flight_table_t *table, flight_t *f) {
+    if (f->abandoned) {
+        return ;
+    }
+    P(&table->lock);
+    unlist_flight(table, f);
+    V(&table->lock);
+    f->abandoned = 1;
+    atomic_store(&f->state, FLIGHT_FAILED);
+    notify_flight(f);
+}
+
+void end_flight(flight_table_t *table, flight_t *f, int ok, int delimited) {
+    P(&table->lock);
+    unlist_flight(table, f);
+    V(&table->lock);
+
+    f->delimited = delimited;
+    atomic_store(&f->state, ok && !f->abandoned ? FLIGHT_DONE : FLIGHT_FAILED);
+    notify_flight(f);
+    release_flight(f);
+}
+
+size_t read_flight(flight_t *f, flight_cursor_t *cur, const char **p) {
+    size_t size = atomic_load(&f->size);
+    if (cur->pos == size) {
+        return 0;
+    }
+    if (cur->block == NULL) {
+        cur->block = f->head;
+    } else if (cur->off == FLIGHT_BLOCK_SIZE) {
+        cur->block = cur->block->next;
+        cur->off = 0;
+    }
+    size_t n = FLIGHT_BLOCK_SIZE - cur->off;
+    if (n > size - cur->pos) {
+        n = size - cur->pos;
+    }
+    *p = cur->block->data + cur->off;
+    cur->off += n;
+    cur->pos += n;
+    return n;
+}
+
+void leave_flight(flight_t *f) {
+    atomic_fetch_sub(&f->nwaiters, 1);
+    release_flight(f);
+}
+
+
+// caller holds table->lock
+void unlist_flight(flight_table_t *table, flight_t *f) {
+    if (!f->listed) {
+        return ;
+    }
+    flight_t **fp = &table->buckets[f->hash % FLIGHT_BUCKETS];
+    while (*fp != f) {
+        fp = &(*fp)->next;
+    }
+    *fp = f->next;
+    f->listed = 0;
+}
+
+// wake every waiter, each watches the eventfd from its own reactor
+void notify_flight(flight_t *f) {
+    uint64_t one = 1;
+    if (atomic_load(&f->nwaiters) > 0 &&
+        write(f->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        unix_error("eventfd write error");
+    }
+}
+
+void release_flight(flight_t *f) {
+    if (atomic_fetch_sub(&f->refcnt, 1) != 1) {
+        return ;
+    }
+    while (f->head != NULL) {
+        flight_block_t *b = f->head;
+        f->head = b->next;
+        free(b);
+    }
+    close(f->efd);
+    free(f->tag);
+    free(f);
+}
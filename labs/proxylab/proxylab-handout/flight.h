@@ -0,0 +1,97 @@
+/*
+ * flight.h - origin fetches shared by concurrent misses on one URL
+ *
+ * The first miss for a tag becomes the leader of a flight: it fetches
+ * from the origin and appends every byte it relays to its own client to
+ * the flight. Misses on the same tag arriving meanwhile attach as waiters
+ * and send the same bytes from the flight as they come in, instead of
+ * opening connections of their own. Waiters may live on any reactor.
+ *
+ * A flight holds at most FLIGHT_MAX_BUFFER bytes. A response known to be
+ * bigger is not shared at all: the leader abandons the flight before it
+ * publishes anything, and waiters that got nothing fetch on their own.
+ */
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include <stdatomic.h>
+
+#include "csapp.h"
+#include "cache.h"
+
+#define FLIGHT_BUCKETS 256
+#define FLIGHT_BLOCK_SIZE 16384
+/* a cacheable response and the lines the proxy adds to it */
+#define FLIGHT_MAX_BUFFER (MAX_OBJECT_SIZE + FLIGHT_BLOCK_SIZE)
+
+enum flight_state {
+    FLIGHT_RUNNING,
+    FLIGHT_DONE,     // whole response is in the flight
+    FLIGHT_FAILED,   // leader gave up, the response is cut short
+};
+
+/* the response is kept in append-only blocks so that waiters can read
+ * what has been published without locking */
+typedef struct flight_block_t flight_block_t;
+struct flight_block_t {
+    flight_block_t *next;
+    char data[FLIGHT_BLOCK_SIZE];
+};
+
+typedef struct flight_t flight_t;
+struct flight_t {
+    char *tag;
+    unsigned long hash;
+    int http11;             // waiters must take the same framing
+    flight_t *next;         // hash chain
+    int listed;             // in the table, new misses may attach
+    int abandoned;          // leader stopped buffering, waiters failed
+
+    atomic_int refcnt;      // leader and waiters
+    atomic_int nwaiters;
+    int efd;                // eventfd, written whenever there is news
+
+    flight_block_t *head, *tail;
+    atomic_size_t size;     // bytes published
+    atomic_int state;
+    int delimited;          // response end is marked by its framing
+};
+
+typedef struct {
+    flight_t *buckets[FLIGHT_BUCKETS];
+    sem_t lock;
+} flight_table_t;
+
+/* a waiter's read position */
+typedef struct {
+    flight_block_t *block;
+    size_t off;             // in block
+    size_t pos;             // in the response
+} flight_cursor_t;
+
+void init_flights(flight_table_t *table);
+
+/* attach to the running flight for tag, or start one and set *leader */
+flight_t *join_flight(flight_table_t *table, const char *tag, int http11,
+                      int *leader);
+
+/* leader: publish n more response bytes; past FLIGHT_MAX_BUFFER the
+ * flight is abandoned instead */
+void feed_flight(flight_table_t *table, flight_t *f, const char *buf, size_t n);
+
+/* leader: stop sharing the response, the flight fails for its waiters
+ * and takes no new ones; the leader still calls end_flight() */
+void abandon_flight(flight_table_t *table, flight_t *f);
+
+/* leader: the response is complete (ok) or cut short, drops the leader's
+ * reference */
+void end_flight(flight_table_t *table, flight_t *f, int ok, int delimited);
+
+/* waiter: bytes ready at the cursor, contiguous, and moves the cursor
+ * past them; 0 if it has caught up */
+size_t read_flight(flight_t *f, flight_cursor_t *cur, const char **p);
+
+/* waiter: detach, drops the waiter's reference */
+void leave_flight(flight_t *f);
+
+#endif /* __FLIGHT_H__ */
@@ -0,0 +1,154 @@
+#!/bin/bash
+#
+# flighttest.sh - concurrent misses that must not share a fetch
+#
+#     A slow origin answers a conditional request with a 304. Two misses
+#     on one URL go to the proxy at once, the first conditional; the
+#     other must get the 200 and its body, not the first one's 304.
+#     Likewise a miss with a Cookie or an Authorization must not answer
+#     for a plain one, and a response too big to buffer is not shared:
+#     the second miss fetches it on its own.
+#
+#     usage: ./flighttest.sh
+#
+
+PORT_START=20000
+MAX_RAND=12000
+MAX_TRIES=50
+
+function wait_for_port {
+    for i in `seq 1 ${MAX_TRIES}`; do
+        (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "Error: nothing listens on port $1"
+    return 1
+}
+
+function pick_port {
+    while true; do
+        port=$((PORT_START + RANDOM % MAX_RAND))
+        (exec 3<>/dev/tcp/127.0.0.1/${port}) 2>/dev/null || { echo ${port}; return; }
+    done
+}
+
+function cleanup {
+    kill ${PROXY_PID} ${ORIGIN_PID} 2>/dev/null
+    wait 2>/dev/null
+    rm -rf ${TMP}
+}
+
+TMP=`mktemp -d /tmp/flighttest.XXXXXX`
+trap cleanup EXIT
+
+# takes a second to answer, 304 for the current ETag; /who tells whose
+# credentials it saw, /large is too big to keep. Requests are logged
+cat > ${TMP}/origin.py <<'EOF'
+import http.server, sys, time
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    def log_message(self, *args):
+        pass
+    def do_GET(self):
+        with open(sys.argv[2], "a") as log:
+            log.write(self.path + "\n")
+        time.sleep(1)
+        if self.path.startswith("/who"):
+            who = self.headers.get("Cookie") or \
+                self.headers.get("Authorization") or "nobody"
+            body = (who + "\n").encode()
+            self.send_response(200)
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+            return
+        if self.path == "/large":
+            body = b"0123456789" * 30000
+            self.send_response(200)
+            self.send_header("Cache-Control", "no-store")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+            return
+        if self.headers.get("If-None-Match") == '"v1"':
+            self.send_response(304)
+            self.send_header("ETag", '"v1"')
+            self.end_headers()
+            return
+        body = b"the whole body\n"
+        self.send_response(200)
+        self.send_header("ETag", '"v1"')
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+http.server.ThreadingHTTPServer(("127.0.0.1", int(sys.argv[1])),
+                                Handler).serve_forever()
+EOF
+
+ORIGIN_PORT=`pick_port`
+python3 ${TMP}/origin.py ${ORIGIN_PORT} ${TMP}/origin.log &
+ORIGIN_PID=$!
+PROXY_PORT=`pick_port`
+while [ ${PROXY_PORT} = ${ORIGIN_PORT} ]; do
+    PROXY_PORT=`pick_port`
+done
+./proxy ${PROXY_PORT} >/dev/null 2>&1 &
+PROXY_PID=$!
+wait_for_port ${ORIGIN_PORT} || exit 1
+wait_for_port ${PROXY_PORT} || exit 1
+
+# a miss with the request header $1 and a plain one 0.2s later
+function race {
+    curl -s -x 127.0.0.1:${PROXY_PORT} -H "$1" -o ${TMP}/first ${URL} &
+    FIRST_PID=$!
+    sleep 0.2
+    curl -s -x 127.0.0.1:${PROXY_PORT} -o ${TMP}/second ${URL}
+    wait ${FIRST_PID}
+}
+
+URL=http://127.0.0.1:${ORIGIN_PORT}/obj
+curl -s -x 127.0.0.1:${PROXY_PORT} -H 'If-None-Match: "v1"' \
+    -o ${TMP}/cond -w '%{http_code}' ${URL} > ${TMP}/cond.code &
+COND_PID=$!
+sleep 0.2
+curl -s -x 127.0.0.1:${PROXY_PORT} -o ${TMP}/plain -w '%{http_code}' \
+    ${URL} > ${TMP}/plain.code
+wait ${COND_PID}
+
+STATUS=0
+if [ "`cat ${TMP}/cond.code`" != 304 ]; then
+    echo "Fail: conditional client got `cat ${TMP}/cond.code`, not 304"
+    STATUS=1
+fi
+if [ "`cat ${TMP}/plain.code`" != 200 ] ||
+   [ "`cat ${TMP}/plain`" != "the whole body" ]; then
+    echo "Fail: plain client got `cat ${TMP}/plain.code`, not 200 and the body"
+    STATUS=1
+fi
+
+URL=http://127.0.0.1:${ORIGIN_PORT}/who
+for HEADER in "Cookie: id=1" "Authorization: Basic dXNlcjpwdw=="; do
+    rm -f ${TMP}/first ${TMP}/second
+    race "${HEADER}"
+    if [ "`cat ${TMP}/first`" != "${HEADER#*: }" ] ||
+       [ "`cat ${TMP}/second`" != nobody ]; then
+        echo "Fail: a miss with \"${HEADER%%:*}\" answered for a plain one"
+        STATUS=1
+    fi
+    URL=${URL}2     # a fresh URL, the plain response is cached
+done
+
+# the follower must not wait on a buffer of the whole body
+URL=http://127.0.0.1:${ORIGIN_PORT}/large
+race "Accept: */*"
+python3 -c 'import sys; sys.stdout.write("0123456789" * 30000)' > ${TMP}/large
+if ! cmp -s ${TMP}/first ${TMP}/large || ! cmp -s ${TMP}/second ${TMP}/large; then
+    echo "Fail: a response too big to buffer did not reach both clients"
+    STATUS=1
+elif [ "`grep -c '^/large$' ${TMP}/origin.log`" != 2 ]; then
+    echo "Fail: a response too big to buffer was shared"
+    STATUS=1
+fi
+
+[ ${STATUS} = 0 ] && echo "flighttest: ok"
+exit ${STATUS}
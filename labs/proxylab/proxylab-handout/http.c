@@ -0,0 +1,403 @@
+/*
+ * http.c - HTTP/1.x response parsing and chunked body decoding
+ *
+ * The proxy needs to know where an origin response ends so that the
+ * upstream connection can be reused: Content-Length, chunked framing, a
+ * status without body, or (otherwise) the origin closing the connection.
+ * Byte ranges are parsed for objects served in parts, see blocks.h.
+ */
+#include <limits.h>
+
+#include "http.h"
+
+enum chunk_state {
+    CHUNK_SIZE,          // hex size of the next chunk
+    CHUNK_EXT,           // chunk extension, skipped up to LF
+    CHUNK_DATA,          // chunk payload
+    CHUNK_DATA_END,      // CRLF after the payload
+    CHUNK_TRAILER,       // start of a trailer line, LF here ends the body
+    CHUNK_TRAILER_LINE,  // inside a trailer line
+    CHUNK_DONE,
+};
+
+static int header_is(const char *line, const char *value, const char *name);
+static long token_seconds(const char *value, const char *end,
+                          const char *token);
+static long scan_number(const char **p, const char *end);
+
+int parse_response_header(const char *head, size_t len, http_response_t *resp) {
+    const char *end = head + len;
+    resp->version = 10;
+    resp->status = 0;
+    resp->content_length = -1;
+    resp->chunked = 0;
+    resp->keep_alive = 0;
+    resp->max_age = -1;
+    resp->swr = 0;
+    resp->no_cache = 0;
+    resp->no_store = 0;
+    resp->private = 0;
+    resp->public = 0;
+    resp->s_maxage = -1;
+    resp->set_cookie = 0;
+
+    // status line: HTTP/1.x SSS reason
+    int minor, status;
+    if (len < strlen("HTTP/1.x 200") ||
+        sscanf(head, "HTTP/1.%d %3d", &minor, &status) != 2) {
+        return 0;
+    }
+    resp->version = minor >= 1 ? 11 : 10;
+    resp->status = status;
+
+    int conn_close = 0, conn_keep_alive = 0;
+    const char *line = memchr(head, '\n', len);
+    while (line != NULL && ++line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            break;
+        }
+        const char *value = memchr(line, ':', eol - line);
+        if (value != NULL) {
+            value++;
+            if (header_is(line, value, "Content-Length")) {
+                resp->content_length = strtol(value, NULL, 10);
+            } else if (header_is(line, value, "Transfer-Encoding")) {
+                resp->chunked = value_has_token(value, eol, "chunked");
+            } else if (header_is(line, value, "Connection")) {
+                conn_close |= value_has_token(value, eol, "close");
+                conn_keep_alive |= value_has_token(value, eol, "keep-alive");
+            } else if (header_is(line, value, "Cache-Control")) {
+                long secs = token_seconds(value, eol, "max-age");
+                if (secs >= 0) {
+                    resp->max_age = secs;
+                }
+                resp->no_cache |= value_has_token(value, eol, "no-cache");
+                if ((secs = token_seconds(value, eol,
+                                          "stale-while-revalidate")) >= 0) {
+                    resp->swr = secs;
+                }
+                resp->no_store |= value_has_token(value, eol, "no-store");
+                resp->private |= value_has_token(value, eol, "private");
+                resp->public |= value_has_token(value, eol, "public");
+                if ((secs = token_seconds(value, eol, "s-maxage")) >= 0) {
+                    resp->s_maxage = secs;
+                }
+            } else if (header_is(line, value, "Set-Cookie")) {
+                resp->set_cookie = 1;
+            }
+        }
+        line = eol;
+    }
+
+    // HTTP/1.1 is persistent unless told otherwise, 1.0 only if asked
+    if (resp->version == 11) {
+        resp->keep_alive = !conn_close;
+    } else {
+        resp->keep_alive = conn_keep_alive && !conn_close;
+    }
+    if (resp->chunked) {
+        resp->content_length = -1;  // chunked framing wins
+    }
+    // whatever order the directives came in: s-maxage is the one for a
+    // shared cache, and no-cache stores but revalidates each time
+    if (resp->s_maxage >= 0) {
+        resp->max_age = resp->s_maxage;
+    }
+    if (resp->no_cache) {
+        resp->max_age = 0;
+    }
+    return 1;
+}
+
+int response_storable(const http_response_t *resp, int authorized) {
+    if (authorized && !resp->public && resp->s_maxage < 0) {
+        return 0;
+    }
+    return !resp->no_store && !resp->private && !resp->set_cookie;
+}
+
+int response_has_body(const http_response_t *resp) {
+    return !(resp->status / 100 == 1 || resp->status == 204 ||
+             resp->status == 304);
+}
+
+size_t strip_hop_headers(char *head, size_t len, int drop_te) {
+    char *end = head + len;
+    char *line = memchr(head, '\n', len);
+    if (line == NULL) {
+        return len;
+    }
+    line++;
+    while (line < end) {
+        char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            break;
+        }
+        char *colon = memchr(line, ':', eol - line);
+        if (colon != NULL &&
+            (header_is(line, colon + 1, "Connection") ||
+             header_is(line, colon + 1, "Keep-Alive") ||
+             header_is(line, colon + 1, "Proxy-Connection") ||
+             (drop_te && header_is(line, colon + 1, "Transfer-Encoding")))) {
+            // shift the rest of the header over this line
+            size_t linelen = eol + 1 - line;
+            memmove(line, eol + 1, end - eol - 1);
+            end -= linelen;
+            continue;
+        }
+        line = eol + 1;
+    }
+    return end - head;
+}
+
+void init_chunk_decoder(chunk_decoder_t *d) {
+    d->state = CHUNK_SIZE;
+    d->size = 0;
+    d->digits = 0;
+}
+
+int chunk_decoder_done(const chunk_decoder_t *d) {
+    return d->state == CHUNK_DONE;
+}
+
+ssize_t decode_chunked(chunk_decoder_t *d, const char *in, size_t len,
+                       char *out, size_t *outlen) {
+    size_t i = 0, o = 0;
+    while (i < len && d->state != CHUNK_DONE) {
+        char ch = in[i];
+        switch (d->state) {
+        case CHUNK_SIZE:
+            if (isxdigit((unsigned char)ch)) {
+                if (d->size > (LONG_MAX >> 4)) {
+                    return -1;
+                }
+                d->size = d->size * 16 +
+                    (isdigit((unsigned char)ch) ? ch - '0'
+                                                : tolower(ch) - 'a' + 10);
+                d->digits++;
+                i++;
+                break;
+            }
+            if (d->digits == 0) {
+                return -1;
+            }
+            d->state = CHUNK_EXT;
+            break;
+        case CHUNK_EXT:
+            i++;
+            if (ch == '\n') {
+                d->state = d->size > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+                d->digits = 0;
+            }
+            break;
+        case CHUNK_DATA: {
+            size_t n = len - i;
+            if (n > d->size) {
+                n = d->size;
+            }
+            if (out != NULL) {
+                memcpy(out + o, in + i, n);
+            }
+            o += n;
+            i += n;
+            d->size -= n;
+            if (d->size == 0) {
+                d->state = CHUNK_DATA_END;
+            }
+            break;
+        }
+        case CHUNK_DATA_END:
+            i++;
+            if (ch == '\n') {
+                d->state = CHUNK_SIZE;
+            } else if (ch != '\r') {
+                return -1;
+            }
+            break;
+        case CHUNK_TRAILER:
+            i++;
+            if (ch == '\n') {
+                d->state = CHUNK_DONE;
+            } else if (ch != '\r') {
+                d->state = CHUNK_TRAILER_LINE;
+            }
+            break;
+        case CHUNK_TRAILER_LINE:
+            i++;
+            if (ch == '\n') {
+                d->state = CHUNK_TRAILER;
+            }
+            break;
+        }
+    }
+    *outlen = o;
+    return i;
+}
+
+
+/* line starts with header name followed by the ':' just before value */
+int header_is(const char *line, const char *value, const char *name) {
+    size_t n = strlen(name);
+    return value - line == n + 1 && !strncasecmp(line, name, n);
+}
+
+int value_has_token(const char *value, const char *end, const char *token) {
+    size_t n = strlen(token);
+    const char *p = value;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        const char *q = p;
+        while (q < end && *q != ',' && *q != '\r' && *q != '\n' &&
+               *q != ' ' && *q != '\t' && *q != ';' && *q != '=') {
+            q++;
+        }
+        if (q - p == n && !strncasecmp(p, token, n)) {
+            return 1;
+        }
+        p = q;
+        while (p < end && *p != ',') {
+            p++;
+        }
+    }
+    return 0;
+}
+
+// seconds of a "token=N" directive in a comma separated list, -1 if the
+// directive is absent
+long token_seconds(const char *value, const char *end, const char *token) {
+    size_t n = strlen(token);
+    const char *p = value;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        if (end - p > n && !strncasecmp(p, token, n) && p[n] == '=') {
+            p += n + 1;
+            if (p < end && *p == '"') {
+                p++;
+            }
+            if (p < end && isdigit((unsigned char)*p)) {
+                return strtol(p, NULL, 10);
+            }
+            return -1;
+        }
+        while (p < end && *p != ',') {
+            p++;
+        }
+    }
+    return -1;
+}
+
+const char *find_header(const char *head, size_t len, const char *name,
+                        size_t *vlen) {
+    const char *end = head + len;
+    const char *line = memchr(head, '\n', len);
+    while (line != NULL && ++line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            break;
+        }
+        const char *value = memchr(line, ':', eol - line);
+        if (value != NULL && header_is(line, ++value, name)) {
+            while (value < eol && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            const char *vend = eol;
+            while (vend > value && isspace((unsigned char)vend[-1])) {
+                vend--;
+            }
+            *vlen = vend - value;
+            return value;
+        }
+        line = eol;
+    }
+    return NULL;
+}
+
+int parse_range(const char *value, size_t len, long total, long *first,
+                long *last) {
+    const char *p = value, *end = value + len;
+    if (len < 6 || strncasecmp(p, "bytes=", 6)) {
+        return RANGE_NONE;
+    }
+    p += 6;
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+
+    // "a-b", "a-" or the suffix "-n"
+    long a = -1, b = -1;
+    if (p < end && *p == '-') {
+        p++;
+        if ((b = scan_number(&p, end)) < 0) {
+            return RANGE_NONE;
+        }
+    } else {
+        if ((a = scan_number(&p, end)) < 0 || p == end || *p++ != '-') {
+            return RANGE_NONE;
+        }
+        if (p < end && isdigit((unsigned char)*p) &&
+            ((b = scan_number(&p, end)) < 0 || b < a)) {
+            return RANGE_NONE;
+        }
+    }
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    if (p != end) {
+        return RANGE_NONE;  // several ranges, sent as the whole body
+    }
+
+    if (a < 0) {
+        if (b == 0 || total == 0) {
+            return RANGE_BAD;
+        }
+        *first = b < total ? total - b : 0;
+        *last = total - 1;
+        return RANGE_OK;
+    }
+    if (a >= total) {
+        return RANGE_BAD;
+    }
+    *first = a;
+    *last = b >= 0 && b < total ? b : total - 1;
+    return RANGE_OK;
+}
+
+int parse_content_range(const char *head, size_t len, long *first,
+                        long *last, long *total) {
+    size_t vlen;
+    const char *p = find_header(head, len, "Content-Range", &vlen);
+    if (p == NULL || vlen < 6 || strncasecmp(p, "bytes ", 6)) {
+        return 0;
+    }
+    const char *end = p + vlen;
+    p += 6;
+    if ((*first = scan_number(&p, end)) < 0 || p == end || *p++ != '-' ||
+        (*last = scan_number(&p, end)) < *first || p == end || *p++ != '/' ||
+        (*total = scan_number(&p, end)) <= *last || p != end) {
+        return 0;
+    }
+    return 1;
+}
+
+// the decimal number at *p, moving *p past it; -1 if there is none or it
+// does not fit a long
+long scan_number(const char **p, const char *end) {
+    const char *q = *p;
+    long n = 0;
+    while (q < end && isdigit((unsigned char)*q)) {
+        if (n > (LONG_MAX - 9) / 10) {
+            return -1;
+        }
+        n = n * 10 + (*q++ - '0');
+    }
+    if (q == *p) {
+        return -1;
+    }
+    *p = q;
+    return n;
+}
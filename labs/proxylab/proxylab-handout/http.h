@@ -0,0 +1,84 @@
+/*
+ * http.h - HTTP/1.x message helpers used by the proxy
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+/* what the proxy needs to know about an origin response header */
+typedef struct {
+    int version;            // 10 for HTTP/1.0, 11 for HTTP/1.1
+    int status;
+    long content_length;    // -1 if absent
+    int chunked;            // Transfer-Encoding: chunked
+    int keep_alive;         // origin allows reusing the connection
+    long max_age;           // freshness for a shared cache (s), -1 if
+                            // none: s-maxage, else max-age, 0 if no-cache
+    long swr;               // stale-while-revalidate (s), 0 if absent
+    int no_cache;           // Cache-Control no-cache
+    int no_store;           // Cache-Control no-store
+    int private;            // Cache-Control private
+    int public;             // Cache-Control public
+    long s_maxage;          // Cache-Control s-maxage (s), -1 if absent
+    int set_cookie;         // has a Set-Cookie line
+} http_response_t;
+
+/* parse the status line and header (len bytes, ending in a blank line),
+ * return 0 if it is not an HTTP/1.x response */
+int parse_response_header(const char *head, size_t len, http_response_t *resp);
+
+/* may a shared cache keep this response: not no-store, private, nor
+ * setting a cookie, and public or with an s-maxage if the request had
+ * an Authorization (RFC 9111 3.5) */
+int response_storable(const http_response_t *resp, int authorized);
+
+/* does a response with this status carry a body at all */
+int response_has_body(const http_response_t *resp);
+
+/* drop hop-by-hop header lines in place, also Transfer-Encoding if
+ * drop_te is set; return the new length */
+size_t strip_hop_headers(char *head, size_t len, int drop_te);
+
+/* does the header value [value, end), a comma separated list, contain
+ * token (case insensitive), bare or with an =argument */
+int value_has_token(const char *value, const char *end, const char *token);
+
+/* value of the first header line called name in head (len bytes), with
+ * its length in *vlen and surrounding blanks trimmed; NULL if absent */
+const char *find_header(const char *head, size_t len, const char *name,
+                        size_t *vlen);
+
+enum range_result {
+    RANGE_NONE,     // not a single byte range, the whole body is sent
+    RANGE_OK,
+    RANGE_BAD,      // starts past the end of the body: 416
+};
+
+/* the byte range a Range header value (len bytes) asks for, of a body
+ * of total bytes, as [*first, *last] */
+int parse_range(const char *value, size_t len, long total, long *first,
+                long *last);
+
+/* Content-Range "bytes first-last/total" of a 206 header; 0 if it is
+ * absent, malformed or leaves total unknown */
+int parse_content_range(const char *head, size_t len, long *first,
+                        long *last, long *total);
+
+/* incremental decoder for a chunked body */
+typedef struct {
+    int state;
+    long size;      // bytes left in the current chunk
+    int digits;
+} chunk_decoder_t;
+
+void init_chunk_decoder(chunk_decoder_t *d);
+int chunk_decoder_done(const chunk_decoder_t *d);
+
+/* consume raw chunked bytes from in, copy the decoded body to out (if not
+ * NULL, room for len bytes) and set *outlen. Returns the number of input
+ * bytes that belong to the message, or -1 on a framing error */
+ssize_t decode_chunked(chunk_decoder_t *d, const char *in, size_t len,
+                       char *out, size_t *outlen);
+
+#endif /* __HTTP_H__ */
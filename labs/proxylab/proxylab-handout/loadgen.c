@@ -0,0 +1,404 @@
+/*
+ * loadgen.c - closed-loop HTTP load generator
+ *
+ * Every connection is a thread that sends a GET through the proxy, reads
+ * the whole response and sends the next one on the same connection, so
+ * the offered load is the concurrency and nothing more. URLs name files
+ * of a synthetic corpus on the origin, picked by Zipf popularity: rank k
+ * (from 1) is asked for in proportion to 1/k^s. Requests completed
+ * during the warm-up are not counted; the rest go into a latency
+ * histogram per thread, merged at the end. A response the proxy served
+ * from its cache carries X-Cache: HIT, that gives the hit ratio. With
+ * -k, a connection is closed after that many requests and a new one
+ * opened, to load accepting as well.
+ *
+ * usage: ./loadgen [-c conns] [-d secs] [-w secs] [-n files] [-s zipf]
+ *                  [-k requests] proxy_host:port origin_host:port
+ *        ./loadgen -g dir [-n files]     write the corpus into dir
+ */
+#include <math.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "csapp.h"
+#include "http.h"
+#include "stats.h"
+
+#define MAX_CONNS 1024
+#define MAX_FILES 1000000
+#define MIN_FILE_SIZE 256       /* corpus sizes are log-uniform in between */
+#define MAX_FILE_SIZE 65536
+#define RESP_BUF_SIZE (MAX_FILE_SIZE + 16384)
+
+enum fetch_result {
+    FETCH_ERROR = -1,
+    FETCH_CLOSED = -2,      // the connection was gone before any answer
+};
+
+enum phase {
+    PHASE_WARMUP,
+    PHASE_MEASURE,
+    PHASE_STOP,
+};
+
+typedef struct {
+    pthread_t tid;
+    unsigned long seed;
+    char buf[RESP_BUF_SIZE];
+    hist_t latency;             // us, send to the last body byte
+    long requests, bytes, hits, errors, connects;
+} client_t;
+
+static char proxy_host[MAXLINE], proxy_port[MAXLINE];
+static char origin[MAXLINE];
+static int nfiles = 1000;
+static int per_conn;        // requests before reconnecting, 0: no limit
+static double *zipf_cdf;
+static atomic_int phase;
+
+static void usage(const char *prog);
+static void split_host_port(char *arg, char *host, char *port);
+static long now_us(void);
+static unsigned long next_random(unsigned long *state);
+static long file_size(int id);
+static void write_corpus(const char *dir);
+static void init_zipf(double s);
+static int pick_file(unsigned long *seed);
+static void *client_func(void *vargp);
+static int fetch(client_t *cl, int fd, int id, long *len, int *hit);
+static int read_more(int fd, char *buf, size_t *have, size_t cap);
+
+int main(int argc, char **argv) {
+    int conns = 16, secs = 10, warmup = 2;
+    double s = 1.0;
+    char *corpus = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:d:w:n:s:g:k:")) != -1) {
+        switch (opt) {
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'd':
+            secs = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'n':
+            nfiles = atoi(optarg);
+            break;
+        case 's':
+            s = atof(optarg);
+            break;
+        case 'g':
+            corpus = optarg;
+            break;
+        case 'k':
+            per_conn = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (nfiles < 1 || nfiles > MAX_FILES) {
+        app_error("-n must be 1 to 1000000");
+    }
+    if (corpus != NULL) {
+        write_corpus(corpus);
+        return 0;
+    }
+    if (optind + 2 != argc || conns < 1 || conns > MAX_CONNS || secs < 1 ||
+        warmup < 0 || s < 0 || per_conn < 0) {
+        usage(argv[0]);
+    }
+    split_host_port(argv[optind], proxy_host, proxy_port);
+    strncpy(origin, argv[optind + 1], MAXLINE - 1);
+    Signal(SIGPIPE, SIG_IGN);
+    init_zipf(s);
+
+    client_t *clients = Malloc(conns * sizeof(client_t));
+    for (int i = 0; i < conns; ++i) {
+        client_t *cl = &clients[i];
+        init_hist(&cl->latency);
+        cl->seed = 0x9e3779b97f4a7c15UL * (i + 1);
+        cl->requests = cl->bytes = cl->hits = cl->errors = cl->connects = 0;
+        Pthread_create(&cl->tid, NULL, client_func, cl);
+    }
+
+    sleep(warmup);
+    long start = now_us();
+    atomic_store(&phase, PHASE_MEASURE);
+    sleep(secs);
+    atomic_store(&phase, PHASE_STOP);
+    long elapsed = now_us() - start;
+
+    hist_sum_t *sum = Calloc(1, sizeof(hist_sum_t));
+    long requests = 0, bytes = 0, hits = 0, errors = 0, connects = 0;
+    for (int i = 0; i < conns; ++i) {
+        client_t *cl = &clients[i];
+        Pthread_join(cl->tid, NULL);
+        merge_hist(sum, &cl->latency);
+        requests += cl->requests;
+        bytes += cl->bytes;
+        hits += cl->hits;
+        errors += cl->errors;
+        connects += cl->connects;
+    }
+
+    double t = elapsed / 1e6;
+    printf("%d conns, %d files, zipf %.2f, %.1f s\n", conns, nfiles, s, t);
+    printf("requests %ld: %.1f req/s, %.1f MB/s\n", requests,
+           requests / t, bytes / t / 1e6);
+    printf("latency us: mean %ld, p50 %ld, p90 %ld, p99 %ld, p999 %ld, "
+           "max %ld\n", sum->n ? sum->sum / sum->n : 0,
+           hist_percentile(sum, 0.5), hist_percentile(sum, 0.9),
+           hist_percentile(sum, 0.99), hist_percentile(sum, 0.999),
+           sum->max);
+    printf("hit ratio %.4f, %ld errors, %ld connections opened\n",
+           requests ? (double)hits / requests : 0, errors, connects);
+    free(sum);
+    free(clients);
+    free(zipf_cdf);
+    return errors > 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-c conns] [-d secs] [-w secs] [-n files] "
+            "[-s zipf] [-k requests] proxy_host:port origin_host:port\n"
+            "       %s -g dir [-n files]\n", prog, prog);
+    exit(1);
+}
+
+void split_host_port(char *arg, char *host, char *port) {
+    char *colon = strrchr(arg, ':');
+    if (colon == NULL) {
+        app_error("expected host:port");
+    }
+    *colon = '\0';
+    strncpy(host, arg, MAXLINE - 1);
+    strncpy(port, colon + 1, MAXLINE - 1);
+}
+
+long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// xorshift64*
+unsigned long next_random(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dUL;
+}
+
+// the same for every run, so the corpus need not travel with the numbers
+long file_size(int id) {
+    unsigned long seed = 0x2545f4914f6cdd1dUL ^ (unsigned long)(id + 1);
+    double u = (next_random(&seed) >> 11) / 9007199254740992.0;
+    return (long)(MIN_FILE_SIZE *
+                  pow((double)MAX_FILE_SIZE / MIN_FILE_SIZE, u));
+}
+
+void write_corpus(const char *dir) {
+    char path[MAXLINE];
+    char *data = Malloc(MAX_FILE_SIZE);
+    for (int i = 0; i < MAX_FILE_SIZE; ++i) {
+        data[i] = 'a' + i % 26;
+    }
+    for (int id = 0; id < nfiles; ++id) {
+        snprintf(path, sizeof(path), "%s/f%d", dir, id);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            unix_error("open corpus file");
+        }
+        long size = file_size(id);
+        if (write(fd, data, size) != size) {
+            unix_error("write corpus file");
+        }
+        Close(fd);
+    }
+    free(data);
+}
+
+void init_zipf(double s) {
+    zipf_cdf = Malloc(nfiles * sizeof(double));
+    double total = 0;
+    for (int k = 0; k < nfiles; ++k) {
+        total += 1 / pow(k + 1, s);
+        zipf_cdf[k] = total;
+    }
+    for (int k = 0; k < nfiles; ++k) {
+        zipf_cdf[k] /= total;
+    }
+}
+
+// the first rank whose cdf reaches a uniform draw
+int pick_file(unsigned long *seed) {
+    double u = (next_random(seed) >> 11) / 9007199254740992.0;
+    int lo = 0, hi = nfiles - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void *client_func(void *vargp) {
+    client_t *cl = vargp;
+    int fd = -1;
+    int sent = 0;           // on this connection
+
+    while (atomic_load(&phase) != PHASE_STOP) {
+        if (fd < 0) {
+            fd = open_clientfd(proxy_host, proxy_port);
+            if (fd < 0) {
+                cl->errors++;
+                usleep(10000);
+                continue;
+            }
+            cl->connects++;
+            sent = 0;
+        }
+        int id = pick_file(&cl->seed);
+        int measured = atomic_load(&phase) == PHASE_MEASURE;
+        long start = now_us();
+        long len;
+        int hit;
+        int rc = fetch(cl, fd, id, &len, &hit);
+        long end = now_us();
+
+        // the proxy may have closed an idle connection just as it was
+        // used again, that is no error
+        if (rc == FETCH_CLOSED && sent > 0) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        sent++;
+
+        // only what was asked for and answered while measuring counts
+        measured = measured && atomic_load(&phase) == PHASE_MEASURE;
+        if (rc < 0) {
+            cl->errors += measured;
+        } else if (measured) {
+            record_hist(&cl->latency, end - start);
+            cl->requests++;
+            cl->bytes += len;
+            cl->hits += hit;
+        }
+        if (rc <= 0 || sent == per_conn) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+/* one request and its response; the body length in *len. Returns 1 if
+ * the connection can take the next request, 0 if it must be closed, or
+ * FETCH_ERROR or FETCH_CLOSED */
+int fetch(client_t *cl, int fd, int id, long *len, int *hit) {
+    char req[MAXLINE];
+    int n = snprintf(req, sizeof(req), "GET http://%s/f%d HTTP/1.1\r\n"
+                     "Host: %s\r\n\r\n", origin, id, origin);
+    if (rio_writen(fd, req, n) != n) {
+        return FETCH_CLOSED;
+    }
+
+    char *buf = cl->buf;
+    size_t have = 0;
+    char *eoh;
+    while ((eoh = memmem(buf, have, "\r\n\r\n", 4)) == NULL) {
+        int rc = read_more(fd, buf, &have, RESP_BUF_SIZE);
+        if (rc <= 0) {
+            return rc == 0 && have == 0 ? FETCH_CLOSED : FETCH_ERROR;
+        }
+    }
+    size_t hdrlen = eoh + 4 - buf;
+    http_response_t resp;
+    if (!parse_response_header(buf, hdrlen, &resp) || resp.status != 200) {
+        return FETCH_ERROR;
+    }
+    size_t vlen;
+    const char *v = find_header(buf, hdrlen, "X-Cache", &vlen);
+    *hit = v != NULL && vlen == 3 && strncasecmp(v, "HIT", 3) == 0;
+
+    // the proxy keeps an HTTP/1.1 client's connection after any response
+    // it can delimit, even one whose status line says HTTP/1.0 as the
+    // origin's did, unless it says otherwise
+    v = find_header(buf, hdrlen, "Connection", &vlen);
+    int keep = v == NULL || !value_has_token(v, v + vlen, "close");
+
+    // the body is only counted, so it is read over what came before
+    size_t body = have - hdrlen;
+    if (resp.chunked) {
+        chunk_decoder_t d;
+        init_chunk_decoder(&d);
+        size_t out;
+        *len = 0;
+        char *p = buf + hdrlen;
+        for (;;) {
+            ssize_t used = decode_chunked(&d, p, body, NULL, &out);
+            if (used < 0) {
+                return FETCH_ERROR;
+            }
+            *len += out;
+            if (chunk_decoder_done(&d)) {
+                break;
+            }
+            have = 0;
+            if (read_more(fd, buf, &have, RESP_BUF_SIZE) <= 0) {
+                return FETCH_ERROR;
+            }
+            p = buf;
+            body = have;
+        }
+    } else if (resp.content_length >= 0) {
+        while (body < resp.content_length) {
+            have = 0;
+            if (read_more(fd, buf, &have, RESP_BUF_SIZE) <= 0) {
+                return FETCH_ERROR;
+            }
+            body += have;
+        }
+        *len = resp.content_length;
+    } else {
+        // to the end of the connection
+        int rc;
+        while ((have = 0, rc = read_more(fd, buf, &have, RESP_BUF_SIZE)) > 0) {
+            body += have;
+        }
+        if (rc < 0) {
+            return FETCH_ERROR;
+        }
+        *len = body;
+        return 0;
+    }
+    return keep;
+}
+
+// append what the socket has to buf[0, *have); 0 at its end, -1 on an error
+int read_more(int fd, char *buf, size_t *have, size_t cap) {
+    if (*have == cap) {
+        return -1;      // a header that does not fit
+    }
+    ssize_t n;
+    while ((n = read(fd, buf + *have, cap - *have)) < 0 && errno == EINTR) {
+    }
+    if (n > 0) {
+        *have += n;
+    }
+    return n > 0 ? 1 : (int)n;
+}
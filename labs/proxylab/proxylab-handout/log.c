@@ -0,0 +1,457 @@
+/*
+ * log.c - asynchronous logger
+ *
+ * Every ring has one writer, its thread, and one reader, the logger, so
+ * head and tail are all they share. A record is a header followed by
+ * the arguments in the order the format takes them: 8 bytes for each
+ * number or pointer, strings copied with their NUL, rounded up to 8
+ * bytes. The logger walks the format again and prints each conversion
+ * with its own snprintf(). A record that does not fit before the end
+ * of the ring leaves a pad there and starts over at the beginning. Each
+ * pass of the logger merges what the rings hold by time stamp.
+ */
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "log.h"
+
+#define LOG_PAD -1          /* level of a pad record */
+#define LOG_SPEC_LEN 32
+
+typedef struct {
+    uint32_t len;           // header included, multiple of 8
+    int32_t level;
+    long ts;                // us, wall clock
+    const char *fmt;
+} log_rec_t;
+
+typedef struct log_ring_t log_ring_t;
+struct log_ring_t {
+    char data[LOG_RING_SIZE];
+    _Alignas(64) atomic_size_t head;    // written by the owner
+    _Alignas(64) atomic_size_t tail;    // written by the logger
+    atomic_long dropped;
+    log_ring_t *next;
+    size_t pos, end;        // the logger's, during a pass
+};
+
+/* one conversion of a format */
+typedef struct {
+    char spec[LOG_SPEC_LEN];    // for snprintf(), length is ll or none
+    int width_star, prec_star;
+    int prec;                   // digits after '.', -1 if none or '*'
+    int wide;                   // 8 byte integer
+    char conv;
+} log_spec_t;
+
+/* text waiting for one write() */
+typedef struct {
+    int fd;
+    size_t len;
+    char buf[65536];
+} log_out_t;
+
+static int min_level = LOG_INFO;
+static _Atomic(log_ring_t*) rings;     // all threads' rings, newest first
+static __thread log_ring_t *my_ring;
+static atomic_long written;
+
+static const char *level_names[] = { "debug", "info", "warn", "error" };
+
+static log_ring_t *get_ring(void);
+static const char *parse_spec(const char *f, log_spec_t *s);
+static size_t pack_args(const char *fmt, va_list ap, char *p, char *end);
+static void put_record(log_ring_t *r, log_rec_t *rec);
+static void *logger_func(void *arg);
+static int drain_rings(log_out_t *out, log_out_t *err);
+static log_rec_t *peek_ring(log_ring_t *r);
+static void format_record(log_rec_t *rec, log_out_t *o);
+static void write_out(log_out_t *o);
+
+void init_log(int level) {
+    min_level = level;
+    pthread_t tid;
+    Pthread_create(&tid, NULL, logger_func, NULL);
+}
+
+int parse_log_level(const char *name) {
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; ++i) {
+        if (!strcmp(name, level_names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int log_enabled(int level) {
+    return level >= min_level;
+}
+
+void log_msg(int level, const char *fmt, ...) {
+    if (level < min_level) {
+        return ;
+    }
+    _Alignas(8) char buf[LOG_MAX_RECORD];
+    log_rec_t *rec = (log_rec_t*)buf;
+    va_list ap;
+    va_start(ap, fmt);
+    size_t n = pack_args(fmt, ap, buf + sizeof(log_rec_t),
+                         buf + LOG_MAX_RECORD);
+    va_end(ap);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->len = sizeof(log_rec_t) + n;
+    rec->level = level;
+    rec->ts = ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+    rec->fmt = fmt;
+    put_record(get_ring(), rec);
+}
+
+void print_log_stats(void) {
+    long dropped = 0;
+    int n = 0;
+    for (log_ring_t *r = atomic_load(&rings); r != NULL; r = r->next) {
+        dropped += atomic_load(&r->dropped);
+        n++;
+    }
+    fprintf(stderr, "log: %ld lines written, %ld dropped, %d threads\n",
+            atomic_load(&written), dropped, n);
+}
+
+
+// the calling thread's ring, made on its first record
+log_ring_t *get_ring(void) {
+    if (my_ring == NULL) {
+        log_ring_t *r = (log_ring_t*) Malloc(sizeof(log_ring_t));
+        atomic_init(&r->head, 0);
+        atomic_init(&r->tail, 0);
+        atomic_init(&r->dropped, 0);
+        r->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &r->next, r)) {
+            ;
+        }
+        my_ring = r;
+    }
+    return my_ring;
+}
+
+// f is at a '%' that is not "%%", returns what follows the conversion
+const char *parse_spec(const char *f, log_spec_t *s) {
+    int n = 0;
+    s->spec[n++] = *f++;
+    s->width_star = s->prec_star = s->wide = 0;
+    s->prec = -1;
+    while (*f != '\0' && strchr("-+ #0", *f) != NULL && n < 8) {
+        s->spec[n++] = *f++;
+    }
+    if (*f == '*') {
+        s->width_star = 1;
+        s->spec[n++] = *f++;
+    }
+    while (isdigit((unsigned char)*f) && n < 16) {
+        s->spec[n++] = *f++;
+    }
+    if (*f == '.') {
+        s->spec[n++] = *f++;
+        if (*f == '*') {
+            s->prec_star = 1;
+            s->spec[n++] = *f++;
+        } else {
+            s->prec = 0;
+        }
+        while (isdigit((unsigned char)*f) && n < 24) {
+            s->prec = s->prec * 10 + (*f - '0');
+            s->spec[n++] = *f++;
+        }
+    }
+    // lengths of 8 bytes are all passed as long long
+    while (*f != '\0' && strchr("hlzjtL", *f) != NULL) {
+        s->wide |= *f != 'h';
+        f++;
+    }
+    s->conv = *f != '\0' ? *f++ : 's';
+    if (s->wide && strchr("diuxXo", s->conv) != NULL) {
+        s->spec[n++] = 'l';
+        s->spec[n++] = 'l';
+    } else {
+        s->wide = 0;
+    }
+    s->spec[n++] = s->conv;
+    s->spec[n] = '\0';
+    return f;
+}
+
+// the arguments fmt takes, into [p, end); bytes used
+size_t pack_args(const char *fmt, va_list ap, char *p, char *end) {
+    char *start = p;
+    const char *f = fmt;
+    while ((f = strchr(f, '%')) != NULL) {
+        if (f[1] == '%') {
+            f += 2;
+            continue;
+        }
+        log_spec_t s;
+        f = parse_spec(f, &s);
+
+        int64_t v[2];
+        int nv = 0;
+        if (s.width_star) {
+            v[nv++] = va_arg(ap, int);
+        }
+        if (s.prec_star) {
+            s.prec = va_arg(ap, int);
+            v[nv++] = s.prec;
+        }
+        for (int i = 0; i < nv; ++i) {
+            if (p + 8 > end) {
+                return p - start;
+            }
+            memcpy(p, &v[i], 8);
+            p += 8;
+        }
+
+        if (s.conv == 's') {
+            // cut to fit, keeping room for a few numbers after it
+            const char *str = va_arg(ap, const char *);
+            if (str == NULL) {
+                str = "(null)";
+            }
+            long room = end - p - 64;
+            if (room < 1) {
+                return p - start;
+            }
+            size_t max = room - 1;
+            if (s.prec >= 0 && (size_t)s.prec < max) {
+                max = s.prec;
+            }
+            size_t len = strnlen(str, max);
+            memcpy(p, str, len);
+            p[len] = '\0';
+            p += (len + 8) & ~7;
+            continue;
+        }
+
+        if (p + 8 > end) {
+            return p - start;
+        }
+        switch (s.conv) {
+        case 'e': case 'E': case 'f': case 'F':
+        case 'g': case 'G': case 'a': case 'A': {
+            double d = va_arg(ap, double);
+            memcpy(p, &d, 8);
+            break;
+        }
+        case 'p': {
+            void *ptr = va_arg(ap, void *);
+            memcpy(p, &ptr, 8);
+            break;
+        }
+        default: {
+            int64_t i = s.wide ? va_arg(ap, long long) : va_arg(ap, int);
+            memcpy(p, &i, 8);
+        }
+        }
+        p += 8;
+    }
+    return p - start;
+}
+
+// never waits: a full ring loses the record
+void put_record(log_ring_t *r, log_rec_t *rec) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t len = (rec->len + 7) & ~7;
+    size_t off = head & (LOG_RING_SIZE - 1);
+    size_t pad = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : 0;
+    if (head + pad + len - tail > LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return ;
+    }
+    if (pad > 0) {
+        // a tail shorter than a header is skipped without one
+        if (pad >= sizeof(log_rec_t)) {
+            log_rec_t *p = (log_rec_t*)(r->data + off);
+            p->len = pad;
+            p->level = LOG_PAD;
+        }
+        head += pad;
+        off = 0;
+    }
+    rec->len = len;
+    memcpy(r->data + off, rec, len);
+    atomic_store_explicit(&r->head, head + len, memory_order_release);
+}
+
+void *logger_func(void *arg) {
+    Pthread_detach(Pthread_self());
+    static log_out_t out = { .fd = STDOUT_FILENO };
+    static log_out_t err = { .fd = STDERR_FILENO };
+    while (1) {
+        int busy = drain_rings(&out, &err);
+        write_out(&out);
+        write_out(&err);
+        if (!busy) {
+            usleep(LOG_IDLE_SLEEP * 1000);
+        }
+    }
+    return NULL;
+}
+
+// format what the rings hold, oldest first; 0 if they were empty
+int drain_rings(log_out_t *out, log_out_t *err) {
+    log_ring_t *first = atomic_load(&rings);
+    for (log_ring_t *r = first; r != NULL; r = r->next) {
+        r->pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        r->end = atomic_load_explicit(&r->head, memory_order_acquire);
+    }
+
+    int busy = 0;
+    while (1) {
+        log_ring_t *best = NULL;
+        log_rec_t *rec = NULL;
+        for (log_ring_t *r = first; r != NULL; r = r->next) {
+            log_rec_t *next = peek_ring(r);
+            if (next != NULL && (rec == NULL || next->ts < rec->ts)) {
+                best = r;
+                rec = next;
+            }
+        }
+        if (best == NULL) {
+            break;
+        }
+        format_record(rec, rec->level >= LOG_WARN ? err : out);
+        best->pos += rec->len;
+        busy = 1;
+    }
+
+    for (log_ring_t *r = first; r != NULL; r = r->next) {
+        atomic_store_explicit(&r->tail, r->pos, memory_order_release);
+    }
+    return busy;
+}
+
+// the next record of the pass in r, past any pad, NULL at its end
+log_rec_t *peek_ring(log_ring_t *r) {
+    while (r->pos != r->end) {
+        size_t off = r->pos & (LOG_RING_SIZE - 1);
+        if (LOG_RING_SIZE - off < sizeof(log_rec_t)) {
+            r->pos += LOG_RING_SIZE - off;  // a tail too short for a pad
+            continue;
+        }
+        log_rec_t *rec = (log_rec_t*)(r->data + off);
+        if (rec->level != LOG_PAD) {
+            return rec;
+        }
+        r->pos += rec->len;
+    }
+    return NULL;
+}
+
+void format_record(log_rec_t *rec, log_out_t *o) {
+    if (sizeof(o->buf) - o->len < 2 * LOG_MAX_RECORD) {
+        write_out(o);
+    }
+    char *dst = o->buf + o->len;
+    size_t room = 2 * LOG_MAX_RECORD - 1;   // the newline goes after it
+    size_t n = 0;
+
+    time_t sec = rec->ts / 1000000;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    n += snprintf(dst, room, "%02d:%02d:%02d.%03ld ", tm.tm_hour, tm.tm_min,
+                  tm.tm_sec, rec->ts / 1000 % 1000);
+    if (rec->level >= LOG_WARN) {
+        n += snprintf(dst + n, room - n, "%s: ", level_names[rec->level]);
+    }
+
+    const char *p = (const char *)(rec + 1);
+    const char *end = (const char *)rec + rec->len;
+    const char *f = rec->fmt;
+    while (*f != '\0' && n < room) {
+        if (*f != '%') {
+            dst[n++] = *f++;
+            continue;
+        }
+        if (f[1] == '%') {
+            dst[n++] = '%';
+            f += 2;
+            continue;
+        }
+        log_spec_t s;
+        f = parse_spec(f, &s);
+
+        int64_t stars[2];
+        int nstars = s.width_star + s.prec_star;
+        if (p + 8 * nstars > end) {
+            break;  // cut short when it was packed
+        }
+        for (int i = 0; i < nstars; ++i) {
+            memcpy(&stars[i], p, 8);
+            p += 8;
+        }
+        if (p >= end) {
+            break;
+        }
+
+        // one snprintf() per conversion, with its stars in front
+#define EMIT(v) \
+        (nstars == 0 ? snprintf(dst + n, room - n, s.spec, v) : \
+         nstars == 1 ? snprintf(dst + n, room - n, s.spec, (int)stars[0], v) : \
+         snprintf(dst + n, room - n, s.spec, (int)stars[0], (int)stars[1], v))
+        int w;
+        if (s.conv == 's') {
+            w = EMIT(p);
+            p += (strlen(p) + 8) & ~7;
+        } else {
+            int64_t i;
+            double d;
+            void *ptr;
+            switch (s.conv) {
+            case 'e': case 'E': case 'f': case 'F':
+            case 'g': case 'G': case 'a': case 'A':
+                memcpy(&d, p, 8);
+                w = EMIT(d);
+                break;
+            case 'p':
+                memcpy(&ptr, p, 8);
+                w = EMIT(ptr);
+                break;
+            case 'd': case 'i': case 'c':
+                memcpy(&i, p, 8);
+                w = s.wide ? EMIT((long long)i) : EMIT((int)i);
+                break;
+            default:
+                memcpy(&i, p, 8);
+                w = s.wide ? EMIT((unsigned long long)i) : EMIT((unsigned)i);
+            }
+            p += 8;
+        }
+#undef EMIT
+        if (w > 0) {
+            n += w;
+        }
+    }
+    if (n > room) {
+        n = room;
+    }
+    dst[n++] = '\n';
+    o->len += n;
+    atomic_fetch_add_explicit(&written, 1, memory_order_relaxed);
+}
+
+void write_out(log_out_t *o) {
+    size_t done = 0;
+    while (done < o->len) {
+        ssize_t n = write(o->fd, o->buf + done, o->len - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;  // nowhere to log that
+        }
+        done += n;
+    }
+    o->len = 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * log.h - asynchronous logger
+ *
+ * A log call formats nothing and takes no lock: it copies the format
+ * pointer and the raw arguments into a record in its thread's own ring,
+ * and a logger thread turns the records into text and writes them out in
+ * batches. A ring with no room drops the record and counts it, so a
+ * slow terminal never stalls a reactor. Lines come out in time order
+ * within each batch the logger writes.
+ */
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "csapp.h"
+
+#define LOG_RING_SIZE 262144    /* bytes per thread, power of two */
+#define LOG_MAX_RECORD 2048     /* bytes, longer strings are cut */
+#define LOG_IDLE_SLEEP 5        /* ms the logger waits when all is drained */
+
+enum log_level {
+    LOG_DEBUG,
+    LOG_INFO,      // this and debug go to stdout
+    LOG_WARN,      // this and error go to stderr
+    LOG_ERROR,
+};
+
+/* start the logger thread, records below level are skipped */
+void init_log(int level);
+
+/* level by name, -1 if there is none */
+int parse_log_level(const char *name);
+
+/* whether records of level are kept, to skip work done only for them */
+int log_enabled(int level);
+
+/* fmt must stay valid for good (a literal): only the pointer is kept.
+ * Conversions: d i u x X o c s p e f g and %%, with the usual flags,
+ * widths, precisions and h hh l ll z j t lengths. */
+void log_msg(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+void print_log_stats(void);
+
+#endif /* __LOG_H__ */
@@ -0,0 +1,146 @@
+/*
+ * outvec.c - scatter-gather output builder
+ *
+ * Own bytes are recorded by offset, not address, since the buffer may
+ * move while the message is put together; addresses are only taken when
+ * the iovecs for sendmsg() are filled in. A segment that continues the
+ * previous one, like consecutive header lines forwarded unchanged,
+ * extends it instead of taking another iovec.
+ */
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "outvec.h"
+
+static out_seg_t *last_seg(outvec_t *v, const char *base);
+static void add_seg(outvec_t *v, const char *base, size_t off, size_t n);
+static void reserve_own(outvec_t *v);
+
+void init_outvec(outvec_t *v) {
+    memset(v, 0, sizeof(*v));
+}
+
+void free_outvec(outvec_t *v) {
+    free(v->segs);
+    free(v->own.data);
+}
+
+void reset_outvec(outvec_t *v) {
+    v->nsegs = 0;
+    v->own.len = 0;
+    v->cur = 0;
+    v->curoff = 0;
+    v->left = 0;
+}
+
+void rewind_outvec(outvec_t *v) {
+    v->left = 0;
+    for (int i = 0; i < v->nsegs; ++i) {
+        v->left += v->segs[i].len;
+    }
+    v->cur = 0;
+    v->curoff = 0;
+}
+
+void ref_outvec(outvec_t *v, const void *p, size_t n) {
+    out_seg_t *s = last_seg(v, p);
+    if (s != NULL && s->base + s->off + s->len == (const char *)p) {
+        s->len += n;
+        v->left += n;
+        return ;
+    }
+    add_seg(v, p, 0, n);
+}
+
+void copy_outvec(outvec_t *v, const void *p, size_t n) {
+    reserve_own(v);
+    size_t off = v->own.len;
+    append_strbuf(&v->own, p, n);
+    add_seg(v, NULL, off, n);
+}
+
+void printf_outvec(outvec_t *v, const char *fmt, ...) {
+    reserve_own(v);
+    size_t off = v->own.len;
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf_strbuf(&v->own, fmt, ap);
+    va_end(ap);
+    add_seg(v, NULL, off, v->own.len - off);
+}
+
+ssize_t send_outvec(outvec_t *v, int fd) {
+    struct iovec iov[OUTVEC_IOV];
+    int n = 0;
+    for (int i = v->cur; i < v->nsegs && n < OUTVEC_IOV; ++i) {
+        out_seg_t *s = &v->segs[i];
+        const char *p = (s->base != NULL ? s->base : v->own.data) + s->off;
+        size_t skip = i == v->cur ? v->curoff : 0;
+        iov[n].iov_base = (void *)(p + skip);
+        iov[n].iov_len = s->len - skip;
+        n++;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (sent <= 0) {
+        return sent;
+    }
+
+    v->left -= sent;
+    size_t rest = sent;
+    while (rest > 0) {
+        size_t seglen = v->segs[v->cur].len - v->curoff;
+        if (rest < seglen) {
+            v->curoff += rest;
+            break;
+        }
+        rest -= seglen;
+        v->cur++;
+        v->curoff = 0;
+    }
+    return sent;
+}
+
+
+// the last segment, if it is of the same kind (own bytes if base is NULL)
+// and not sent yet
+out_seg_t *last_seg(outvec_t *v, const char *base) {
+    if (v->nsegs == 0 || v->cur == v->nsegs) {
+        return NULL;
+    }
+    out_seg_t *s = &v->segs[v->nsegs - 1];
+    return (s->base == NULL) == (base == NULL) ? s : NULL;
+}
+
+void add_seg(outvec_t *v, const char *base, size_t off, size_t n) {
+    if (n == 0) {
+        return ;
+    }
+    v->left += n;
+    out_seg_t *s = last_seg(v, base);
+    if (base == NULL && s != NULL && s->off + s->len == off) {
+        s->len += n;    // own bytes right after the previous ones
+        return ;
+    }
+    if (v->nsegs == v->segcap) {
+        v->segcap = v->segcap ? v->segcap * 2 : 8;
+        v->segs = (out_seg_t*) Realloc(v->segs, v->segcap * sizeof(out_seg_t));
+    }
+    s = &v->segs[v->nsegs++];
+    s->base = base;
+    s->off = off;
+    s->len = n;
+}
+
+void reserve_own(outvec_t *v) {
+    if (v->own.data == NULL) {
+        init_strbuf(&v->own, 256);
+    }
+}
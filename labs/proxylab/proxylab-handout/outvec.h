@@ -0,0 +1,53 @@
+/*
+ * outvec.h - scatter-gather output builder
+ *
+ * A message to send is put together as a list of segments: bytes that
+ * already sit somewhere else (the client's read buffer, a cached object,
+ * a flight block) are referenced where they are, and only lines the
+ * proxy makes up itself are copied, into a buffer the vector owns. The
+ * whole list goes out with one sendmsg() per call, as far as the socket
+ * takes it. Referenced bytes must stay put until they are sent.
+ */
+#ifndef __OUTVEC_H__
+#define __OUTVEC_H__
+
+#include "csapp.h"
+#include "request.h"
+
+#define OUTVEC_IOV 64       /* segments handed to one sendmsg() */
+
+typedef struct {
+    const char *base;       // NULL: at off in the vector's own bytes
+    size_t off, len;
+} out_seg_t;
+
+typedef struct {
+    out_seg_t *segs;
+    int nsegs, segcap;
+    strbuf_t own;           // bytes made up by the proxy
+    int cur;                // first segment not completely sent
+    size_t curoff;          // bytes of it already sent
+    size_t left;            // bytes not sent yet
+} outvec_t;
+
+void init_outvec(outvec_t *v);
+void free_outvec(outvec_t *v);
+
+/* drop all segments */
+void reset_outvec(outvec_t *v);
+
+/* send everything again from the start */
+void rewind_outvec(outvec_t *v);
+
+/* n bytes at p, sent from where they are */
+void ref_outvec(outvec_t *v, const void *p, size_t n);
+
+/* n bytes copied into the vector */
+void copy_outvec(outvec_t *v, const void *p, size_t n);
+void printf_outvec(outvec_t *v, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* one sendmsg() of what is left, bytes sent or -1 with errno set */
+ssize_t send_outvec(outvec_t *v, int fd);
+
+#endif /* __OUTVEC_H__ */
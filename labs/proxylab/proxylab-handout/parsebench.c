@@ -0,0 +1,319 @@
+/*
+ * parsebench.c - request parser microbenchmark
+ *
+ * Parses and rewrites the same request header over and over, once with
+ * the line-by-line parser the proxy used to have (copied below, with its
+ * 64-byte line buffers) and once with request.c. The old parser can only
+ * take requests whose lines fit in 64 bytes, so the browser-like request
+ * with a long URL and cookies is run through the new one only, whole and
+ * arriving in small reads.
+ *
+ * usage: ./parsebench [iterations]
+ */
+#include <stdarg.h>
+#include <time.h>
+
+#include "csapp.h"
+#include "http.h"
+#include "request.h"
+
+#define MAX_LINE_LEN 64
+#define MAX_REQUEST_LEN 16384
+
+static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+
+static const char *short_req =
+    "GET http://localhost:15213/home.html HTTP/1.1\r\n"
+    "Host: localhost:15213\r\n"
+    "User-Agent: curl/7.81.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Proxy-Connection: Keep-Alive\r\n"
+    "\r\n";
+
+static const char *browser_req =
+    "GET http://www.example.com:8080/assets/js/vendor/app.bundle.min.js"
+    "?v=3f9a1c2e7b&session=0d8e4b2a61f74c39a7e5&utm_source=newsletter"
+    "&utm_medium=email&utm_campaign=autumn_launch HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://www.example.com:8080/products/category/shoes"
+    "?sort=price&page=2\r\n"
+    "Cookie: _ga=GA1.2.1234567890.1697040000; _gid=GA1.2.987654321."
+    "1697040000; sessionid=5f2b7c9e1a3d4f6b8c0e2a4d6f8b0c2e; csrftoken="
+    "Xy7Kq2Lm9Np4Rs6Tu8Vw0Yz1Ab3Cd5Ef7Gh9Ij1Kl3Mn5Op7Qr9St1Uv3Wx5Yz; "
+    "theme=dark; consent=analytics%2Cmarketing; cart=7a1f3e9c\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "\r\n";
+
+static long now_ns(void);
+static int old_parse(const char *buf, size_t len, char *out, size_t *outlen);
+static int new_parse(const char *buf, size_t len, size_t piece,
+                     strbuf_t *out);
+static void run(const char *name, const char *req, size_t piece, int old,
+                long iters);
+
+int main(int argc, char **argv) {
+    long iters = argc > 1 ? atol(argv[1]) : 1000000;
+
+    run("short, old parser", short_req, 0, 1, iters);
+    run("short, new parser", short_req, 0, 0, iters);
+    run("browser, new parser", browser_req, 0, 0, iters);
+    run("browser, new parser, 64-byte reads", browser_req, 64, 0, iters);
+
+    char out[MAX_REQUEST_LEN];
+    size_t outlen;
+    printf("browser, old parser: %s\n",
+           old_parse(browser_req, strlen(browser_req), out, &outlen)
+           ? "parsed (truncated)" : "rejected");
+    return 0;
+}
+
+void run(const char *name, const char *req, size_t piece, int old,
+         long iters) {
+    size_t len = strlen(req);
+    char out[MAX_REQUEST_LEN];
+    size_t outlen = 0;
+    strbuf_t sb;
+    init_strbuf(&sb, 256);
+
+    long start = now_ns();
+    for (long i = 0; i < iters; ++i) {
+        int ok = old ? old_parse(req, len, out, &outlen)
+                     : new_parse(req, len, piece, &sb);
+        if (!ok) {
+            app_error("parse failed");
+        }
+    }
+    long ns = now_ns() - start;
+    printf("%-40s %4zu bytes  %7.1f ns/request  %6.0f MB/s\n", name, len,
+           (double)ns / iters, (double)len * iters / ns * 1000);
+    free(sb.data);
+}
+
+long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/* the new parser and the rewrite process_client() does with it, fed the
+ * request piece bytes at a time if piece is not 0 */
+int new_parse(const char *buf, size_t len, size_t piece, strbuf_t *out) {
+    req_parser_t p;
+    init_request(&p);
+    int rc = PARSE_AGAIN;
+    for (size_t have = piece ? piece : len; rc == PARSE_AGAIN; have += piece) {
+        rc = parse_request(&p, buf, have < len ? have : len);
+    }
+    span_t host, port, path;
+    if (rc != PARSE_DONE || !span_is(buf, p.method, "GET") ||
+        !split_url(buf, p.url, &host, &port, &path)) {
+        return 0;
+    }
+
+    out->len = 0;
+    append_strbuf(out, "GET ", 4);
+    append_strbuf(out, buf + path.off, path.len);
+    append_strbuf(out, " HTTP/1.1\r\n", 11);
+    for (int i = 0; i < p.nheaders; ++i) {
+        span_t name = p.headers[i].name, value = p.headers[i].value;
+        if (span_is(buf, name, "User-Agent")) {
+            append_strbuf(out, user_agent_hdr, strlen(user_agent_hdr));
+            continue;
+        } else if (span_is(buf, name, "Connection") ||
+                   span_is(buf, name, "Proxy-Connection")) {
+            value_has_token(buf + value.off, buf + value.off + value.len,
+                            "close");
+            continue;
+        }
+        append_strbuf(out, buf + name.off, name.len);
+        append_strbuf(out, ": ", 2);
+        append_strbuf(out, buf + value.off, value.len);
+        append_strbuf(out, "\r\n", 2);
+    }
+    append_strbuf(out, "Connection: keep-alive\r\n", 24);
+    append_strbuf(out, "\r\n", 2);
+    return 1;
+}
+
+
+/* the old parser, as it was in proxy.c */
+typedef struct {
+    const char *pos;
+    const char *end;
+} linebuf_t;
+
+static ssize_t read_line(linebuf_t *lp, char *usrbuf, size_t maxlen) {
+    size_t n = 0;
+    while (n < maxlen - 1 && lp->pos < lp->end) {
+        char ch = *lp->pos++;
+        usrbuf[n++] = ch;
+        if (ch == '\n') {
+            break;
+        }
+    }
+    usrbuf[n] = '\0';
+    return n;
+}
+
+static int append(char **pte, const char *end, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int cnt = vsnprintf(*pte, end - *pte, fmt, ap);
+    va_end(ap);
+    if (cnt < 0 || cnt >= end - *pte) {
+        return 0;
+    }
+    *pte += cnt;
+    return 1;
+}
+
+static int process_url(const char *url, char *hostName, char *port,
+                       char *path) {
+    char urlcopy[MAX_LINE_LEN];
+    strcpy(urlcopy, url);
+    char *p = strstr(urlcopy, "http://");
+    if (p == NULL) {
+        return 0;
+    }
+    p += strlen("http://");
+    char *del_colon = strchr(p, ':');
+    char *del_slash = strchr(p, '/');
+    if (del_slash == NULL) {
+        return 0;
+    }
+    if (del_colon == NULL) {
+        strcpy(port, "80");
+        *del_slash = '\0';
+        strcpy(hostName, p);
+    } else {
+        *del_colon = '\0';
+        strcpy(hostName, p);
+        p = del_colon + 1;
+        *del_slash = '\0';
+        strcpy(port, p);
+    }
+    p = del_slash + 1;
+    path[0] = '/';
+    path[1] = '\0';
+    strncat(path, p, MAX_LINE_LEN - 2);
+    return 1;
+}
+
+static int process_http_header(linebuf_t *lp, char *method, char *hostName,
+                               char *port, char *path, char *version) {
+    char usrbuf[MAX_LINE_LEN];
+    method[0] = '\0';
+    ssize_t len = read_line(lp, usrbuf, MAX_LINE_LEN);
+    if (len < 2 || usrbuf[len - 1] != '\n') {
+        return 0;
+    }
+    usrbuf[len - 2] = ' ';
+    char *arr = usrbuf;
+    char *p = strchr(arr, ' ');
+    if (p == NULL) {
+        return 0;
+    }
+    *p = '\0';
+    strcpy(method, arr);
+    if (strcmp(method, "GET")) {
+        return 0;
+    }
+    char url[MAX_LINE_LEN];
+    arr = p + 1;
+    p = strchr(arr, ' ');
+    if (p == NULL) {
+        return 0;
+    }
+    *p = '\0';
+    strcpy(url, arr);
+    if (!process_url(url, hostName, port, path)) {
+        return 0;
+    }
+    arr = p + 1;
+    p = strchr(arr, ' ');
+    if (p == NULL || p == arr) {
+        return 0;
+    }
+    *p = '\0';
+    strcpy(version, arr);
+    return 1;
+}
+
+static int process_request_header(linebuf_t *lp, char **pte,
+                                  const char *end, const char *hostName,
+                                  int *closeFlag) {
+    char usrbuf[MAX_LINE_LEN];
+    int nbytes;
+    int hostFlag = 0;
+    while ((nbytes = read_line(lp, usrbuf, MAX_LINE_LEN))) {
+        if (nbytes == 2 && !strcmp(usrbuf, "\r\n")) {
+            break;
+        }
+        char header[MAX_LINE_LEN], content[MAX_LINE_LEN];
+        char *p = usrbuf;
+        char *delimeter = strchr(p, ':');
+        if (delimeter == NULL) {
+            return 0;
+        }
+        *delimeter = '\0';
+        strcpy(header, p);
+        p = delimeter + 1;
+        strcpy(content, p);
+
+        int ok;
+        if (!strcmp(header, "Host")) {
+            hostFlag = 1;
+            ok = append(pte, end, "%s:%s", header, content);
+        } else if (!strcmp(header, "User-Agent")) {
+            ok = append(pte, end, "%s", user_agent_hdr);
+        } else if (!strcasecmp(header, "Connection") ||
+                   !strcasecmp(header, "Proxy-Connection")) {
+            if (value_has_token(content, content + strlen(content), "close")) {
+                *closeFlag = 1;
+            }
+            ok = 1;
+        } else if (!strcasecmp(header, "Keep-Alive")) {
+            ok = 1;
+        } else {
+            ok = append(pte, end, "%s:%s", header, content);
+        }
+        if (!ok) {
+            return 0;
+        }
+    }
+    if (!hostFlag && !append(pte, end, "Host: %s\r\n", hostName)) {
+        return 0;
+    }
+    if (!append(pte, end, "Connection: keep-alive\r\n")) {
+        return 0;
+    }
+    return append(pte, end, "\r\n");
+}
+
+int old_parse(const char *buf, size_t len, char *out, size_t *outlen) {
+    linebuf_t lb = { buf, buf + len };
+    char method[MAX_LINE_LEN], path[MAX_LINE_LEN], version[MAX_LINE_LEN];
+    char hostName[MAX_LINE_LEN], port[MAX_LINE_LEN];
+    char *p = out;
+    const char *end = out + MAX_REQUEST_LEN;
+    int closeFlag = 0;
+
+    if (!process_http_header(&lb, method, hostName, port, path, version) ||
+        !append(&p, end, "%s %s %s\r\n", method, path, "HTTP/1.1") ||
+        !process_request_header(&lb, &p, end, hostName, &closeFlag)) {
+        return 0;
+    }
+    *outlen = p - out;
+    return 1;
+}
@@ -0,0 +1,515 @@
+/*
+ * poller.c - fd events from epoll or io_uring
+ *
+ * Every watch has the user data (kind << 32 | gen << 34 | fd), for epoll
+ * as for io_uring, and an event is only passed on if gen is still that of
+ * its fd: a watch ended by unwatch_fd() may have events on the way, and
+ * with io_uring the kernel says so only later, once it has cancelled it.
+ * io_uring is driven by hand, without liburing: the rings are mapped
+ * once, submissions are only made visible to the kernel at the next wait.
+ */
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "poller.h"
+#include "log.h"
+
+enum watch_kind {
+    WATCH_NONE,
+    WATCH_POLL,         // readiness
+    WATCH_ACCEPT,
+    WATCH_RECV,         // the first read, then a poll
+};
+
+#define WATCH_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+#define CANCEL_DATA (~0UL)  /* cancel requests, their result is not used */
+
+static poll_slot_t *get_slot(poller_t *p, int fd);
+static uint64_t watch_data(poller_t *p, int fd);
+static poll_slot_t *find_slot(poller_t *p, uint64_t data);
+static int wait_epoll(poller_t *p, poll_event_t *out, int max, int timeout);
+
+static int init_uring(poller_t *p);
+static struct io_uring_sqe *get_sqe(poller_t *p);
+static void submit_uring(poller_t *p, int wait, int timeout);
+static void arm_uring(poller_t *p, int fd, int kind);
+static void return_buf(poller_t *p, unsigned short bid);
+static int wait_uring(poller_t *p, poll_event_t *out, int max, int timeout);
+static int reap_uring(poller_t *p, poll_event_t *out, int max);
+
+// epoll wrapper functions
+static int Epoll_create1(int flags);
+static int Epoll_wait(int epfd, struct epoll_event *events,
+                      int maxevents, int timeout);
+static int Epoll_ctl(int epfd, int op, int fd,
+                     struct epoll_event *event);
+
+int init_poller(poller_t *p, int backend) {
+    memset(p, 0, sizeof(*p));
+    p->epfd = -1;
+    p->ring_fd = -1;
+    if (backend == POLLER_URING && init_uring(p)) {
+        p->backend = POLLER_URING;
+    } else {
+        p->backend = POLLER_EPOLL;
+        p->epfd = Epoll_create1(EPOLL_CLOEXEC);
+    }
+    return p->backend;
+}
+
+const char *poller_name(const poller_t *p) {
+    return p->backend == POLLER_URING ? "io_uring" : "epoll";
+}
+
+void watch_fd(poller_t *p, int fd, void *data) {
+    poll_slot_t *s = get_slot(p, fd);
+    s->data = data;
+    s->kind = WATCH_POLL;
+    if (p->backend == POLLER_URING) {
+        arm_uring(p, fd, WATCH_POLL);
+        return ;
+    }
+    struct epoll_event ev;
+    ev.events = WATCH_EVENTS;
+    ev.data.u64 = watch_data(p, fd);
+    Epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void watch_first_read(poller_t *p, int fd, void *data) {
+    if (p->backend != POLLER_URING) {
+        watch_fd(p, fd, data);  // the owner reads once it is told to
+        return ;
+    }
+    poll_slot_t *s = get_slot(p, fd);
+    s->data = data;
+    s->kind = WATCH_RECV;
+    arm_uring(p, fd, WATCH_RECV);
+}
+
+void watch_accept(poller_t *p, int fd, void *data) {
+    poll_slot_t *s = get_slot(p, fd);
+    s->data = data;
+    s->kind = WATCH_ACCEPT;
+    if (p->backend == POLLER_URING) {
+        arm_uring(p, fd, WATCH_ACCEPT);
+        return ;
+    }
+    // level triggered, so connections left for the next batch are not
+    // forgotten
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = watch_data(p, fd);
+    Epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void unwatch_fd(poller_t *p, int fd, int closing) {
+    if (fd >= p->nslots || p->slots[fd].kind == WATCH_NONE) {
+        return ;
+    }
+    poll_slot_t *s = &p->slots[fd];
+    if (p->backend == POLLER_URING) {
+        // the request holds the file, the socket only closes once the
+        // kernel has seen this
+        struct io_uring_sqe *sqe = get_sqe(p);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = watch_data(p, fd);
+        sqe->user_data = CANCEL_DATA;
+    } else if (!closing) {
+        Epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    s->gen++;
+    s->kind = WATCH_NONE;
+    s->data = NULL;
+}
+
+int wait_poller(poller_t *p, poll_event_t *out, int max, int timeout) {
+    if (p->backend == POLLER_URING) {
+        return wait_uring(p, out, max, timeout);
+    }
+    return wait_epoll(p, out, max, timeout);
+}
+
+
+poll_slot_t *get_slot(poller_t *p, int fd) {
+    if (fd >= p->nslots) {
+        int n = p->nslots ? p->nslots : 1024;
+        while (n <= fd) {
+            n *= 2;
+        }
+        p->slots = (poll_slot_t*) Realloc(p->slots, n * sizeof(poll_slot_t));
+        memset(p->slots + p->nslots, 0,
+               (n - p->nslots) * sizeof(poll_slot_t));
+        p->nslots = n;
+    }
+    return &p->slots[fd];
+}
+
+uint64_t watch_data(poller_t *p, int fd) {
+    poll_slot_t *s = &p->slots[fd];
+    return (uint64_t)(unsigned)fd | (uint64_t)s->kind << 32 |
+           (uint64_t)(s->gen & 0x3fffffff) << 34;
+}
+
+// the slot an event is for, NULL if its watch has ended since
+poll_slot_t *find_slot(poller_t *p, uint64_t data) {
+    int fd = (int)(data & 0xffffffff);
+    if (data == CANCEL_DATA || fd >= p->nslots) {
+        return NULL;
+    }
+    poll_slot_t *s = &p->slots[fd];
+    if (s->kind != (int)((data >> 32) & 3) ||
+        (s->gen & 0x3fffffff) != data >> 34) {
+        return NULL;
+    }
+    return s;
+}
+
+int wait_epoll(poller_t *p, poll_event_t *out, int max, int timeout) {
+    if (p->nevents < max) {
+        p->events = (struct epoll_event*) Realloc(p->events,
+                        max * sizeof(struct epoll_event));
+        p->nevents = max;
+    }
+    int nfds = Epoll_wait(p->epfd, p->events, max, timeout);
+    int n = 0;
+    for (int i = 0; i < nfds; ++i) {
+        poll_slot_t *s = find_slot(p, p->events[i].data.u64);
+        if (s == NULL) {
+            continue;
+        }
+        if (s->kind != WATCH_ACCEPT) {
+            out[n].data = s->data;
+            out[n].events = p->events[i].events;
+            out[n].fd = -1;
+            out[n].buf = NULL;
+            out[n].len = 0;
+            n++;
+            continue;
+        }
+
+        // as many connections as there is room for, the rest of the
+        // batch still needs one each
+        int listenfd = (int)(p->events[i].data.u64 & 0xffffffff);
+        while (n < max - (nfds - i - 1)) {
+            int fd = accept4(listenfd, NULL, NULL,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno != EAGAIN) {
+                    // e.g. out of fds, retry on next event
+                    log_msg(LOG_WARN, "accept4: %s", strerror(errno));
+                }
+                break;
+            }
+            out[n].data = s->data;
+            out[n].events = EPOLLIN;
+            out[n].fd = fd;
+            out[n].buf = NULL;
+            out[n].len = 0;
+            n++;
+        }
+    }
+    return n;
+}
+
+
+int init_uring(poller_t *p) {
+    // one thread submits, so completions need only be handled when it
+    // waits (6.1); the ring starts disabled, as that thread is not the
+    // one setting it up
+    static const unsigned tries[] = {
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+        IORING_SETUP_R_DISABLED,
+        IORING_SETUP_COOP_TASKRUN,
+        0,
+    };
+    struct io_uring_params params;
+    int fd = -1;
+    for (int i = 0; i < sizeof(tries) / sizeof(tries[0]) && fd < 0; ++i) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE | tries[i];
+        params.cq_entries = URING_ENTRIES * 4;
+        fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+        if (fd < 0 && errno != EINVAL) {
+            break;
+        }
+    }
+    if (fd < 0) {
+        log_msg(LOG_WARN, "io_uring_setup: %s", strerror(errno));
+        return 0;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_EXT_ARG)) {
+        log_msg(LOG_WARN, "io_uring: kernel too old");
+        close(fd);
+        return 0;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe);
+    p->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    p->ring = mmap(NULL, p->ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    p->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                   IORING_OFF_SQES);
+    if (p->ring == MAP_FAILED || p->sqes == MAP_FAILED) {
+        unix_error("io_uring mmap error");
+    }
+    char *ring = (char*)p->ring;
+    p->ring_fd = fd;
+    p->disabled = (params.flags & IORING_SETUP_R_DISABLED) != 0;
+    p->sq_entries = params.sq_entries;
+    p->sq_head = (unsigned*)(ring + params.sq_off.head);
+    p->sq_ktail = (unsigned*)(ring + params.sq_off.tail);
+    p->sq_mask = *(unsigned*)(ring + params.sq_off.ring_mask);
+    p->sq_tail = *p->sq_ktail;
+    unsigned *array = (unsigned*)(ring + params.sq_off.array);
+    for (unsigned i = 0; i < p->sq_entries; ++i) {
+        array[i] = i;
+    }
+    p->cq_head = (unsigned*)(ring + params.cq_off.head);
+    p->cq_tail = (unsigned*)(ring + params.cq_off.tail);
+    p->cq_mask = *(unsigned*)(ring + params.cq_off.ring_mask);
+    p->cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+    // the read buffers, group 0; needs 5.19 as multishot accept does
+    p->buf_ring = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+    if (p->buf_ring == MAP_FAILED) {
+        unix_error("io_uring mmap error");
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)p->buf_ring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0) {
+        log_msg(LOG_WARN, "io_uring buffer ring: %s", strerror(errno));
+        munmap(p->buf_ring, URING_BUFS * sizeof(struct io_uring_buf));
+        munmap(p->sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        munmap(p->ring, p->ring_size);
+        close(fd);
+        p->ring_fd = -1;
+        return 0;
+    }
+    p->bufs = (char*) Malloc(URING_BUFS * URING_BUF_SIZE);
+    p->buf_tail = 0;
+    for (int i = 0; i < URING_BUFS; ++i) {
+        return_buf(p, i);
+    }
+    atomic_store_explicit((_Atomic unsigned short*)&p->buf_ring->tail,
+                          p->buf_tail, memory_order_release);
+    return 1;
+}
+
+// a zeroed entry of the submission queue, sent with the next wait
+struct io_uring_sqe *get_sqe(poller_t *p) {
+    unsigned head = atomic_load_explicit((_Atomic unsigned*)p->sq_head,
+                                         memory_order_acquire);
+    if (p->sq_tail - head == p->sq_entries) {
+        submit_uring(p, 0, 0);  // full, the kernel takes them now
+    }
+    struct io_uring_sqe *sqe = &p->sqes[p->sq_tail & p->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    p->sq_tail++;
+    return sqe;
+}
+
+// hand the queued entries over, and wait for one completion if asked
+void submit_uring(poller_t *p, int wait, int timeout) {
+    if (p->disabled) {
+        // the first call on the thread that owns the ring
+        if (syscall(__NR_io_uring_register, p->ring_fd,
+                    IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0) {
+            unix_error("io_uring enable error");
+        }
+        p->disabled = 0;
+    }
+    atomic_store_explicit((_Atomic unsigned*)p->sq_ktail, p->sq_tail,
+                          memory_order_release);
+    unsigned head = atomic_load_explicit((_Atomic unsigned*)p->sq_head,
+                                         memory_order_acquire);
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void *argp = NULL;
+    size_t argsz = 0;
+    if (wait && timeout >= 0) {
+        memset(&arg, 0, sizeof(arg));
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        arg.ts = (unsigned long)&ts;
+        argp = &arg;
+        argsz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    if (syscall(__NR_io_uring_enter, p->ring_fd, p->sq_tail - head,
+                wait ? 1 : 0, flags, argp, argsz) < 0 &&
+        errno != EINTR && errno != ETIME && errno != EBUSY &&
+        errno != EAGAIN) {
+        unix_error("io_uring_enter error");
+    }
+}
+
+void arm_uring(poller_t *p, int fd, int kind) {
+    struct io_uring_sqe *sqe = get_sqe(p);
+    sqe->fd = fd;
+    sqe->user_data = watch_data(p, fd);
+    if (kind == WATCH_POLL) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = WATCH_EVENTS;
+        sqe->len = IORING_POLL_ADD_MULTI;
+    } else if (kind == WATCH_ACCEPT) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->len = URING_BUF_SIZE;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+    }
+}
+
+// put buffer bid back in the ring, seen by the kernel once the tail is
+void return_buf(poller_t *p, unsigned short bid) {
+    struct io_uring_buf *b = &p->buf_ring->bufs[p->buf_tail &
+                                                (URING_BUFS - 1)];
+    b->addr = (unsigned long)(p->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    p->buf_tail++;
+}
+
+int wait_uring(poller_t *p, poll_event_t *out, int max, int timeout) {
+    // the buffers of the last batch have been read by now
+    if (p->nlent > 0) {
+        for (int i = 0; i < p->nlent; ++i) {
+            return_buf(p, p->lent[i]);
+        }
+        p->nlent = 0;
+        atomic_store_explicit((_Atomic unsigned short*)&p->buf_ring->tail,
+                              p->buf_tail, memory_order_release);
+    }
+
+    // no syscall at all if events are waiting and nothing is to be sent
+    int n = reap_uring(p, out, max);
+    if (n == 0 || p->sq_tail != *p->sq_ktail) {
+        submit_uring(p, n == 0, timeout);
+        n += reap_uring(p, out + n, max - n);
+    }
+    return n;
+}
+
+int reap_uring(poller_t *p, poll_event_t *out, int max) {
+    unsigned head = *p->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned*)p->cq_tail,
+                                         memory_order_acquire);
+    int n = 0;
+    for (; head != tail && n < max; ++head) {
+        struct io_uring_cqe *cqe = &p->cqes[head & p->cq_mask];
+        poll_slot_t *s = find_slot(p, cqe->user_data);
+        int fd = (int)(cqe->user_data & 0xffffffff);
+        int more = cqe->flags & IORING_CQE_F_MORE;
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            // lent to the event, or to nobody if the watch is gone
+            p->lent[p->nlent++] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        }
+        if (s == NULL) {
+            continue;
+        }
+
+        poll_event_t *e = &out[n];
+        e->data = s->data;
+        e->events = 0;
+        e->fd = -1;
+        e->buf = NULL;
+        e->len = 0;
+        if (s->kind == WATCH_POLL) {
+            if (cqe->res < 0) {
+                // the poll is over, the owner learns why on its next read
+                e->events = EPOLLERR | EPOLLIN | EPOLLOUT;
+                s->kind = WATCH_NONE;
+            } else {
+                e->events = cqe->res;
+                if (!more) {
+                    arm_uring(p, fd, WATCH_POLL);   // e.g. after overflow
+                }
+            }
+        } else if (s->kind == WATCH_ACCEPT) {
+            if (cqe->res >= 0) {
+                e->events = EPOLLIN;
+                e->fd = cqe->res;
+            } else if (cqe->res != -EAGAIN) {
+                log_msg(LOG_WARN, "accept: %s", strerror(-cqe->res));
+            }
+            if (!more) {
+                arm_uring(p, fd, WATCH_ACCEPT);
+            }
+            if (cqe->res < 0) {
+                continue;
+            }
+        } else {
+            e->events = EPOLLIN;
+            if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                e->buf = p->bufs + (size_t)(cqe->flags >>
+                                            IORING_CQE_BUFFER_SHIFT) *
+                                   URING_BUF_SIZE;
+                e->len = cqe->res;
+            } else if (cqe->res == 0) {
+                e->events |= EPOLLRDHUP;
+            } else if (cqe->res != -ENOBUFS) {
+                e->events |= EPOLLERR;
+            }
+            // the rest comes as for any other fd; data that arrived in
+            // between makes the new poll fire at once
+            s->kind = WATCH_POLL;
+            arm_uring(p, fd, WATCH_POLL);
+        }
+        n++;
+    }
+    atomic_store_explicit((_Atomic unsigned*)p->cq_head, head,
+                          memory_order_release);
+    return n;
+}
+
+
+int Epoll_create1(int flags) {
+    int epollfd = epoll_create1(flags);
+    if (epollfd == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    return epollfd;
+}
+
+int Epoll_wait(int epfd, struct epoll_event *events,
+                      int maxevents, int timeout) {
+    int nfds = epoll_wait(epfd, events, maxevents, timeout);
+    if (nfds == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("epoll_wait");
+        exit(EXIT_FAILURE);
+    }
+    return nfds;
+}
+
+int Epoll_ctl(int epfd, int op, int fd,
+                     struct epoll_event *event) {
+    if (epoll_ctl(epfd, op, fd, event) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * poller.h - fd events from epoll or io_uring
+ *
+ * A reactor says which fds it wants to hear about and waits for a batch
+ * of events; which kernel interface delivers them is settled once, by
+ * init_poller(), and nothing else needs to know. With io_uring, what was
+ * asked for since the last wait goes to the kernel with the wait itself
+ * in one io_uring_enter(): fds are watched by multishot polls, listening
+ * sockets by a multishot accept, and the first read of a new connection
+ * lands in one of a ring of buffers registered with the kernel, so a
+ * request that arrives in one piece costs no read() at all.
+ */
+#ifndef __POLLER_H__
+#define __POLLER_H__
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include "csapp.h"
+
+#define URING_ENTRIES 1024  /* submission queue, the completion one is 4x */
+#define URING_BUFS 128      /* registered read buffers, power of two */
+#define URING_BUF_SIZE 4096
+
+enum poller_backend {
+    POLLER_EPOLL,
+    POLLER_URING,
+};
+
+typedef struct {
+    void *data;
+    uint32_t events;    // EPOLLIN, EPOLLOUT, EPOLLRDHUP, EPOLLERR, EPOLLHUP
+    int fd;             // from watch_accept(): the new connection, else -1
+    const char *buf;    // from watch_first_read(): the bytes read, good
+    size_t len;         // until the next wait; NULL: the owner reads
+} poll_event_t;
+
+/* an fd being watched, what the kernel has pending for it */
+typedef struct {
+    void *data;
+    unsigned gen;       // bumped by unwatch_fd(), older events are dropped
+    int kind;
+} poll_slot_t;
+
+typedef struct {
+    int backend;
+    poll_slot_t *slots; // by fd
+    int nslots;
+
+    // epoll
+    int epfd;
+    struct epoll_event *events;
+    int nevents;
+
+    // io_uring: both rings in one mapping
+    int ring_fd;
+    int disabled;       // until the owning thread first waits
+    void *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries, *sq_head, *sq_ktail, sq_mask, sq_tail;
+    struct io_uring_cqe *cqes;
+    unsigned *cq_head, *cq_tail, cq_mask;
+
+    // registered read buffers, and the ones lent out since the last wait
+    struct io_uring_buf_ring *buf_ring;
+    char *bufs;
+    unsigned short buf_tail;
+    unsigned short lent[URING_BUFS];
+    int nlent;
+} poller_t;
+
+/* backend is what is wanted; io_uring falls back to epoll if the kernel
+ * lacks it. Returns the one in use */
+int init_poller(poller_t *p, int backend);
+const char *poller_name(const poller_t *p);
+
+/* edge triggered: in, out and peer hangup, until unwatched */
+void watch_fd(poller_t *p, int fd, void *data);
+
+/* the same, but the first event may carry the first bytes read */
+void watch_first_read(poller_t *p, int fd, void *data);
+
+/* one event per accepted connection, non-blocking and close-on-exec */
+void watch_accept(poller_t *p, int fd, void *data);
+
+/* stop the events of fd; closing: it is closed right after, and
+ * not dup'ed, which epoll needs no telling about */
+void unwatch_fd(poller_t *p, int fd, int closing);
+
+/* up to max events; timeout in ms, -1 for none. Returns 0 if it passed */
+int wait_poller(poller_t *p, poll_event_t *out, int max, int timeout);
+
+#endif /* __POLLER_H__ */
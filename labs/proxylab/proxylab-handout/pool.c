@@ -0,0 +1,153 @@
+/*
+ * pool.c - per-origin pool of idle upstream connections
+ *
+ * Each origin (host:port) keeps a short stack of idle sockets, the most
+ * recently used on top so that the others age out. An origin may close
+ * an idle connection at any time, so take_pool() peeks at the socket and
+ * skips it if the origin has already hung up.
+ */
+#include "pool.h"
+
+static origin_t *get_origin(pool_t *pool, const char *key, int create);
+static int conn_alive(int fd);
+
+void init_pool(pool_t *pool) {
+    memset(pool->buckets, 0, sizeof(pool->buckets));
+    Sem_init(&pool->lock, 0, 1);
+}
+
+int take_pool(pool_t *pool, const char *host, const char *port) {
+    char key[MAXLINE];
+    snprintf(key, MAXLINE, "%s:%s", host, port);
+    long now = now_ms();
+
+    while (1) {
+        P(&pool->lock);
+        origin_t *origin = get_origin(pool, key, 0);
+        pool_conn_t *pc = NULL;
+        if (origin != NULL && origin->idle != NULL) {
+            pc = origin->idle;
+            origin->idle = pc->next;
+            origin->nidle--;
+        }
+        V(&pool->lock);
+
+        if (pc == NULL) {
+            return -1;
+        }
+        int fd = pc->fd;
+        int fresh = now - pc->idle_since < POOL_IDLE_TIMEOUT;
+        free(pc);
+        if (fresh && conn_alive(fd)) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+void put_pool(pool_t *pool, const char *host, const char *port, int fd) {
+    char key[MAXLINE];
+    snprintf(key, MAXLINE, "%s:%s", host, port);
+
+    pool_conn_t *pc = (pool_conn_t*) Malloc(sizeof(pool_conn_t));
+    pc->fd = fd;
+    pc->idle_since = now_ms();
+
+    P(&pool->lock);
+    origin_t *origin = get_origin(pool, key, 1);
+    if (origin->nidle < POOL_MAX_PER_HOST) {
+        pc->next = origin->idle;
+        origin->idle = pc;
+        origin->nidle++;
+        pc = NULL;
+    }
+    V(&pool->lock);
+
+    if (pc != NULL) {
+        // enough idle connections to this origin already
+        close(fd);
+        free(pc);
+    }
+}
+
+void sweep_pool(pool_t *pool) {
+    long now = now_ms();
+    pool_conn_t *expired = NULL;
+
+    P(&pool->lock);
+    for (int i = 0; i < POOL_BUCKETS; ++i) {
+        origin_t **op = &pool->buckets[i];
+        while (*op != NULL) {
+            origin_t *origin = *op;
+            // the stack is ordered by age, cut it at the first stale one
+            pool_conn_t **pp = &origin->idle;
+            while (*pp != NULL && now - (*pp)->idle_since < POOL_IDLE_TIMEOUT) {
+                pp = &(*pp)->next;
+            }
+            while (*pp != NULL) {
+                pool_conn_t *pc = *pp;
+                *pp = pc->next;
+                origin->nidle--;
+                pc->next = expired;
+                expired = pc;
+            }
+
+            if (origin->idle == NULL) {
+                *op = origin->next;
+                free(origin->key);
+                free(origin);
+            } else {
+                op = &origin->next;
+            }
+        }
+    }
+    V(&pool->lock);
+
+    // close outside the lock
+    while (expired != NULL) {
+        pool_conn_t *pc = expired;
+        expired = pc->next;
+        close(pc->fd);
+        free(pc);
+    }
+}
+
+long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+
+// caller holds pool->lock
+origin_t *get_origin(pool_t *pool, const char *key, int create) {
+    unsigned long hash = 5381;
+    for (const unsigned char *p = (const unsigned char *)key; *p; ++p) {
+        hash = hash * 33 + tolower(*p);
+    }
+    origin_t **bucket = &pool->buckets[hash % POOL_BUCKETS];
+    for (origin_t *origin = *bucket; origin != NULL; origin = origin->next) {
+        if (!strcasecmp(origin->key, key)) {
+            return origin;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    origin_t *origin = (origin_t*) Malloc(sizeof(origin_t));
+    origin->key = strdup(key);
+    origin->idle = NULL;
+    origin->nidle = 0;
+    origin->next = *bucket;
+    *bucket = origin;
+    return origin;
+}
+
+/* an idle connection must have nothing to read: EOF means the origin
+ * closed it, data means it is out of sync */
+int conn_alive(int fd) {
+    char ch;
+    ssize_t n = recv(fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
@@ -0,0 +1,52 @@
+/*
+ * pool.h - idle persistent connections to origin servers
+ *
+ * After a response whose framing is known and whose origin allows it,
+ * the upstream socket is parked here under its host:port instead of
+ * being closed, and the next miss for that origin skips getaddrinfo and
+ * the TCP handshake. The pool is shared by all reactors.
+ */
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "csapp.h"
+
+#define POOL_BUCKETS 256
+#define POOL_MAX_PER_HOST 8       /* idle connections kept per origin */
+#define POOL_IDLE_TIMEOUT 15000   /* ms an idle connection is kept */
+
+typedef struct pool_conn_t pool_conn_t;
+struct pool_conn_t {
+    int fd;
+    long idle_since;   // ms, monotonic
+    pool_conn_t *next;
+};
+
+typedef struct origin_t origin_t;
+struct origin_t {
+    char *key;         // host:port
+    pool_conn_t *idle; // most recently parked first
+    int nidle;
+    origin_t *next;
+};
+
+struct pool_t {
+    origin_t *buckets[POOL_BUCKETS];
+    sem_t lock;
+};
+typedef struct pool_t pool_t;
+
+void init_pool(pool_t *pool);
+
+/* an idle connection to host:port that still looks alive, or -1 */
+int take_pool(pool_t *pool, const char *host, const char *port);
+
+/* park fd for host:port, closes it if the origin already has enough */
+void put_pool(pool_t *pool, const char *host, const char *port, int fd);
+
+/* close connections idle longer than POOL_IDLE_TIMEOUT */
+void sweep_pool(pool_t *pool);
+
+long now_ms(void);
+
+#endif /* __POOL_H__ */
@@ -1,647 +1,2773 @@
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include "csapp.h"
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+#include "cache.h"
+#include "blocks.h"
+#include "disk.h"
+#include "http.h"
+#include "pool.h"
+#include "flight.h"
+#include "dns.h"
+#include "request.h"
+#include "outvec.h"
+#include "wheel.h"
+#include "log.h"
+#include "stats.h"
+#include "poller.h"
 
 #define MAX_BACKLOG 1024
 #define MAX_LINE_LEN 64
-#define MAX_REQUEST_LEN 4096
-#define THREAD_NUM 4
-#define FDBUF_SIZE 16
+#define MAX_REQUEST_LEN 65536  /* largest client request header accepted */
+#define RBUF_INIT 4096         /* first size of a client's read buffer, at
+                                  least URING_BUF_SIZE */
+#define MAX_HOST_LEN 256
+#define MAX_PORT_LEN 8
+#define MAX_HEADER_LEN 16384   /* largest origin response header accepted */
+#define MAX_REACTORS 64
+#define FDQUEUE_SIZE 1024  /* power of two */
+#define CODEL_INTERVAL 100000  /* us a queue may stay above its target */
+#define HEADER_TIMEOUT 10000      /* ms a client may take to send a request */
+#define IDLE_TIMEOUT 10000        /* ms a keep-alive client may stay quiet */
+#define CONNECT_TIMEOUT 3000      /* ms to resolve, and per address tried */
+#define FIRST_BYTE_TIMEOUT 30000  /* ms the origin may take to answer */
+#define TRANSFER_TIMEOUT 60000    /* ms a response may make no progress */
+#define SPLICE_CHUNK 65536         /* bytes moved per splice() call */
 #define MAX_TRANSMIT_SIZE (1 << 31)
+#define STATS_PATH "/__proxy/stats"  /* metrics, for clients on this host */
 
-/** maximum events number of epoll */
+/** maximum events number of one wait */
 #define MAX_EVENTS 10000
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 
+/* what a connection gets when the proxy is too busy to fetch for it */
+static const char *overload_response = "HTTP/1.0 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
 
-struct sbuf_t {
-    int fdbuf[FDBUF_SIZE];
-    int head;
-    int tail;
+/*
+ * Bounded lock-free MPMC queue of accepted fds (Vyukov's ring). Each slot
+ * carries a sequence number telling producers and consumers whose turn
+ * it is, so a handoff costs one CAS on each side and nobody ever sleeps.
+ */
+struct fdslot_t {
+    atomic_size_t seq;
+    int fd;
+    long queued;            // us, when the fd was accepted
+};
+typedef struct fdslot_t fdslot_t;
 
-    sem_t lock;
-    sem_t remain;
-    sem_t available;
+struct fdqueue_t {
+    fdslot_t slots[FDQUEUE_SIZE];
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
 };
-typedef struct sbuf_t sbuf_t;
-static void init_sbuf(sbuf_t *buf);
-static void insert_sbuf(sbuf_t *buf, int fd);
-static int remove_sbuf(sbuf_t *buf);
-
-
-struct cache_node_t {
-    struct cache_node_t *next;
-    struct cache_node_t *prev;
-    char *content;  
-    char tag[MAX_LINE_LEN];
-    int size;
+typedef struct fdqueue_t fdqueue_t;
+static void init_fdqueue(fdqueue_t *q);
+static int push_fdqueue(fdqueue_t *q, int fd, long queued);  // 0 if full
+static int pop_fdqueue(fdqueue_t *q, long *queued);  // -1 if empty
+static size_t fdqueue_len(fdqueue_t *q);
+
+
+/*
+ * Every fd registered with a reactor's poller is described by a watcher,
+ * the poller hands the watcher back and its callback runs on the reactor
+ * thread.
+ */
+typedef struct reactor_t reactor_t;
+typedef struct watcher_t watcher_t;
+typedef void watcher_cb(reactor_t *r, watcher_t *w, poll_event_t *ev);
+
+struct watcher_t {
+    int fd;
+    uint32_t revents;   // events seen since the owner last looked
+    watcher_cb *cb;
+    void *data;
 };
 
-typedef struct cache_node_t cache_node_t;
-static void create_node(cache_node_t *node, 
-                        const char *content, 
-                        const char *tag);
-static void delete_node(cache_node_t *node);
-
-struct cache_t {
-    cache_node_t *sentinel;  
-    int total_size;
-
-    // used for reader-writer model, writer preference
-    int rcnt;
-    int wcnt;
-    sem_t rlock;
-    sem_t rcntlock;
-    sem_t wlock;
-    sem_t wcntlock;
+/*
+ * Connection state machine. Each state handler does as much non-blocking
+ * I/O as it can and returns STEP_AGAIN when the socket would block; the
+ * next event on either socket of the connection resumes it.
+ */
+enum conn_state {
+    CONN_READ_REQUEST,      // reading request line and headers from client
+    CONN_RESOLVE,           // waiting for a resolver thread
+    CONN_CONNECT_UPSTREAM,  // non-blocking connect to the origin server
+    CONN_SEND_REQUEST,      // writing the rewritten request to the origin
+    CONN_READ_RESPONSE,     // reading the response header from the origin
+    CONN_RELAY,             // relaying the response body to the client
+    CONN_SPLICE,            // same, through a pipe for a body not cached
+    CONN_WRITE_RESPONSE,    // writing a cached response to the client
+    CONN_WAIT_FLIGHT,       // sending what another miss on the URL fetches
+    CONN_BLOCKS,            // sending a range of an object kept in blocks
 };
 
-typedef struct cache_t cache_t;
-static void init_cache(cache_t *cache);
-static void insert_cache(cache_t *cache, const char *content, const char *tag);
-static void insert_node(cache_t *cache, cache_node_t *node);
-static void remove_cache(cache_t *cache);  // remove the LRU item from cache
-static void remove_node(cache_node_t *node);
-static void free_cache(cache_t *cache);
+/* how the end of a response body is found */
+enum body_framing {
+    BODY_NONE,      // status without body (1xx, 204, 304)
+    BODY_LENGTH,    // Content-Length
+    BODY_CHUNKED,   // Transfer-Encoding: chunked
+    BODY_CLOSE,     // origin closes the connection
+};
 
-// writer model
-static void writer_prelogue(cache_t *cache);
-static void writer_epilogue(cache_t *cache);
+enum step_result {
+    STEP_NEXT,   // state changed, run the next handler
+    STEP_AGAIN,  // would block, wait for the next event
+    STEP_CLOSE,  // done or failed, close the connection
+};
 
-// reader model
-static void reader_prelogue(cache_t *cache);
-static void reader_epilogue(cache_t *cache);
+typedef struct conn_t conn_t;
 
-// epoll wrapper functions
-static int Epoll_create1(int flags);
+/* what a connection's timer is waiting for */
+enum timeout_kind {
+    TIMEOUT_HEADER,         // client sending its request header
+    TIMEOUT_IDLE,           // keep-alive client between requests
+    TIMEOUT_CONNECT,        // resolving, and each origin address tried
+    TIMEOUT_FIRST_BYTE,     // origin starting to answer the request
+    TIMEOUT_TRANSFER,       // response moving on, re-armed by progress
+    TIMEOUTS,
+};
 
-static int Epoll_wait(int epfd, struct epoll_event *events,
-                      int maxevents, int timeout);
-            
-static int Epoll_ctl(int epfd, int op, int fd,
-                     struct epoll_event *event);
+static const char *timeout_names[TIMEOUTS] = {
+    "header", "idle", "connect", "first byte", "transfer",
+};
+static const long timeout_ms[TIMEOUTS] = {
+    HEADER_TIMEOUT, IDLE_TIMEOUT, CONNECT_TIMEOUT, FIRST_BYTE_TIMEOUT,
+    TRANSFER_TIMEOUT,
+};
 
+/* counted per reactor, for GET /__proxy/stats */
+enum stat_count {
+    COUNT_REQUESTS,
+    COUNT_HITS,             // answered from the cache alone
+    COUNT_MISSES,           // fetched from the origin
+    COUNT_COALESCED,        // followed another miss on the URL
+    COUNT_REVALIDATED,      // stale, and the origin said 304
+    COUNT_CACHE_BYTES,      // sent from cached objects
+    COUNT_ORIGIN_BYTES,     // read from origins
+    COUNTS,
+};
 
-// used for thread argument passing
-typedef struct {
-    sbuf_t *sbuf;
-    cache_t *cache;
-} sbufcache_t;
+static const char *count_names[COUNTS] = {
+    "requests", "hits", "misses", "coalesced", "revalidated",
+    "bytes_from_cache", "bytes_from_origin",
+};
 
-// using LRU 
-static void replace_cache(cache_t *cache, const char *content, const char *tag);
-static char *find_cache(cache_t *cache, const char *tag);
+/* timed per reactor */
+enum stat_hist {
+    HIST_FIRST_BYTE,        // accepted, or next request begun, to the
+                            // first byte of the response sent
+    HIST_CONNECT,           // connect() to the origin until established
+    HIST_TTFB,              // request sent until the origin answers
+    HIST_HIT,               // request read until the response is sent
+    HIST_MISS,              // same, for anything not a hit
+    HISTS,
+};
 
+static const char *hist_names[HISTS] = {
+    "first_byte", "upstream_connect", "upstream_ttfb", "hit_service",
+    "miss_service",
+};
 
-static void process_client(int clientfd, cache_t *cache);
-static int process_http_header(rio_t *rp, char **pte, 
-                        char *method, char *hostName, char *port,
-                        char *path, char *version);
-static int process_request_header(rio_t *rp, char **pte, const char *hostName);
-static int process_url(const char *url, char *hostName, char *port, char *path);
+struct conn_t {
+    int state;
+    reactor_t *reactor;
+    watcher_t client;
+    watcher_t upstream;
+    conn_t *next;           // reactor's list of closed connections
+    int closed;
+    wtimer_t timer;         // on the reactor's wheel while armed
+    int timeout;            // what the timer is for
+    int shed;               // waited too long to be let through, only
+                            // cache hits are served
+    int fetching;           // holds one of the max_fetches slots
+
+    // us, for the histograms
+    long start_us;          // accepted, or the next request began
+    long parsed_us;         // request header complete
+    long connect_us;        // connect() to the origin
+    long sent_us;           // request to the origin sent
+    int first_sent;         // first byte of the response went out
+    int service;            // HIST_HIT or HIST_MISS once done, -1 neither
+
+    // request from client and the rewritten one for the origin, a
+    // pipelined request may follow rbuf[0, rused)
+    char *rbuf;
+    size_t rlen, rused, rcap;
+    req_parser_t parser;    // views into rbuf
+    int keep_alive;         // client allows another request after this
+    outvec_t request;       // mostly the client's lines, in rbuf
+    char hostName[MAX_HOST_LEN], port[MAX_PORT_LEN];
+    char tag[MAXLINE];
+    int http11;             // client spoke HTTP/1.1
+    span_t range;           // value of its Range header, len 0 if none
+    int personal;           // conditional, or with credentials: what the
+                            // origin answers is for this client alone
+    int authorized;         // sent an Authorization, see response_storable()
+    dns_addrs_t addrs;      // of the origin, n is 0 until resolved
+    int addr;               // the one being connected to
+    dns_req_t *dns;         // lookup in progress
+    int reused;             // upstream connection came from the pool
+    long fetch_start;       // ms, what a refetch costs the cache
+
+    // response, out still has to reach the client
+    char *buf;
+    size_t buflen, bufcap;
+    cache_obj_t *obj;       // pinned hit, or the object being filled
+    outvec_t out;
+    http_response_t resp;
+    int framing;
+    long remain;            // BODY_LENGTH: body bytes still expected
+    chunk_decoder_t chunks; // BODY_CHUNKED: where the body ends
+    char *head;             // header of a chunked object being cached
+    size_t headlen;
+    int body_done;          // whole response has been read
+    int junk;               // origin sent more than the response
+    int upstream_eof;
+
+    // concurrent misses on the same URL share one fetch
+    flight_t *flight;
+    int flight_leader;
+    watcher_t flight_watch; // waiter: dup of the flight's eventfd
+    flight_cursor_t cursor;
+    int client_dead;        // leader lost its client, keeps fetching
+    int solo;               // the flight it followed was abandoned
+
+    // a stale hit being revalidated
+    cache_obj_t *stale;     // pinned, goes out again if the origin says 304
+    int refresh;            // in the background, nobody waits for it
+
+    // body bytes moved origin -> pipe -> client without a copy
+    int pipefd[2];
+    size_t piped;           // in the pipe, not yet sent
+
+    // an object kept in blocks, see blocks.h
+    cache_obj_t *blocks;    // its pinned header
+    long pos, end;          // body bytes [pos, end] still to be sent
+    long fill, fill_last;   // body bytes asked of the origin, then the
+                            // offset of the next one it sends
+    int filling;            // the origin is sending them
+    cache_obj_t *block;     // being filled, NULL before a block start
+};
 
-static void forwarding(char *message, size_t requestLen, char *hostName, 
-                        char *port, char *path, int clientfd, cache_t *cache); 
+struct reactor_t {
+    poller_t poller;        // epoll or io_uring, see -u
+    watcher_t wakeup;       // eventfd, signalled when inbox has new fds
+    watcher_t timer;        // timerfd, reaps idle client connections
+    watcher_t listener;     // own SO_REUSEPORT socket with -r, else -1
+    fdqueue_t inbox;
+    cache_t *cache;
+    pool_t *pool;
+    flight_table_t *flights;
+    conn_t *closed;         // freed once the current batch is handled
+    wheel_t wheel;          // connection deadlines
+    dns_cache_t *dns;
+    _Atomic(dns_req_t*) resolved;  // finished lookups, pushed by resolvers
+    pthread_t tid;
+
+    // time accepted fds spent in a queue, written by this reactor only
+    atomic_long qwait_count, qwait_total, qwait_max;  // us
+    atomic_long stolen;
+    atomic_long expired[TIMEOUTS];  // connections timed out
+
+    // load shedding, written by this reactor only
+    long above_since;       // us, since when queue waits exceed the target
+    atomic_long shed_late, shed_busy;   // misses turned away
+
+    atomic_long counts[COUNTS];
+    hist_t hists[HISTS];
+};
 
-static void *thread_func(void *arg);
+// one reactor per CPU
+static reactor_t reactors[MAX_REACTORS];
+static int nreactors;
+static volatile sig_atomic_t dump_stats;
+static int reuseport;   // -r: every reactor accepts on its own socket
+static int backend = POLLER_EPOLL;  // -u: io_uring if the kernel has it
+
+// overload control
+static long queue_target;   // -q, us; 0: nothing is shed for waiting
+static size_t max_queue = FDQUEUE_SIZE; // -Q, queued connections per reactor
+static int max_fetches;     // -c, origin fetches at once; 0: no limit
+static atomic_int fetches;  // running now
+static atomic_long shed_full;   // refused by the accepting thread
+
+static void init_reactor(reactor_t *r, cache_t *cache, pool_t *pool,
+                         flight_table_t *flights, dns_cache_t *dns);
+static void dispatch_conn(int connectfd);
+static void refuse_conn(int connectfd);
+static void take_inbox(reactor_t *r, fdqueue_t *q);
+static int overloaded(reactor_t *r, long wait, long now);
+static void print_queue_stats(void);
+static void print_timeout_stats(void);
+static void print_shed_stats(void);
+static int is_stats_request(conn_t *c);
+static int serve_stats(conn_t *c);
+static void write_stats(strbuf_t *sb, int json);
+static void on_sigusr1(int sig);
+static long now_us(void);
+static int open_reuseport_listenfd(char *port);
+static void on_listen(reactor_t *r, watcher_t *w, poll_event_t *ev);
+static void take_conn(int connectfd, reactor_t *r);
+static void pin_reactor(reactor_t *r);
+static void add_watcher(reactor_t *r, watcher_t *w);
+static void close_watcher(reactor_t *r, watcher_t *w);
+static void on_wakeup(reactor_t *r, watcher_t *w, poll_event_t *ev);
+static void on_timer(reactor_t *r, watcher_t *w, poll_event_t *ev);
+static void on_resolved(dns_req_t *req);
+static void *reactor_func(void *arg);
+
+static conn_t *new_conn(reactor_t *r);
+static void open_conn(reactor_t *r, int clientfd, long accepted, int shed);
+static void close_conn(conn_t *c);
+static void free_conn(conn_t *c);
+static void on_conn_event(reactor_t *r, watcher_t *w, poll_event_t *ev);
+static void drive_conn(conn_t *c);
+static void set_timeout(conn_t *c, int kind);
+static void clear_timeout(conn_t *c);
+static void touch_timeout(conn_t *c);
+static void on_timeout(wtimer_t *t);
+static void connect_timeout(conn_t *c);
+
+// state handlers
+static int do_read_request(conn_t *c);
+static int do_resolve(conn_t *c);
+static int do_connect_upstream(conn_t *c);
+static int do_send_request(conn_t *c);
+static int do_read_response(conn_t *c);
+static int do_relay(conn_t *c);
+static int do_splice(conn_t *c);
+static int can_splice(conn_t *c);
+static int do_write_response(conn_t *c);
+static int do_wait_flight(conn_t *c);
+static int lookup_request(conn_t *c);
+static int begin_fetch(conn_t *c);
+static int take_fetch(conn_t *c);
+static void release_fetch(conn_t *c);
+static int shed_request(conn_t *c);
+static void count_hit(conn_t *c);
+static int start_connect(conn_t *c);
+static int retry_upstream(conn_t *c);
+static size_t consume_body(conn_t *c, char *data, size_t n);
+static void relay_out(conn_t *c, const char *p, size_t n);
+static void relay_copy(conn_t *c, const char *p, size_t n);
+static void relay_head(conn_t *c, const char *head, size_t hdrlen);
+static void relay_cached(conn_t *c, cache_obj_t *obj);
+static int flush_out(conn_t *c);
+static void drop_flight(conn_t *c);
+static void finish_response(conn_t *c);
+static void cache_body_object(conn_t *c);
+static int next_request(conn_t *c);
+
+// objects too big for one cache object, kept in blocks
+static int relay_range(conn_t *c, cache_obj_t *obj);
+static int serve_blocks(conn_t *c);
+static int blocks_body(conn_t *c, size_t hdrlen, long *first, long *total);
+static cache_obj_t *cache_blocks_head(conn_t *c, size_t hdrlen, long total);
+static int start_blocks(conn_t *c, size_t hdrlen, long first, long total);
+static int take_blocks(conn_t *c, size_t hdrlen);
+static int do_blocks(conn_t *c);
+static int fetch_blocks(conn_t *c, long index);
+static void fill_blocks(conn_t *c, const char *data, size_t n);
+static void send_block(conn_t *c, cache_obj_t *block);
+static void end_block_fetch(conn_t *c);
+static void drop_blocks(conn_t *c);
+static long cached_age(cache_obj_t *obj);
+
+// freshness and revalidation
+static void set_freshness(cache_obj_t *obj, const http_response_t *resp);
+static void add_validators(conn_t *c);
+static void start_refresh(conn_t *c);
+static void drop_stale(conn_t *c);
+
+static int process_client(conn_t *c);
+static void build_request(conn_t *c);
+static int copy_span(char *dst, size_t size, const char *buf, span_t s);
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s port", argv[0]);
+    int opt;
+    int eviction = EVICT_CLOCK, admission = 0, log_level = LOG_INFO;
+    char *disk_dir = NULL;
+    while ((opt = getopt(argc, argv, "ac:d:e:l:q:Q:ru")) != -1) {
+        switch (opt) {
+        case 'a':
+            admission = 1;
+            break;
+        case 'c':
+            max_fetches = atoi(optarg);
+            break;
+        case 'd':
+            disk_dir = optarg;
+            break;
+        case 'e':
+            if (!strcmp(optarg, "clock")) {
+                eviction = EVICT_CLOCK;
+            } else if (!strcmp(optarg, "gdsf")) {
+                eviction = EVICT_GDSF;
+            } else {
+                optind = argc;
+            }
+            break;
+        case 'l':
+            log_level = parse_log_level(optarg);
+            if (log_level < 0) {
+                optind = argc;
+            }
+            break;
+        case 'q':
+            queue_target = atof(optarg) * 1000;
+            break;
+        case 'Q':
+            max_queue = atol(optarg);
+            if (max_queue < 1 || max_queue > FDQUEUE_SIZE) {
+                optind = argc;
+            }
+            break;
+        case 'r':
+            reuseport = 1;
+            break;
+        case 'u':
+            backend = POLLER_URING;
+            break;
+        default:
+            optind = argc;  // print usage
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-a] [-c fetches] [-d dir] [-e clock|gdsf] "
+                "[-l level] [-q ms] [-Q depth] [-r] [-u] port\n"
+                "  -a  admit objects into a full cache by TinyLFU\n"
+                "  -c  origin fetches at once, misses beyond get a 503\n"
+                "  -d  keep objects evicted from memory in files under dir\n"
+                "  -e  eviction policy of the cache, clock by default\n"
+                "  -l  log debug, info (default), warn or error and up\n"
+                "  -q  queue wait target, misses that wait longer while the\n"
+                "      queue stands get a 503\n"
+                "  -Q  connections queued per reactor before new ones get a\n"
+                "      503, at most %d\n"
+                "  -r  one SO_REUSEPORT listening socket per reactor\n"
+                "  -u  io_uring instead of epoll, if the kernel has it\n",
+                argv[0], FDQUEUE_SIZE);
         exit(-1);
     }
+    char *port = argv[optind];
     printf("%s", user_agent_hdr);
+    fflush(stdout);     // the logger writes to the fd behind it
+    init_log(log_level);
+
+    // a client hanging up mid-response must not kill the proxy
+    Signal(SIGPIPE, SIG_IGN);
+    // kill -USR1 prints how long accepted connections waited in a queue
+    // and how the cache policy is doing
+    Signal(SIGUSR1, on_sigusr1);
+
+    // the disk tier outlives restarts, its index is rebuilt here
+    static disk_t disk;
+    if (disk_dir != NULL) {
+        init_disk(&disk, disk_dir);
+    }
+    cache_t cache;
+    init_cache(&cache, eviction, admission, disk_dir ? &disk : NULL);
+    static pool_t pool;
+    init_pool(&pool);
+    static flight_table_t flights;
+    init_flights(&flights);
+    static dns_cache_t dns;
+    init_dns(&dns);
+
+    // every reactor runs its own event loop on its own thread
+    nreactors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nreactors < 1) {
+        nreactors = 1;
+    } else if (nreactors > MAX_REACTORS) {
+        nreactors = MAX_REACTORS;
+    }
+    for (int i = 0; i < nreactors; ++i) {
+        init_reactor(&reactors[i], &cache, &pool, &flights, &dns);
+        if (reuseport) {
+            // the kernel spreads connections over the sockets, so no
+            // thread sits between accept and the reactor
+            reactors[i].listener.fd = open_reuseport_listenfd(port);
+            if (reactors[i].listener.fd < 0) {
+                unix_error("open_reuseport_listenfd error");
+            }
+            reactors[i].listener.cb = on_listen;
+            reactors[i].listener.data = NULL;
+            watch_accept(&reactors[i].poller, reactors[i].listener.fd,
+                         &reactors[i].listener);
+        }
+        Pthread_create(&reactors[i].tid, NULL, reactor_func, &reactors[i]);
+    }
 
-    // get listen fd of server
-    int listenfd = Open_listenfd(argv[1]);
+    // without -r, this thread accepts for all reactors; with it, the
+    // loop below only does housekeeping
+    poll_event_t *events = Malloc(MAX_EVENTS * sizeof(poll_event_t));
+    static poller_t acceptor;
+    init_poller(&acceptor, backend);
+    log_msg(LOG_INFO, "events from %s", poller_name(&acceptor));
+    if (!reuseport) {
+        int listenfd = Open_listenfd(port);
+        fcntl(listenfd, F_SETFL, O_NONBLOCK);
+        watch_accept(&acceptor, listenfd, NULL);
+    }
 
-    sbuf_t buf;
-    cache_t cache;
-    init_sbuf(&buf);
-    init_cache(&cache);
-    sbufcache_t arg;
-    arg.sbuf = &buf;
-    arg.cache = &cache;
+    long last_sweep = now_ms();
+    while (1) {
+        int nfds = wait_poller(&acceptor, events, MAX_EVENTS, 1000);
+        if (now_ms() - last_sweep >= 1000) {
+            // close upstream connections that sat idle too long
+            sweep_pool(&pool);
+            sweep_dns(&dns);
+            last_sweep = now_ms();
+        }
+        if (dump_stats) {
+            dump_stats = 0;
+            print_queue_stats();
+            print_timeout_stats();
+            print_shed_stats();
+            print_log_stats();
+            print_cache_stats(&cache);
+        }
+        for (int i = 0; i < nfds; ++i) {
+            take_conn(events[i].fd, NULL);
+        }
+    }
 
-    pthread_t threadspool[THREAD_NUM];
+    free(events);
+    free_cache(&cache);
+}
 
-    for (int i = 0; i < THREAD_NUM; ++i) {
-        Pthread_create(&threadspool[i], NULL, thread_func, &arg);
+void init_reactor(reactor_t *r, cache_t *cache, pool_t *pool,
+                  flight_table_t *flights, dns_cache_t *dns) {
+    init_poller(&r->poller, backend);
+    r->cache = cache;
+    r->pool = pool;
+    r->flights = flights;
+    r->dns = dns;
+    atomic_init(&r->resolved, NULL);
+    r->closed = NULL;
+    init_wheel(&r->wheel, now_ms());
+    r->listener.fd = -1;
+    init_fdqueue(&r->inbox);
+    atomic_init(&r->qwait_count, 0);
+    atomic_init(&r->qwait_total, 0);
+    atomic_init(&r->qwait_max, 0);
+    atomic_init(&r->stolen, 0);
+    r->above_since = 0;
+    atomic_init(&r->shed_late, 0);
+    atomic_init(&r->shed_busy, 0);
+    for (int i = 0; i < COUNTS; ++i) {
+        atomic_init(&r->counts[i], 0);
+    }
+    for (int i = 0; i < HISTS; ++i) {
+        init_hist(&r->hists[i]);
+    }
+    for (int i = 0; i < TIMEOUTS; ++i) {
+        atomic_init(&r->expired[i], 0);
     }
 
-    struct epoll_event ev, events[MAX_EVENTS];
-    int epollfd = Epoll_create1(0);
-    ev.events = EPOLLIN;
-    ev.data.fd = listenfd;
-    Epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &ev);
+    r->wakeup.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->wakeup.fd < 0) {
+        unix_error("eventfd error");
+    }
+    r->wakeup.cb = on_wakeup;
+    r->wakeup.data = NULL;
+    add_watcher(r, &r->wakeup);
+
+    // turn the wheel every tick
+    struct itimerspec its;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = WHEEL_TICK * 1000000L;
+    its.it_value = its.it_interval;
+    r->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (r->timer.fd < 0 || timerfd_settime(r->timer.fd, 0, &its, NULL) < 0) {
+        unix_error("timerfd error");
+    }
+    r->timer.cb = on_timer;
+    r->timer.data = NULL;
+    add_watcher(r, &r->timer);
+}
 
-    while (1) {
-        int nfds = Epoll_wait(epollfd, events, MAX_EVENTS, -1);
-        for (int n = 0; n < nfds; ++n) {
-            if (events[n].data.fd == listenfd) {
-                struct sockaddr client;
-                socklen_t clientLen = sizeof(client); 
-
-                // connect with client
-                int connectfd = Accept(listenfd, &client, &clientLen);
-
-                // print client information
-                char host[MAX_LINE_LEN], serv[MAX_LINE_LEN];
-                Getnameinfo(&client, clientLen, 
-                            host, MAX_LINE_LEN, 
-                            serv, MAX_LINE_LEN, 0);
-                printf("connect to %s: %s\n", host, serv);
-
-                fcntl(connectfd, F_SETFL, O_NONBLOCK);
-                ev.events = EPOLLIN | EPOLLET;
-                ev.data.fd = connectfd;
-                Epoll_ctl(epollfd, EPOLL_CTL_ADD, connectfd, &ev);
-            } else {
-                // insert connected file descriptor to fd buffer
-                insert_sbuf(&buf, events[n].data.fd);
+// called by the accepting thread: the next reactor round robin or a
+// random one, whichever has fewer connections waiting
+void dispatch_conn(int connectfd) {
+    static unsigned int next, seed = 1;
+    reactor_t *r = &reactors[next++ % nreactors];
+    reactor_t *other = &reactors[rand_r(&seed) % nreactors];
+    if (fdqueue_len(&other->inbox) < fdqueue_len(&r->inbox)) {
+        r = other;
+    }
+
+    long queued = now_us();
+    int i = r - reactors;
+    while (fdqueue_len(&reactors[i].inbox) >= max_queue ||
+           !push_fdqueue(&reactors[i].inbox, connectfd, queued)) {
+        // full, try the others, and turn it away if all are
+        i = (i + 1) % nreactors;
+        if (&reactors[i] == r) {
+            refuse_conn(connectfd);
+            return ;
+        }
+    }
+
+    uint64_t one = 1;
+    if (write(reactors[i].wakeup.fd, &one, sizeof(one)) < 0 &&
+        errno != EAGAIN) {
+        unix_error("eventfd write error");
+    }
+}
+
+// every reactor is backed up: answer right away rather than queue it
+void refuse_conn(int connectfd) {
+    // a close with unread bytes resets the connection, and the client
+    // might never see the answer, so take what has arrived first
+    char junk[MAXLINE];
+    if (read(connectfd, junk, sizeof(junk)) >= 0 || errno == EAGAIN) {
+        send(connectfd, overload_response, strlen(overload_response),
+             MSG_NOSIGNAL);
+    }
+    close(connectfd);
+    add_stat(&shed_full, 1);
+}
+
+// open the connections waiting in q on reactor r
+void take_inbox(reactor_t *r, fdqueue_t *q) {
+    int fd;
+    long queued;
+    while ((fd = pop_fdqueue(q, &queued)) >= 0) {
+        long now = now_us();
+        long wait = now - queued;
+        atomic_fetch_add_explicit(&r->qwait_count, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&r->qwait_total, wait, memory_order_relaxed);
+        if (wait > atomic_load_explicit(&r->qwait_max, memory_order_relaxed)) {
+            atomic_store_explicit(&r->qwait_max, wait, memory_order_relaxed);
+        }
+        if (q != &r->inbox) {
+            atomic_fetch_add_explicit(&r->stolen, 1, memory_order_relaxed);
+        }
+        open_conn(r, fd, queued, overloaded(r, wait, now));
+    }
+}
+
+/*
+ * CoDel on the time connections waited in the inboxes. A wait above the
+ * target is fine while the queue drains, as after a burst; once waits
+ * have stayed above it for a whole interval the queue is standing, and
+ * every connection that waited longer than the target is shed until a
+ * wait falls below it again. So is one that waited over an interval.
+ * Servers, unlike routers, shed all of the late ones instead of a few
+ * at a growing rate: a connection is not a packet, its client does not
+ * back off by itself.
+ */
+int overloaded(reactor_t *r, long wait, long now) {
+    if (queue_target == 0) {
+        return 0;
+    }
+    if (wait <= queue_target) {
+        r->above_since = 0;
+        return 0;
+    }
+    if (r->above_since == 0) {
+        r->above_since = now;
+    }
+    return wait > CODEL_INTERVAL || now - r->above_since >= CODEL_INTERVAL;
+}
+
+void print_queue_stats(void) {
+    for (int i = 0; i < nreactors; ++i) {
+        reactor_t *r = &reactors[i];
+        long cnt = atomic_load(&r->qwait_count);
+        fprintf(stderr, "reactor %d: %ld conns, queue wait avg %ld us, "
+                "max %ld us, %ld stolen, %zu queued\n", i, cnt,
+                cnt ? atomic_load(&r->qwait_total) / cnt : 0,
+                atomic_load(&r->qwait_max), atomic_load(&r->stolen),
+                fdqueue_len(&r->inbox));
+    }
+}
+
+void print_timeout_stats(void) {
+    long n[TIMEOUTS] = { 0 };
+    for (int i = 0; i < nreactors; ++i) {
+        for (int k = 0; k < TIMEOUTS; ++k) {
+            n[k] += atomic_load(&reactors[i].expired[k]);
+        }
+    }
+    fprintf(stderr, "timed out: ");
+    for (int k = 0; k < TIMEOUTS; ++k) {
+        fprintf(stderr, "%s%s %ld", k ? ", " : "", timeout_names[k], n[k]);
+    }
+    fprintf(stderr, "\n");
+}
+
+void print_shed_stats(void) {
+    long late = 0, busy = 0;
+    for (int i = 0; i < nreactors; ++i) {
+        late += atomic_load(&reactors[i].shed_late);
+        busy += atomic_load(&reactors[i].shed_busy);
+    }
+    fprintf(stderr, "shed: %ld queues full, %ld waited too long, "
+            "%ld over the fetch limit, %d fetches running\n",
+            atomic_load(&shed_full), late, busy, atomic_load(&fetches));
+}
+
+// only from this host, the numbers tell more than a client should know
+int is_stats_request(conn_t *c) {
+    const char *buf = c->rbuf;
+    req_parser_t *p = &c->parser;
+    if (!span_is(buf, p->method, "GET") ||
+        (!span_is(buf, p->url, STATS_PATH) &&
+         !span_is(buf, p->url, STATS_PATH "?format=json"))) {
+        return 0;
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(c->client.fd, (struct sockaddr *)&addr, &len) < 0) {
+        return 0;
+    }
+    if (addr.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        return (ntohl(in->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr.ss_family == AF_INET6) {
+        struct in6_addr *in6 = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(in6) ||
+               (IN6_IS_ADDR_V4MAPPED(in6) && in6->s6_addr[12] == 127);
+    }
+    return 0;
+}
+
+int serve_stats(conn_t *c) {
+    int json = c->parser.url.len > strlen(STATS_PATH);
+    strbuf_t body;
+    init_strbuf(&body, 4096);
+    write_stats(&body, json);
+    printf_outvec(&c->out, "HTTP/1.0 200 OK\r\n"
+                  "Content-Type: %s\r\n"
+                  "Content-Length: %zu\r\n"
+                  "Cache-Control: no-store\r\n"
+                  "Connection: close\r\n\r\n",
+                  json ? "application/json" : "text/plain", body.len);
+    copy_outvec(&c->out, body.data, body.len);
+    free(body.data);
+
+    c->keep_alive = 0;
+    c->framing = BODY_LENGTH;
+    c->body_done = 1;
+    set_timeout(c, TIMEOUT_TRANSFER);
+    c->state = CONN_WRITE_RESPONSE;
+    return STEP_NEXT;
+}
+
+// all reactors summed; each value may be a moment older than the next
+void write_stats(strbuf_t *sb, int json) {
+    long counts[COUNTS] = { 0 };
+    long conns = 0, wait = 0, wait_max = 0, stolen = 0, queued = 0;
+    long late = 0, busy = 0;
+    long expired[TIMEOUTS] = { 0 };
+    for (int i = 0; i < nreactors; ++i) {
+        reactor_t *r = &reactors[i];
+        for (int k = 0; k < COUNTS; ++k) {
+            counts[k] += atomic_load(&r->counts[k]);
+        }
+        conns += atomic_load(&r->qwait_count);
+        wait += atomic_load(&r->qwait_total);
+        if (atomic_load(&r->qwait_max) > wait_max) {
+            wait_max = atomic_load(&r->qwait_max);
+        }
+        stolen += atomic_load(&r->stolen);
+        queued += fdqueue_len(&r->inbox);
+        late += atomic_load(&r->shed_late);
+        busy += atomic_load(&r->shed_busy);
+        for (int k = 0; k < TIMEOUTS; ++k) {
+            expired[k] += atomic_load(&r->expired[k]);
+        }
+    }
+
+    report_t rep;
+    begin_report(&rep, sb, json);
+    for (int k = 0; k < COUNTS; ++k) {
+        report_long(&rep, count_names[k], counts[k]);
+    }
+    long served = counts[COUNT_HITS] + counts[COUNT_MISSES] +
+                  counts[COUNT_COALESCED] + counts[COUNT_REVALIDATED];
+    long bytes = counts[COUNT_CACHE_BYTES] + counts[COUNT_ORIGIN_BYTES];
+    report_double(&rep, "hit_ratio", served ? (double)(counts[COUNT_HITS] +
+                  counts[COUNT_REVALIDATED]) / served : 0);
+    report_double(&rep, "byte_hit_ratio",
+                  bytes ? (double)counts[COUNT_CACHE_BYTES] / bytes : 0);
+
+    report_long(&rep, "connections", conns);
+    report_long(&rep, "queue_depth", queued);
+    report_long(&rep, "queue_wait_mean_us", conns ? wait / conns : 0);
+    report_long(&rep, "queue_wait_max_us", wait_max);
+    report_long(&rep, "stolen", stolen);
+    report_long(&rep, "fetches_running", atomic_load(&fetches));
+    report_long(&rep, "shed_queue_full", atomic_load(&shed_full));
+    report_long(&rep, "shed_late", late);
+    report_long(&rep, "shed_busy", busy);
+    for (int k = 0; k < TIMEOUTS; ++k) {
+        char key[64];
+        snprintf(key, sizeof(key), "timeouts_%s", timeout_names[k]);
+        for (char *q = key; *q; ++q) {
+            if (*q == ' ') {
+                *q = '_';
             }
         }
+        report_long(&rep, key, expired[k]);
     }
 
-    free_cache(&cache);
+    cache_t *cache = reactors[0].cache;
+    report_long(&rep, "cache_lookups", atomic_load(&cache->lookups));
+    report_long(&rep, "cache_hits", atomic_load(&cache->hits));
+    report_long(&rep, "cache_hit_bytes", atomic_load(&cache->hit_bytes));
+    report_long(&rep, "cache_inserts", atomic_load(&cache->inserts));
+    report_long(&rep, "cache_rejects", atomic_load(&cache->rejects));
+    report_long(&rep, "cache_evictions", atomic_load(&cache->evictions));
+
+    hist_sum_t *sum = Malloc(sizeof(hist_sum_t));
+    for (int k = 0; k < HISTS; ++k) {
+        memset(sum, 0, sizeof(hist_sum_t));
+        for (int i = 0; i < nreactors; ++i) {
+            merge_hist(sum, &reactors[i].hists[k]);
+        }
+        report_hist(&rep, hist_names[k], sum);
+    }
+    free(sum);
+    end_report(&rep);
 }
 
-void process_client(int clientfd, cache_t *cache) {
-    // initial rio buffer
-    rio_t rio; 
-    Rio_readinitb(&rio, clientfd);
+void on_sigusr1(int sig) {
+    dump_stats = 1;
+}
 
-    // process http request message from client, then send proxyRequet
-    // to origin server
-    // request_pointer record the end of proxyRequest
-    char proxyRequest[MAX_REQUEST_LEN];
-    char *request_pointer = proxyRequest;
+long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
 
-    char method[MAX_LINE_LEN], hostName[MAX_LINE_LEN], port[MAX_LINE_LEN], 
-         path[MAX_LINE_LEN], http_version[MAX_LINE_LEN];
+/* open_listenfd with SO_REUSEPORT so that every reactor can bind the
+ * same port, non-blocking; -1 on error */
+int open_reuseport_listenfd(char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    int rc = getaddrinfo(NULL, port, &hints, &listp);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo failed (port %s): %s\n",
+                port, gai_strerror(rc));
+        return -1;
+    }
 
-    // http Header
-    if (!process_http_header(&rio, &request_pointer, 
-                        method, hostName, port, path, http_version)) {
-        // not GET method
-        fprintf(stderr, "URL format error or" 
-            " Doesn't support method: %s\n", method);
-        return ;
+    for (p = listp; p; p = p->ai_next) {
+        listenfd = socket(p->ai_family,
+                          p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          p->ai_protocol);
+        if (listenfd < 0) {
+            continue;
+        }
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+                   &optval, sizeof(int));
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                   &optval, sizeof(int));
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(listenfd);
+        listenfd = -1;
+    }
+    freeaddrinfo(listp);
+
+    if (listenfd >= 0 && listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
     }
-    // add blank line: \r\n
-    int cnt = sprintf(request_pointer, "\r\n");
-    request_pointer += cnt;
-    // request Header
-    if (!process_request_header(&rio, &request_pointer, hostName)) {
-        fprintf(stderr, "Header format is error\n");
+    return listenfd;
+}
+
+void on_listen(reactor_t *r, watcher_t *w, poll_event_t *ev) {
+    take_conn(ev->fd, r);
+}
+
+// a connection accepted into reactor r or, by the shared accepting
+// thread (r is NULL), through the inboxes
+void take_conn(int connectfd, reactor_t *r) {
+    // print client information, numeric: a reverse lookup here would
+    // stall every accept behind DNS
+    struct sockaddr_storage client;
+    socklen_t clientLen = sizeof(client);
+    char host[MAX_LINE_LEN], serv[MAX_LINE_LEN];
+    if (log_enabled(LOG_INFO) &&
+        getpeername(connectfd, (SA *)&client, &clientLen) == 0 &&
+        getnameinfo((SA *)&client, clientLen, host, MAX_LINE_LEN,
+                    serv, MAX_LINE_LEN,
+                    NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+        log_msg(LOG_INFO, "connect to %s: %s", host, serv);
+    }
+
+    if (r == NULL) {
+        dispatch_conn(connectfd);
+    } else {
+        // no queue on this path, counts as a zero wait
+        atomic_fetch_add_explicit(&r->qwait_count, 1, memory_order_relaxed);
+        open_conn(r, connectfd, now_us(), 0);
+    }
+}
+
+// with -r, keep each reactor and its socket on one CPU
+void pin_reactor(reactor_t *r) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((r - reactors) % (ncpu > 0 ? ncpu : 1), &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0) {
+        log_msg(LOG_WARN, "pthread_setaffinity_np: %s", strerror(rc));
+    }
+}
+
+// edge triggered, watchers always run until the fd would block
+void add_watcher(reactor_t *r, watcher_t *w) {
+    w->revents = 0;
+    watch_fd(&r->poller, w->fd, w);
+}
+
+// io_uring holds on to a watched socket until told, so never just close
+void close_watcher(reactor_t *r, watcher_t *w) {
+    unwatch_fd(&r->poller, w->fd, 1);
+    close(w->fd);
+    w->fd = -1;
+}
+
+void on_wakeup(reactor_t *r, watcher_t *w, poll_event_t *ev) {
+    uint64_t cnt;
+    if (read(w->fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        unix_error("eventfd read error");
+    }
+    // lookups finished by the resolver threads
+    dns_req_t *req = atomic_exchange(&r->resolved, NULL);
+    while (req != NULL) {
+        dns_req_t *next = req->next;
+        conn_t *c = (conn_t*)req->data;
+        if (c != NULL) {
+            c->addrs = req->addrs;
+            c->dns = NULL;
+            drive_conn(c);
+        }
+        free(req);
+        req = next;
+    }
+
+    take_inbox(r, &r->inbox);
+
+    // a reactor stuck in a long handler can't open what was queued for
+    // it, so take that over while awake
+    for (int i = 0; i < nreactors; ++i) {
+        if (&reactors[i] != r && fdqueue_len(&reactors[i].inbox) > 0) {
+            take_inbox(r, &reactors[i].inbox);
+        }
+    }
+}
+
+// expire the connections whose deadline has passed
+void on_timer(reactor_t *r, watcher_t *w, poll_event_t *ev) {
+    uint64_t cnt;
+    if (read(w->fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        unix_error("timerfd read error");
+    }
+    advance_wheel(&r->wheel, now_ms());
+}
+
+// called on a resolver thread: hand the result to the reactor that asked
+void on_resolved(dns_req_t *req) {
+    reactor_t *r = (reactor_t*)req->owner;
+    dns_req_t *head = atomic_load(&r->resolved);
+    do {
+        req->next = head;
+    } while (!atomic_compare_exchange_weak(&r->resolved, &head, req));
+
+    uint64_t one = 1;
+    if (write(r->wakeup.fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        unix_error("eventfd write error");
+    }
+}
+
+void *reactor_func(void *arg) {
+    Pthread_detach(Pthread_self());
+    reactor_t *r = (reactor_t*)arg;
+    poll_event_t *events = Malloc(MAX_EVENTS * sizeof(poll_event_t));
+    if (reuseport) {
+        pin_reactor(r);
+    }
+
+    while (1) {
+        int nfds = wait_poller(&r->poller, events, MAX_EVENTS, -1);
+        for (int n = 0; n < nfds; ++n) {
+            watcher_t *w = (watcher_t*)events[n].data;
+            w->cb(r, w, &events[n]);
+        }
+
+        // a connection closed above may still have had events in this
+        // batch, so it is only freed now
+        while (r->closed != NULL) {
+            conn_t *c = r->closed;
+            r->closed = c->next;
+            free_conn(c);
+        }
+    }
+    return NULL;
+}
+
+
+conn_t *new_conn(reactor_t *r) {
+    conn_t *c = (conn_t*) Calloc(1, sizeof(conn_t));
+    c->reactor = r;
+    c->remain = -1;
+    c->service = -1;
+
+    c->client.fd = -1;
+    c->client.cb = on_conn_event;
+    c->client.data = c;
+
+    c->upstream.fd = -1;
+    c->upstream.cb = on_conn_event;
+    c->upstream.data = c;
+
+    c->flight_watch.fd = -1;
+    c->flight_watch.cb = on_conn_event;
+    c->flight_watch.data = c;
+
+    c->pipefd[0] = c->pipefd[1] = -1;
+    c->timer.cb = on_timeout;
+    c->timer.data = c;
+    init_outvec(&c->request);
+    init_outvec(&c->out);
+    return c;
+}
+
+// clientfd comes from accept4() already non-blocking
+void open_conn(reactor_t *r, int clientfd, long accepted, int shed) {
+    conn_t *c = new_conn(r);
+    c->shed = shed;
+    c->start_us = accepted;
+    c->state = CONN_READ_REQUEST;
+    c->rbuf = (char*) Malloc(RBUF_INIT);
+    c->rcap = RBUF_INIT;
+    init_request(&c->parser);
+    set_timeout(c, TIMEOUT_HEADER);
+
+    // with io_uring the request may come with the event that says so
+    c->client.fd = clientfd;
+    c->client.revents = 0;
+    watch_first_read(&r->poller, clientfd, &c->client);
+}
+
+// closing unwatches the fds, memory is released after the batch
+void close_conn(conn_t *c) {
+    if (c->closed) {
         return ;
     }
+    c->closed = 1;
+    clear_timeout(c);
+    release_fetch(c);
+    if (c->flight != NULL) {
+        drop_flight(c);
+    }
+    if (c->dns != NULL) {
+        // the resolver still holds it, on_wakeup() frees it
+        c->dns->data = NULL;
+        c->dns = NULL;
+    }
+    if (c->client.fd >= 0) {
+        close_watcher(c->reactor, &c->client);
+    }
+    if (c->upstream.fd >= 0) {
+        close_watcher(c->reactor, &c->upstream);
+    }
+    if (c->pipefd[0] >= 0) {
+        close(c->pipefd[0]);
+        close(c->pipefd[1]);
+    }
+    c->next = c->reactor->closed;
+    c->reactor->closed = c;
+}
 
-    printf("%s\n", proxyRequest);
+void free_conn(conn_t *c) {
+    if (c->obj != NULL) {
+        release_object(c->obj);
+    }
+    drop_stale(c);
+    drop_blocks(c);
+    free(c->rbuf);
+    free_outvec(&c->request);
+    free_outvec(&c->out);
+    free(c->buf);
+    free(c->head);
+    free(c);
+}
 
-    // forward client request to origin server and get returned object
-    // if size of returned object is bigger than MAX_OBJECT_SIZE, then 
-    // truncate it
-    size_t requestLen = request_pointer - &proxyRequest[0];
-    forwarding(proxyRequest, requestLen, 
-            hostName, port, path, clientfd, cache); 
+void on_conn_event(reactor_t *r, watcher_t *w, poll_event_t *ev) {
+    conn_t *c = (conn_t*)w->data;
+    if (c->closed) {
+        return ; // closed earlier in this batch
+    }
+    if (ev->len > 0) {
+        // the first read, done by the poller; rbuf is empty and at least
+        // as large as its buffers
+        memcpy(c->rbuf, ev->buf, ev->len);
+        c->rlen = ev->len;
+    }
+    w->revents |= ev->events;
+    drive_conn(c);
 }
 
+// (re)start the connection's deadline for kind
+void set_timeout(conn_t *c, int kind) {
+    c->timeout = kind;
+    add_timer(&c->reactor->wheel, &c->timer, now_ms(), timeout_ms[kind]);
+}
 
-void forwarding(char *message, size_t requestLen, char *hostName, 
-                char *port, char *path, int clientfd, cache_t *cache) {
+void clear_timeout(conn_t *c) {
+    del_timer(&c->timer);
+}
 
-    char tag[MAX_LINE_LEN];
-    strcat(tag, hostName);
-    strcat(tag, ":");
-    strcat(tag, port);
-    strcat(tag, path);
-    char *content;
-    printf("%s\n", tag);
-    
-    // find content in cache
-    if ((content = find_cache(cache, tag)) != NULL) {
-        Rio_writen(clientfd, content, strlen(content));
+// the response moved, push its deadline back
+void touch_timeout(conn_t *c) {
+    if (c->timer.slot != NULL && c->timeout == TIMEOUT_TRANSFER) {
+        set_timeout(c, TIMEOUT_TRANSFER);
+    }
+}
+
+void on_timeout(wtimer_t *t) {
+    conn_t *c = (conn_t*)t->data;
+    atomic_fetch_add_explicit(&c->reactor->expired[c->timeout], 1,
+                              memory_order_relaxed);
+    if (c->timeout == TIMEOUT_CONNECT) {
+        connect_timeout(c);
         return ;
     }
- 
-    // connect to default http port
-    int connectfd = open_clientfd(hostName, port);    
-    // connect error
-    if (connectfd < 0) {
-        fprintf(stderr, "Open_clientfd error\n");
+    if (c->timeout == TIMEOUT_FIRST_BYTE || c->timeout == TIMEOUT_TRANSFER) {
+        log_msg(LOG_WARN, "%s timeout on %s", timeout_names[c->timeout],
+                c->tag);
+    }
+    close_conn(c);
+}
+
+// the lookup or the connect to the current address took too long
+void connect_timeout(conn_t *c) {
+    if (c->state != CONN_CONNECT_UPSTREAM) {
+        log_msg(LOG_WARN, "resolving %s timed out", c->hostName);
+        close_conn(c);
         return ;
     }
+    log_msg(LOG_WARN, "connect to %s:%s timed out", c->hostName, c->port);
+    close_watcher(c->reactor, &c->upstream);
+    c->addr++;
+    drive_conn(c);
+}
 
-    rio_t rio;
-    Rio_readinitb(&rio, connectfd);
+// run state handlers until one would block or the connection is done
+void drive_conn(conn_t *c) {
+    while (1) {
+        int rc;
+        switch (c->state) {
+        case CONN_READ_REQUEST:
+            rc = do_read_request(c);
+            break;
+        case CONN_RESOLVE:
+            rc = do_resolve(c);
+            break;
+        case CONN_CONNECT_UPSTREAM:
+            rc = do_connect_upstream(c);
+            break;
+        case CONN_SEND_REQUEST:
+            rc = do_send_request(c);
+            break;
+        case CONN_READ_RESPONSE:
+            rc = do_read_response(c);
+            break;
+        case CONN_RELAY:
+            rc = do_relay(c);
+            break;
+        case CONN_SPLICE:
+            rc = do_splice(c);
+            break;
+        case CONN_WRITE_RESPONSE:
+            rc = do_write_response(c);
+            break;
+        case CONN_WAIT_FLIGHT:
+            rc = do_wait_flight(c);
+            break;
+        case CONN_BLOCKS:
+            rc = do_blocks(c);
+            break;
+        default:
+            rc = STEP_CLOSE;
+        }
 
-    // sent request
-    Rio_writen(connectfd, message, requestLen); 
+        if (rc == STEP_AGAIN) {
+            return ;
+        }
+        if (rc == STEP_CLOSE) {
+            close_conn(c);
+            return ;
+        }
+    }
+}
 
-    // get response
-    int cnt;
-    int total_bytes = 0;
-    char usrbuf[MAX_OBJECT_SIZE];
-    char cachebuf[MAX_OBJECT_SIZE];
-    int flag = 0;
+int do_read_request(conn_t *c) {
+    // a pipelined request may be in the buffer already, the parser only
+    // looks at bytes it has not seen
+    int rc = parse_request(&c->parser, c->rbuf, c->rlen);
+    while (rc == PARSE_AGAIN) {
+        if (c->rlen == c->rcap) {
+            if (c->rcap == MAX_REQUEST_LEN) {
+                log_msg(LOG_WARN, "Request header is too long");
+                return STEP_CLOSE;
+            }
+            c->rcap *= 2;
+            c->rbuf = (char*) Realloc(c->rbuf, c->rcap);
+        }
+        ssize_t n = read(c->client.fd, c->rbuf + c->rlen, c->rcap - c->rlen);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN ? STEP_AGAIN : STEP_CLOSE;
+        }
+        if (n == 0) {
+            return STEP_CLOSE; // client is done, or left mid request
+        }
+        c->rlen += n;
+        if (c->timeout == TIMEOUT_IDLE) {
+            set_timeout(c, TIMEOUT_HEADER);  // the next request began
+            c->start_us = now_us();
+        }
+        rc = parse_request(&c->parser, c->rbuf, c->rlen);
+    }
+    if (rc == PARSE_ERROR) {
+        log_msg(LOG_WARN, "Malformed request header");
+        return STEP_CLOSE;
+    }
+    c->rused = c->parser.end;
+    clear_timeout(c);
+    c->parsed_us = now_us();
 
-    while ((cnt = Rio_readnb(&rio, usrbuf, MAX_OBJECT_SIZE))) {
-        total_bytes += cnt;
-        if (total_bytes > MAX_OBJECT_SIZE) {
-            flag = 1;
-        } else {
-            strncat(cachebuf, usrbuf, cnt);
+    if (is_stats_request(c)) {
+        return serve_stats(c);
+    }
+    if (!process_client(c)) {
+        return STEP_CLOSE;
+    }
+    add_stat(&c->reactor->counts[COUNT_REQUESTS], 1);
+    return lookup_request(c);
+}
+
+// the cache's answer to a parsed request, or the origin's
+int lookup_request(conn_t *c) {
+    c->obj = find_cache(c->reactor->cache, c->tag);
+    if (c->obj != NULL && c->obj->total > 0) {
+        // kept in blocks, which are not revalidated: once expired the
+        // object is fetched again and replaces them
+        long expires = atomic_load(&c->obj->expires);
+        if (expires == 0 || wall_ms() < expires) {
+            return serve_blocks(c);
         }
-        Rio_writen(clientfd, usrbuf, cnt);
+        release_object(c->obj);
+        c->obj = NULL;
+    }
+    if (c->obj != NULL) {
+        long expires = atomic_load(&c->obj->expires);
+        long now = wall_ms();
+        int fresh = expires == 0 || now < expires;
+        if (!fresh && now < expires + c->obj->swr) {
+            // good enough for now, one refresh per object meanwhile
+            if (!atomic_exchange(&c->obj->refreshing, 1)) {
+                start_refresh(c);
+            }
+            fresh = 1;
+        }
+        if (fresh) {
+            count_hit(c);
+            set_timeout(c, TIMEOUT_TRANSFER);
+            if (!relay_range(c, c->obj)) {
+                relay_cached(c, c->obj);
+            }
+            c->framing = BODY_LENGTH;   // cached objects always have a length
+            c->body_done = 1;
+            c->state = CONN_WRITE_RESPONSE;
+            return STEP_NEXT;
+        }
+        // too stale, ask the origin whether it still holds
+        c->stale = c->obj;
+        c->obj = NULL;
     }
 
-   
-    if (!flag ) {
-        if (cache->total_size + total_bytes < MAX_CACHE_SIZE) {
-            // insert
-            insert_cache(cache, cachebuf, tag);
-        } else {
-            // replace
-            replace_cache(cache, cachebuf, tag);
+    // a miss costs an origin fetch, which the proxy may not afford now
+    if (c->shed || !take_fetch(c)) {
+        return shed_request(c);
+    }
+
+    // only one miss per URL goes to the origin, the others follow it; a
+    // range, a 304 or a response for someone's cookies is what its client
+    // asked for alone
+    int leader = 1;
+    if (c->range.len == 0 && !c->personal && !c->solo) {
+        c->flight = join_flight(c->reactor->flights, c->tag, c->http11,
+                                &leader);
+    }
+    c->service = HIST_MISS;
+    if (!leader) {
+        release_fetch(c);   // the leader fetches for it
+        add_stat(&c->reactor->counts[COUNT_COALESCED], 1);
+        // the eventfd may be watched by several reactors, each through
+        // its own fd
+        c->flight_watch.fd = fcntl(c->flight->efd, F_DUPFD_CLOEXEC, 0);
+        if (c->flight_watch.fd < 0) {
+            unix_error("fcntl error");
         }
+        add_watcher(c->reactor, &c->flight_watch);
+        memset(&c->cursor, 0, sizeof(c->cursor));
+        set_timeout(c, TIMEOUT_TRANSFER);
+        c->state = CONN_WAIT_FLIGHT;
+        return STEP_NEXT;
     }
-    close(connectfd);
+    c->flight_leader = c->flight != NULL;
+    add_stat(&c->reactor->counts[COUNT_MISSES], 1);
+    build_request(c);
+    return begin_fetch(c);
 }
 
-int process_http_header(rio_t *rp, char **pte, 
-                    char *method, char *hostName, char *port,
-                    char *path, char *version) {
-    char usrbuf[MAX_LINE_LEN];
-    ssize_t len = Rio_readlineb(rp, usrbuf, MAX_LINE_LEN);
-    usrbuf[len - 2] = ' ';
-    
-    char *arr = usrbuf;
-    char *p = strchr(arr, ' ');
-    *p = '\0';
-    strcpy(method, arr); // get method
-
-    // don't support other method
-    if (strcmp(method, "GET")) {
+// take one of the max_fetches slots, 0 if all are in use
+int take_fetch(conn_t *c) {
+    int n = atomic_fetch_add(&fetches, 1);
+    if (max_fetches > 0 && n >= max_fetches) {
+        atomic_fetch_sub(&fetches, 1);
         return 0;
     }
+    c->fetching = 1;
+    return 1;
+}
 
-    char url[MAX_LINE_LEN];
-    arr = p + 1;
-    p = strchr(arr, ' ');
-    *p = '\0';
-    strcpy(url, arr); // get url
-    
-    // using url fill hostName, port and path
-    // if wrong format, return 0
-    if (!process_url(url, hostName, port, path)) {
-        return 0;
+void release_fetch(conn_t *c) {
+    if (c->fetching) {
+        c->fetching = 0;
+        atomic_fetch_sub(&fetches, 1);
     }
+}
 
-    arr = p + 1;
-    p = strchr(arr, ' ');
-    *p = '\0';
-    strcpy(version, arr);
-    
-    version[strlen(version) - 1] = '0';
-
-    int cnt = sprintf(*pte, "%s", method); 
-    *pte += cnt;
-    cnt = sprintf(*pte, " %s", path);
-    *pte += cnt;
-    cnt = sprintf(*pte, " %s\r\n", version);
-    *pte += cnt;
-    
-    // return normally
-    return 1;
+// overloaded: a stale copy is better than nothing, else a 503 at once
+int shed_request(conn_t *c) {
+    reactor_t *r = c->reactor;
+    atomic_fetch_add_explicit(c->shed ? &r->shed_late : &r->shed_busy, 1,
+                              memory_order_relaxed);
+    set_timeout(c, TIMEOUT_TRANSFER);
+    if (c->stale != NULL) {
+        c->obj = c->stale;
+        c->stale = NULL;
+        count_hit(c);
+        relay_cached(c, c->obj);
+    } else {
+        copy_outvec(&c->out, overload_response, strlen(overload_response));
+        c->keep_alive = 0;
+    }
+    c->framing = BODY_LENGTH;
+    c->body_done = 1;
+    c->state = CONN_WRITE_RESPONSE;
+    return STEP_NEXT;
 }
 
-int process_request_header(rio_t *rp, char **pte, const char *hostName) {
-    char usrbuf[MAX_LINE_LEN];
-    int nbytes;
-    int hostFlag = 0;
-    while ((nbytes = Rio_readlineb(rp, usrbuf, MAX_LINE_LEN))) {
-        int cnt;
-        if (nbytes == 2 && !strcmp(usrbuf, "\r\n")) { // blank line
-            cnt = sprintf(*pte, "%s", usrbuf);
-            *pte += cnt;
-            break;
+// the bytes are counted where they are sent from the object
+void count_hit(conn_t *c) {
+    add_stat(&c->reactor->counts[COUNT_HITS], 1);
+    c->service = HIST_HIT;
+}
+
+// reuse an idle connection to the origin if there is one
+int begin_fetch(conn_t *c) {
+    c->fetch_start = now_ms();
+    int fd = take_pool(c->reactor->pool, c->hostName, c->port);
+    if (fd >= 0) {
+        c->upstream.fd = fd;
+        c->reused = 1;
+        add_watcher(c->reactor, &c->upstream);
+        set_timeout(c, TIMEOUT_FIRST_BYTE);
+        rewind_outvec(&c->request);
+        c->state = CONN_SEND_REQUEST;
+        return STEP_NEXT;
+    }
+    return start_connect(c);
+}
+
+int start_connect(conn_t *c) {
+    if (c->addrs.n == 0) {
+        dns_req_t *req = (dns_req_t*) Malloc(sizeof(dns_req_t));
+        req->done = on_resolved;
+        req->owner = c->reactor;
+        req->data = c;
+        int rc = dns_lookup(c->reactor->dns, c->hostName, c->port,
+                            &c->addrs, req);
+        if (rc == DNS_WAIT) {
+            c->dns = req;
+            set_timeout(c, TIMEOUT_CONNECT);
+            c->state = CONN_RESOLVE;
+            return STEP_AGAIN;
         }
+        free(req);
+        if (rc == DNS_FAIL) {
+            log_msg(LOG_WARN, "%s recently failed to resolve", c->hostName);
+            return STEP_CLOSE;
+        }
+    }
+    c->addr = 0;
+    c->state = CONN_CONNECT_UPSTREAM;
+    return STEP_NEXT;
+}
+
+// on_wakeup() fills in the addresses once the lookup is done
+int do_resolve(conn_t *c) {
+    if (c->dns != NULL) {
+        return STEP_AGAIN;  // woken by something else
+    }
+    clear_timeout(c);
+    if (c->addrs.n == 0) {
+        return STEP_CLOSE;  // the resolver thread said why
+    }
+    c->addr = 0;
+    c->state = CONN_CONNECT_UPSTREAM;
+    return STEP_NEXT;
+}
 
-        char header[MAX_LINE_LEN], content[MAX_LINE_LEN]; 
-        char *p = usrbuf;
-        char *delimeter = strchr(p, ':'); 
+// the origin closed a pooled connection before answering, GET is
+// idempotent so send the request again on a new connection
+int retry_upstream(conn_t *c) {
+    close_watcher(c->reactor, &c->upstream);
+    c->reused = 0;
+    c->buflen = 0;
+    return start_connect(c);
+}
 
-        if (delimeter == NULL) {
-            // not a valid header, exit with failure
-            return 0;
+int do_connect_upstream(conn_t *c) {
+    while (c->addr < c->addrs.n) {
+        if (c->upstream.fd < 0) {
+            dns_addr_t *p = &c->addrs.addr[c->addr];
+            int fd = socket(p->family,
+                            p->socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                            p->protocol);
+            if (fd < 0) {
+                c->addr++;
+                continue;
+            }
+            c->connect_us = now_us();
+            if (connect(fd, (SA *)&p->addr, p->addrlen) < 0 &&
+                errno != EINPROGRESS) {
+                close(fd);
+                c->addr++;
+                continue;
+            }
+            c->upstream.fd = fd;
+            add_watcher(c->reactor, &c->upstream);
+            // connect_timeout() moves on if this one hangs
+            set_timeout(c, TIMEOUT_CONNECT);
         }
 
-        *delimeter = '\0';
-        strcpy(header, p);
-        p = delimeter + 1;
-        strcpy(content, p);
-        
-        if (!strcmp(header, "Host")) {
-            hostFlag = 1;
-            cnt = sprintf(*pte, "%s:%s", header, content);
-            *pte += cnt;
-        } else if (!strcmp(header, "User-Agent")) {
-            cnt = sprintf(*pte, "%s", user_agent_hdr); 
-            *pte += cnt;
-        } else if (!strcmp(header, "Connection")) {
-            cnt = sprintf(*pte, "%s: close", header); 
-            *pte += cnt;
-        } else if (!strcmp(header, "Proxy-Connection")) {
-            cnt = sprintf(*pte, "%s: close", header); 
-            *pte += cnt;
-        } else { // other headers, forward them unchanged
-            cnt = sprintf(*pte, "%s:%s", header, content); 
-            *pte += cnt;
+        // writable (or failed) once the handshake is over
+        if (!(c->upstream.revents & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return STEP_AGAIN;
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->upstream.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err == 0) {
+            record_hist(&c->reactor->hists[HIST_CONNECT],
+                        now_us() - c->connect_us);
+            set_timeout(c, TIMEOUT_FIRST_BYTE);
+            rewind_outvec(&c->request);
+            c->state = CONN_SEND_REQUEST;
+            return STEP_NEXT;
         }
-    }
 
-    if (!hostFlag) {
-        // brower doesn't send Host header, add default one
-        int cnt = sprintf(*pte, "Host: %s", hostName);
-        *pte += cnt;
+        // try the next address
+        close_watcher(c->reactor, &c->upstream);
+        c->addr++;
     }
 
-    return 1; // return normally
+    clear_timeout(c);
+    log_msg(LOG_WARN, "Open_clientfd error");
+    return STEP_CLOSE;
 }
 
+int do_send_request(conn_t *c) {
+    while (c->request.left > 0) {
+        ssize_t n = send_outvec(&c->request, c->upstream.fd);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return STEP_AGAIN;
+            }
+            return c->reused ? retry_upstream(c) : STEP_CLOSE;
+        }
+    }
+    c->sent_us = now_us();
 
-int process_url(const char *url, char *hostName, char *port, char *path) {
-    char urlcopy[MAX_LINE_LEN]; 
-    strcpy(urlcopy, url);
-    char *p = urlcopy;
-    p = strstr(p, "http://");
-    if (p == NULL) {
-        // not a valid http url
-        return 0; // 
+    if (c->buf == NULL) {
+        c->bufcap = MAXBUF;
+        c->buf = (char*) Malloc(c->bufcap + 1);
     }
-    p += strlen("http://");
-    
-    // hostName and port
-    char *del_colon = strchr(p, ':');
-    char *del_slash = strchr(p, '/');
+    c->buflen = 0;
+    c->state = CONN_READ_RESPONSE;
+    return STEP_NEXT;
+}
 
-    // invalid http url
-    if (del_slash == NULL) {
-        return 0;
+int do_read_response(conn_t *c) {
+    char *eoh = NULL;
+    while (eoh == NULL) {
+        if (c->buflen == c->bufcap) {
+            if (c->bufcap >= MAX_HEADER_LEN) {
+                log_msg(LOG_WARN, "Response header is too long");
+                return STEP_CLOSE;
+            }
+            c->bufcap *= 2;
+            c->buf = (char*) Realloc(c->buf, c->bufcap + 1);
+        }
+        ssize_t n = read(c->upstream.fd, c->buf + c->buflen,
+                         c->bufcap - c->buflen);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return STEP_AGAIN;
+            }
+            n = 0;
+        }
+        if (n == 0) {
+            if (c->buflen == 0 && c->reused) {
+                return retry_upstream(c);
+            }
+            if (c->blocks != NULL) {
+                log_msg(LOG_WARN, "%s: no answer to a range request", c->tag);
+                return STEP_CLOSE;
+            }
+            // no complete header, relay whatever the origin sent
+            c->upstream_eof = 1;
+            c->framing = BODY_CLOSE;
+            set_timeout(c, TIMEOUT_TRANSFER);
+            relay_out(c, c->buf, c->buflen);
+            c->state = CONN_RELAY;
+            return STEP_NEXT;
+        }
+        if (c->buflen == 0) {
+            record_hist(&c->reactor->hists[HIST_TTFB], now_us() - c->sent_us);
+        }
+        add_stat(&c->reactor->counts[COUNT_ORIGIN_BYTES], n);
+        size_t from = c->buflen > 3 ? c->buflen - 3 : 0;
+        c->buflen += n;
+        c->buf[c->buflen] = '\0';
+        eoh = strstr(c->buf + from, "\r\n\r\n");
     }
-    
-    if (del_colon == NULL) {
-        // default port 80
-        strcpy(port, "80");
-        *del_slash = '\0';
-        strcpy(hostName, p);
+    set_timeout(c, TIMEOUT_TRANSFER);
+
+    size_t hdrlen = eoh + 4 - c->buf;
+    int parsed = parse_response_header(c->buf, hdrlen, &c->resp);
+    if (!parsed) {
+        // not HTTP/1.x, relay it until the origin closes
+        c->framing = BODY_CLOSE;
+    } else if (!response_has_body(&c->resp)) {
+        c->framing = BODY_NONE;
+        c->body_done = 1;
+    } else if (c->resp.chunked) {
+        c->framing = BODY_CHUNKED;
+        init_chunk_decoder(&c->chunks);
+    } else if (c->resp.content_length >= 0) {
+        c->framing = BODY_LENGTH;
+        c->remain = c->resp.content_length;
+        c->body_done = c->remain == 0;
     } else {
-        *del_colon = '\0';
-        strcpy(hostName, p);
-        p = del_colon + 1;
-        *del_slash = '\0';
-        strcpy(port, p);
+        c->framing = BODY_CLOSE;
+        c->resp.keep_alive = 0;
     }
 
-    p = del_slash + 1;
-    path[0] = '/';
-    path[1] = '\0';
-    strncat(path, p, MAX_LINE_LEN - 2);
-    return 1;
+    // hop-by-hop headers only concern the proxy's own connections
+    size_t newlen = strip_hop_headers(c->buf, hdrlen, 0);
+    memmove(c->buf + newlen, c->buf + hdrlen, c->buflen - hdrlen);
+    c->buflen -= hdrlen - newlen;
+    hdrlen = newlen;
+
+    if (c->blocks != NULL) {
+        return take_blocks(c, hdrlen);
+    }
+    if (c->stale != NULL) {
+        if (c->resp.status == 304) {
+            // unchanged: the cached copy goes out instead, fresh again
+            long ttl = c->resp.max_age >= 0 ?
+                c->resp.max_age * 1000 : c->stale->ttl;
+            atomic_store(&c->stale->expires, wall_ms() + ttl);
+            atomic_store(&c->stale->date, wall_ms());
+            consume_body(c, c->buf + hdrlen, c->buflen - hdrlen);
+            add_stat(&c->reactor->counts[COUNT_REVALIDATED], 1);
+            relay_cached(c, c->stale);
+            c->state = CONN_RELAY;
+            return STEP_NEXT;
+        }
+        drop_stale(c);  // a new version replaces it
+    }
+    if (c->resp.status == 200 && !c->personal &&
+        !response_storable(&c->resp, 0)) {
+        // the origin no longer lets anyone keep it, older copies neither
+        remove_cache(c->reactor->cache, c->tag);
+    }
+
+    long first, total;
+    if (parsed && blocks_body(c, hdrlen, &first, &total)) {
+        return start_blocks(c, hdrlen, first, total);
+    }
+    if (c->flight_leader && c->framing == BODY_LENGTH &&
+        hdrlen + c->remain > MAX_OBJECT_SIZE) {
+        // too big to share, waiters fetch on their own
+        abandon_flight(c->reactor->flights, c->flight);
+    }
+
+    // only 200 responses a shared cache may keep are cached, sized once
+    // from Content-Length when the origin sent it. Any other body is
+    // collected on its own and gets its header back, with a
+    // Content-Length, once complete.
+    if (c->resp.status == 200 && response_storable(&c->resp, c->authorized)) {
+        if (c->framing != BODY_LENGTH) {
+            c->head = (char*) Malloc(hdrlen);
+            memcpy(c->head, c->buf, hdrlen);
+            c->headlen = hdrlen;
+            c->obj = create_object(MAXBUF);
+        } else if (hdrlen + c->remain <= MAX_OBJECT_SIZE) {
+            c->obj = create_object(hdrlen + c->remain);
+            if (append_object(&c->obj, c->buf, hdrlen) < 0) {
+                c->obj = NULL;
+            }
+        }
+    }
+
+    // body bytes that came in with the header
+    size_t body = consume_body(c, c->buf + hdrlen, c->buflen - hdrlen);
+    const char *head = c->obj != NULL && c->head == NULL ?
+        c->obj->data : c->buf;
+    if (parsed) {
+        relay_head(c, head, hdrlen);
+        relay_out(c, head + hdrlen, body);
+    } else {
+        relay_out(c, head, hdrlen + body);
+    }
+    c->state = CONN_RELAY;
+    return STEP_NEXT;
 }
 
+// body: read straight into the object while it is cacheable, switch to
+// the connection buffer once it is not. A chunked body is relayed as is
+// and decoded on the side.
+int do_relay(conn_t *c) {
+    while (1) {
+        int rc = flush_out(c);
+        if (rc != STEP_NEXT) {
+            return rc;
+        }
+        if (c->body_done || c->upstream_eof) {
+            finish_response(c);
+            return next_request(c);
+        }
+        if (c->obj == NULL && can_splice(c)) {
+            c->state = CONN_SPLICE;
+            return STEP_NEXT;
+        }
 
-void init_sbuf(sbuf_t *buf) {
-    buf->head = 0;
-    buf->tail = 0;
+        char *dst = c->buf;
+        size_t room = c->bufcap;
+        if (c->obj != NULL && c->framing != BODY_CHUNKED) {
+            if (reserve_object(&c->obj, c->obj->size + 1) < 0) {
+                c->obj = NULL;  // too big to cache
+            } else {
+                dst = c->obj->data + c->obj->size;
+                room = c->obj->capacity - c->obj->size;
+            }
+        }
+        if (c->framing == BODY_LENGTH && room > c->remain) {
+            room = c->remain;
+        }
 
-    Sem_init(&buf->lock, 0, 1);
-    Sem_init(&buf->remain, 0, 0);
-    Sem_init(&buf->available, 0, FDBUF_SIZE);
+        ssize_t n = read(c->upstream.fd, dst, room);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return STEP_AGAIN;
+            }
+            n = 0;  // treat a reset like the end of the response
+        }
+        if (n == 0) {
+            c->upstream_eof = 1;
+            if (c->framing == BODY_CLOSE) {
+                c->body_done = 1;
+            }
+            continue;
+        }
+        touch_timeout(c);
+        add_stat(&c->reactor->counts[COUNT_ORIGIN_BYTES], n);
+        relay_out(c, dst, consume_body(c, dst, n));
+    }
 }
 
-void insert_sbuf(sbuf_t *buf, int fd) {
-    P(&buf->available);
+// once nothing needs to see the body any more, let the kernel move it:
+// the rest of a body being cached, or shared with a flight's waiters,
+// and a chunked one (only the decoder knows where it ends) is copied
+int can_splice(conn_t *c) {
+    if (c->framing != BODY_LENGTH && c->framing != BODY_CLOSE) {
+        return 0;
+    }
+    if ((c->flight != NULL && !c->flight->abandoned) || c->client_dead) {
+        return 0;
+    }
+    if (c->pipefd[0] < 0 && pipe2(c->pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        c->pipefd[0] = c->pipefd[1] = -1;
+        return 0;   // out of fds, copying still works
+    }
+    return 1;
+}
 
-    P(&buf->lock);
-    buf->fdbuf[buf->tail] = fd;
-    buf->tail = (buf->tail + 1) % FDBUF_SIZE;
-    V(&buf->lock);
+int do_splice(conn_t *c) {
+    while (1) {
+        // the pipe is emptied before it is filled again, so EAGAIN from
+        // either splice is about the socket
+        while (c->piped > 0) {
+            ssize_t n = splice(c->pipefd[0], NULL, c->client.fd, NULL,
+                               c->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN ? STEP_AGAIN : STEP_CLOSE;
+            }
+            c->piped -= n;
+            touch_timeout(c);
+        }
+        if (c->body_done || c->upstream_eof) {
+            finish_response(c);
+            return next_request(c);
+        }
 
-    V(&buf->remain);
+        size_t want = SPLICE_CHUNK;
+        if (c->framing == BODY_LENGTH && want > c->remain) {
+            want = c->remain;
+        }
+        ssize_t n = splice(c->upstream.fd, NULL, c->pipefd[1], NULL, want,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return STEP_AGAIN;
+            }
+            n = 0;  // treat a reset like the end of the response
+        }
+        if (n == 0) {
+            c->upstream_eof = 1;
+            if (c->framing == BODY_CLOSE) {
+                c->body_done = 1;
+            }
+            continue;
+        }
+        c->piped += n;
+        add_stat(&c->reactor->counts[COUNT_ORIGIN_BYTES], n);
+        if (c->framing == BODY_LENGTH) {
+            c->remain -= n;
+            c->body_done = c->remain == 0;
+        }
+    }
 }
 
-int remove_sbuf(sbuf_t *buf) {
-    int retv;
-    P(&buf->remain);
-     
-    P(&buf->lock);
-    retv = buf->fdbuf[buf->head];
-    buf->head = (buf->head + 1) % FDBUF_SIZE;
-    V(&buf->lock);
+// n body bytes arrived at data, which is either the free tail of c->obj
+// or c->buf; returns how many of them belong to this response
+size_t consume_body(conn_t *c, char *data, size_t n) {
+    switch (c->framing) {
+    case BODY_NONE:
+        c->junk |= n > 0;
+        return 0;
+    case BODY_LENGTH:
+        if (n > c->remain) {
+            c->junk = 1;
+            n = c->remain;
+        }
+        c->remain -= n;
+        c->body_done = c->remain == 0;
+        break;
+    case BODY_CHUNKED: {
+        char *out = NULL;
+        if (c->obj != NULL && reserve_object(&c->obj, c->obj->size + n) < 0) {
+            c->obj = NULL;  // decoded body too big to cache
+        }
+        if (c->obj != NULL) {
+            out = c->obj->data + c->obj->size;
+        }
+        size_t outlen;
+        ssize_t used = decode_chunked(&c->chunks, data, n, out, &outlen);
+        if (used < 0) {
+            // broken framing, relay the rest until the origin closes
+            if (c->obj != NULL) {
+                release_object(c->obj);
+                c->obj = NULL;
+            }
+            c->framing = BODY_CLOSE;
+            c->resp.keep_alive = 0;
+            return n;
+        }
+        if (c->obj != NULL) {
+            c->obj->size += outlen;
+        }
+        if (chunk_decoder_done(&c->chunks)) {
+            c->body_done = 1;
+            c->junk |= used < n;
+        }
+        return used;
+    }
+    default:
+        break;
+    }
+
+    if (c->obj != NULL) {
+        if (data == c->obj->data + c->obj->size) {
+            c->obj->size += n;
+        } else if (append_object(&c->obj, data, n) < 0) {
+            c->obj = NULL;
+        }
+    }
+    return n;
+}
 
-    V(&buf->available);
-    return retv;
+int do_write_response(conn_t *c) {
+    int rc = flush_out(c);
+    if (rc != STEP_NEXT) {
+        return rc;
+    }
+    return next_request(c); // whole response is sent
 }
 
-void *thread_func(void *arg) {
-    Pthread_detach(Pthread_self());
-    sbufcache_t t = *(sbufcache_t*)arg;
+// follow a flight: send what its leader has published so far
+int do_wait_flight(conn_t *c) {
     while (1) {
-        int connectfd = remove_sbuf(t.sbuf);
-        process_client(connectfd, t.cache);
-        Close(connectfd);
+        int rc = flush_out(c);
+        if (rc != STEP_NEXT) {
+            return rc;
+        }
+        // state first: once it is final, the size read after it is too
+        int state = atomic_load(&c->flight->state);
+        const char *p;
+        size_t n;
+        int more = 0;
+        while ((n = read_flight(c->flight, &c->cursor, &p)) > 0) {
+            ref_outvec(&c->out, p, n);  // all of it in one sendmsg()
+            more = 1;
+        }
+        if (more) {
+            continue;
+        }
+        if (state == FLIGHT_RUNNING) {
+            return STEP_AGAIN;
+        }
+        if (state == FLIGHT_FAILED && c->cursor.pos == 0) {
+            // abandoned before any of it was sent: look again, alone
+            drop_flight(c);
+            drop_stale(c);
+            c->solo = 1;
+            return lookup_request(c);
+        }
+
+        // the client saw exactly what the leader's client saw
+        c->framing = c->flight->delimited ? BODY_LENGTH : BODY_CLOSE;
+        c->body_done = state == FLIGHT_DONE;
+        drop_flight(c);
+        return next_request(c);
     }
-    return NULL;
 }
 
-void create_node(cache_node_t *node, 
-                 const char *content, 
-                 const char *tag) {
-    node->size = strlen(content);
-    node->content = (char*)malloc(node->size + 1);
-    strcpy(node->content, content);
-    strcpy(node->tag, tag);
-    node->next = NULL;
-    node->prev = NULL;
+// the leader's next bytes for its client, sent from where they are, and
+// for the flight's waiters
+void relay_out(conn_t *c, const char *p, size_t n) {
+    ref_outvec(&c->out, p, n);
+    if (c->flight != NULL) {
+        feed_flight(c->reactor->flights, c->flight, p, n);
+    }
 }
 
-void delete_node(cache_node_t *node) {
-    free(node->content);
+// same for bytes that don't stay put
+void relay_copy(conn_t *c, const char *p, size_t n) {
+    copy_outvec(&c->out, p, n);
+    if (c->flight != NULL) {
+        feed_flight(c->reactor->flights, c->flight, p, n);
+    }
 }
 
-void init_cache(cache_t *cache) {
-    cache->sentinel = (cache_node_t*) malloc(sizeof(cache_node_t)); 
-    cache->sentinel->next = cache->sentinel; 
-    cache->sentinel->prev = cache->sentinel;
-    cache->total_size = 0;
-    cache->rcnt = 0;
-    cache->wcnt = 0;
-    Sem_init(&cache->rlock, 0, 1);
-    Sem_init(&cache->rcntlock, 0, 1);
-    Sem_init(&cache->wlock, 0, 1);
-    Sem_init(&cache->wcntlock, 0, 1);
+// an origin response header, marked as a miss
+void relay_head(conn_t *c, const char *head, size_t hdrlen) {
+    static const char xcache[] = "X-Cache: MISS\r\n\r\n";
+    relay_out(c, head, hdrlen - 2);
+    relay_copy(c, xcache, sizeof(xcache) - 1);
 }
 
+// a cached response, with an Age header telling how long ago the origin
+// vouched for it; only the Age line is written, the object goes out
+// from the cache as it is
+void relay_cached(conn_t *c, cache_obj_t *obj) {
+    add_stat(&c->reactor->counts[COUNT_CACHE_BYTES], obj->size);
+    const char *data = obj->data;
+    const char *eoh = memmem(data, obj->size, "\r\n\r\n", 4);
+    if (eoh == NULL) {
+        relay_out(c, data, obj->size);
+        return ;
+    }
+    size_t hdrlen = eoh + 4 - data;
+    long age = cached_age(obj);
+
+    // an origin that is a cache itself sent an Age already, ours adds
+    // to it and replaces its line
+    size_t vlen;
+    const char *v = find_header(data, hdrlen, "Age", &vlen);
+    if (v != NULL) {
+        const char *line = v, *eol = memchr(v, '\n', eoh + 2 - v);
+        while (line > data && line[-1] != '\n') {
+            line--;
+        }
+        age += atol(v);
+        relay_out(c, data, line - data);
+        data = eol + 1;
+    }
+    relay_out(c, data, eoh + 2 - data);
 
-// writer
-void insert_cache(cache_t *cache, const char *content, const char *tag) {
-    writer_prelogue(cache);
+    char lines[64];
+    int n = snprintf(lines, sizeof(lines),
+                     "Age: %ld\r\nX-Cache: HIT\r\n\r\n", age);
+    relay_copy(c, lines, n);
+    relay_out(c, eoh + 4, obj->data + obj->size - (eoh + 4));
+}
 
-    cache_node_t *node = (cache_node_t*) malloc(sizeof(cache_node_t));
-    create_node(node, content, tag);
-    insert_node(cache, node);
-    cache->total_size += node->size;
+// send what is in c->out to the client
+int flush_out(conn_t *c) {
+    if (c->client_dead) {
+        reset_outvec(&c->out);
+        return STEP_NEXT;
+    }
+    while (c->out.left > 0) {
+        ssize_t n = send_outvec(&c->out, c->client.fd);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return STEP_AGAIN;
+            }
+            if (c->flight_leader && !c->flight->abandoned &&
+                atomic_load(&c->flight->nwaiters) > 0) {
+                // others depend on this fetch, finish it without the client
+                c->client_dead = 1;
+                c->keep_alive = 0;
+                reset_outvec(&c->out);
+                return STEP_NEXT;
+            }
+            return STEP_CLOSE;
+        }
+        if (!c->first_sent && c->start_us > 0) {
+            c->first_sent = 1;
+            record_hist(&c->reactor->hists[HIST_FIRST_BYTE],
+                        now_us() - c->start_us);
+        }
+        touch_timeout(c);
+    }
+    reset_outvec(&c->out);
+    return STEP_NEXT;
+}
 
-    writer_epilogue(cache);
+// leader: a closed flight fails its waiters, waiter: detach
+void drop_flight(conn_t *c) {
+    if (c->flight_leader) {
+        end_flight(c->reactor->flights, c->flight, 0, 0);
+    } else {
+        // a dup'ed eventfd stays in epoll until removed, the file is
+        // still open elsewhere
+        unwatch_fd(&c->reactor->poller, c->flight_watch.fd, 0);
+        close(c->flight_watch.fd);
+        c->flight_watch.fd = -1;
+        leave_flight(c->flight);
+    }
+    c->flight = NULL;
+    c->flight_leader = 0;
 }
 
-void insert_node(cache_t *cache, cache_node_t *node) {
-    node->next = cache->sentinel->next;
-    node->prev = cache->sentinel;
-    cache->sentinel->next->prev = node;
-    cache->sentinel->next = node;
+// response fully relayed: cache it if it is complete and park the
+// upstream connection if the origin keeps it open
+void finish_response(conn_t *c) {
+    release_fetch(c);
+    if (c->obj != NULL) {
+        if (!c->body_done) {
+            // origin closed early, don't cache a partial object
+            release_object(c->obj);
+        } else if (c->head != NULL) {
+            cache_body_object(c);
+        } else {
+            set_freshness(c->obj, &c->resp);
+            insert_cache(c->reactor->cache, c->tag, c->obj,
+                         now_ms() - c->fetch_start);
+        }
+        c->obj = NULL;
+    }
+
+    // after the insert, so that later misses find the object in the cache
+    if (c->flight != NULL) {
+        end_flight(c->reactor->flights, c->flight, c->body_done,
+                   c->framing != BODY_CLOSE);
+        c->flight = NULL;
+        c->flight_leader = 0;
+    }
+
+    if (c->upstream.fd >= 0 && c->body_done && !c->junk &&
+        !c->upstream_eof && c->resp.keep_alive) {
+        // the pool may hand it to any reactor
+        unwatch_fd(&c->reactor->poller, c->upstream.fd, 0);
+        put_pool(c->reactor->pool, c->hostName, c->port, c->upstream.fd);
+        c->upstream.fd = -1;
+    }
 }
 
+// store a decoded chunked body, or one read up to EOF, with a
+// Content-Length header instead so that any client can be served from it
+// over a persistent connection
+void cache_body_object(conn_t *c) {
+    char length[MAX_LINE_LEN];
+    int lenlen = sprintf(length, "Content-Length: %d\r\n", c->obj->size);
+    size_t headlen = strip_hop_headers(c->head, c->headlen, 1) - 2;
+
+    cache_obj_t *obj = create_object(headlen + lenlen + 2 + c->obj->size);
+    if (append_object(&obj, c->head, headlen) == 0 &&
+        append_object(&obj, length, lenlen) == 0 &&
+        append_object(&obj, "\r\n", 2) == 0 &&
+        append_object(&obj, c->obj->data, c->obj->size) == 0) {
+        set_freshness(obj, &c->resp);
+        insert_cache(c->reactor->cache, c->tag, obj,
+                     now_ms() - c->fetch_start);
+    }
+    release_object(c->obj);
+}
 
-// writer
-void remove_cache(cache_t *cache) {
-    writer_prelogue(cache);
+// the response has been sent: close, or get ready for the client's next
+// request, which only works if the client could tell where this
+// response ended
+int next_request(conn_t *c) {
+    if (c->service >= 0 && c->body_done) {
+        record_hist(&c->reactor->hists[c->service], now_us() - c->parsed_us);
+    }
+    if (!c->keep_alive || c->framing == BODY_CLOSE || !c->body_done) {
+        return STEP_CLOSE;
+    }
 
-    cache_node_t *node = cache->sentinel->prev; 
-    remove_node(node);
-    cache->total_size -= node->size;
-    delete_node(node);
-    free(node);
+    // whatever finish_response() did not park in the pool
+    if (c->upstream.fd >= 0) {
+        close_watcher(c->reactor, &c->upstream);
+    }
+    if (c->obj != NULL) {
+        release_object(c->obj);
+        c->obj = NULL;
+    }
+    drop_stale(c);
+    drop_blocks(c);
+    c->addrs.n = 0;
+    reset_outvec(&c->request);
+    free(c->head);
+    c->head = NULL;
+
+    // drop the request just served, keep what the client pipelined
+    c->rlen -= c->rused;
+    memmove(c->rbuf, c->rbuf + c->rused, c->rlen);
+    c->rused = 0;
+    init_request(&c->parser);
+
+    c->reused = 0;
+    reset_outvec(&c->out);
+    c->buflen = 0;
+    memset(&c->resp, 0, sizeof(c->resp));
+    c->framing = BODY_NONE;
+    c->remain = -1;
+    c->body_done = c->junk = c->upstream_eof = 0;
+
+    c->shed = 0;    // it waited in no queue for the next request
+    c->start_us = c->rlen > 0 ? now_us() : 0;
+    c->first_sent = 0;
+    c->service = -1;
+    c->state = CONN_READ_REQUEST;
+    set_timeout(c, c->rlen > 0 ? TIMEOUT_HEADER : TIMEOUT_IDLE);
+    return STEP_NEXT;
+}
 
-    writer_epilogue(cache);
+
+// a Range on a whole cached object: the bytes asked for in a 206, or a
+// 416; 0 if it is not one range, and the object goes out whole
+int relay_range(conn_t *c, cache_obj_t *obj) {
+    if (c->range.len == 0) {
+        return 0;
+    }
+    const char *eoh = memmem(obj->data, obj->size, "\r\n\r\n", 4);
+    if (eoh == NULL) {
+        return 0;
+    }
+    size_t hdrlen = eoh + 4 - obj->data;
+    long total = obj->size - hdrlen, first, last;
+    int rc = parse_range(c->rbuf + c->range.off, c->range.len, total,
+                         &first, &last);
+    if (rc == RANGE_NONE) {
+        return 0;
+    }
+    if (rc == RANGE_BAD) {
+        write_unsatisfiable(&c->out, total);
+        return 1;
+    }
+    write_range_head(&c->out, obj->data, hdrlen, total, first, last, 1,
+                     cached_age(obj), "HIT");
+    ref_outvec(&c->out, obj->data + hdrlen + first, last - first + 1);
+    add_stat(&c->reactor->counts[COUNT_CACHE_BYTES], last - first + 1);
+    return 1;
+}
+
+// a hit on the header of an object kept in blocks: the range the client
+// asked for, or the whole body, block by block
+int serve_blocks(conn_t *c) {
+    cache_obj_t *head = c->obj;
+    c->obj = NULL;
+    c->blocks = head;
+    c->framing = BODY_LENGTH;
+    set_timeout(c, TIMEOUT_TRANSFER);
+
+    long first = 0, last = head->total - 1;
+    int rc = RANGE_NONE;
+    if (c->range.len > 0) {
+        rc = parse_range(c->rbuf + c->range.off, c->range.len, head->total,
+                         &first, &last);
+    }
+    if (rc == RANGE_BAD) {
+        add_stat(&c->reactor->counts[COUNT_HITS], 1);
+        c->service = HIST_HIT;
+        write_unsatisfiable(&c->out, head->total);
+        c->body_done = 1;
+        c->state = CONN_WRITE_RESPONSE;
+        return STEP_NEXT;
+    }
+
+    // a hit, as far as the first block tells
+    cache_obj_t *block = find_block(c->reactor->cache, c->tag, head,
+                                    first / BLOCK_SIZE);
+    if (block == NULL && (c->shed || !take_fetch(c))) {
+        return shed_request(c);
+    }
+    add_stat(&c->reactor->counts[block != NULL ? COUNT_HITS : COUNT_MISSES],
+             1);
+    c->service = block != NULL ? HIST_HIT : HIST_MISS;
+    write_range_head(&c->out, head->data, head->size, head->total, first,
+                     last, rc == RANGE_OK, cached_age(head),
+                     block != NULL ? "HIT" : "MISS");
+    c->pos = first;
+    c->end = last;
+    if (block != NULL) {
+        send_block(c, block);
+    }
+    c->state = CONN_BLOCKS;
+    return STEP_NEXT;
 }
 
-void remove_node(cache_node_t *node) {
-    node->prev->next = node->next;
-    node->next->prev = node->prev;
+// is the body of this origin response too big for one object: where it
+// starts (a 206 may not start at 0) and how long it is in all
+int blocks_body(conn_t *c, size_t hdrlen, long *first, long *total) {
+    long last;
+    if (c->framing != BODY_LENGTH || c->refresh ||
+        !response_storable(&c->resp, c->authorized)) {
+        return 0;
+    }
+    if (c->resp.status == 200) {
+        *first = 0;
+        *total = c->remain;
+    } else if (c->resp.status != 206 ||
+               !parse_content_range(c->buf, hdrlen, first, &last, total) ||
+               last - *first + 1 != c->remain) {
+        return 0;
+    }
+    return hdrlen + *total > MAX_OBJECT_SIZE;
 }
 
-void free_cache(cache_t *cache) {
-    while (cache->total_size != 0) {
-        remove_cache(cache);
+// a new header for the blocks of the URL, in the cache and pinned; it
+// replaces any older one, and with it the older blocks
+cache_obj_t *cache_blocks_head(conn_t *c, size_t hdrlen, long total) {
+    cache_obj_t *head = create_blocks_head(c->buf, hdrlen, total);
+    if (head == NULL) {
+        return NULL;
     }
-    free(cache->sentinel);
+    set_freshness(head, &c->resp);
+    atomic_fetch_add(&head->refcnt, 1);     // the cache takes the other
+    insert_cache(c->reactor->cache, c->tag, head, now_ms() - c->fetch_start);
+    return head;
 }
 
-// writer 
-void replace_cache(cache_t *cache, const char *content, const char *tag) {
-    writer_prelogue(cache);
+// the first response for an object too big for one: its header is cached
+// at once, the body in blocks as it passes on to the client, which gets
+// the response as the origin sent it
+int start_blocks(conn_t *c, size_t hdrlen, long first, long total) {
+    if ((c->blocks = cache_blocks_head(c, hdrlen, total)) == NULL) {
+        return STEP_CLOSE;
+    }
+    if (c->flight_leader) {
+        // waiters go to the header just cached, as later misses do
+        abandon_flight(c->reactor->flights, c->flight);
+    }
+    size_t body = c->buflen - hdrlen;
+    if (body > c->remain) {
+        c->junk = 1;
+        body = c->remain;
+    }
+    c->pos = c->fill = first;
+    c->end = first + c->remain - 1;
+    c->filling = 1;
+    c->body_done = 0;
+    relay_head(c, c->buf, hdrlen);
+    fill_blocks(c, c->buf + hdrlen, body);
+    c->state = CONN_BLOCKS;
+    return STEP_NEXT;
+}
 
-    remove_cache(cache);
-    insert_cache(cache, content, tag);
+// the origin's answer to fetch_blocks(): a 206 for the blocks asked for,
+// or a 200 with the whole body, cached on its way to them
+int take_blocks(conn_t *c, size_t hdrlen) {
+    long first = 0, last, total = -1;
+    if (c->framing == BODY_LENGTH && c->resp.status == 206) {
+        if (!parse_content_range(c->buf, hdrlen, &first, &last, &total) ||
+            first != c->fill || last - first + 1 != c->remain) {
+            total = -1;
+        }
+    } else if (c->framing == BODY_LENGTH && c->resp.status == 200) {
+        first = 0;
+        total = c->remain;
+    }
+    if (total != c->blocks->total || !response_storable(&c->resp, c->authorized)) {
+        // the object changed, or the origin failed: what the client was
+        // promised cannot be sent, a new body starts over with new blocks
+        log_msg(LOG_WARN, "%s changed, or a range of it failed", c->tag);
+        long start, length;
+        if (blocks_body(c, hdrlen, &start, &length)) {
+            cache_obj_t *head = cache_blocks_head(c, hdrlen, length);
+            if (head != NULL) {
+                release_object(head);
+            }
+        }
+        return STEP_CLOSE;
+    }
 
-    writer_epilogue(cache);
+    size_t body = c->buflen - hdrlen;
+    if (body > c->remain) {
+        c->junk = 1;
+        body = c->remain;
+    }
+    c->fill = first;
+    c->filling = 1;
+    c->body_done = 0;
+    fill_blocks(c, c->buf + hdrlen, body);
+    c->state = CONN_BLOCKS;
+    return STEP_NEXT;
 }
 
-// reader
-char *find_cache(cache_t *cache, const char *tag) {
-    reader_prelogue(cache);
+// body bytes [pos, end] of c->blocks: blocks in the cache go out from
+// there, pinned one at a time; the others come from the origin, and are
+// cached once they are complete and sent
+int do_blocks(conn_t *c) {
+    while (1) {
+        int rc = flush_out(c);
+        if (rc != STEP_NEXT) {
+            return rc;
+        }
+        if (c->obj != NULL) {
+            release_object(c->obj);     // the cached block just sent
+            c->obj = NULL;
+        }
+        if (c->block != NULL && c->block->size == c->block->capacity) {
+            insert_block(c->reactor->cache, c->tag, c->blocks,
+                         (c->fill - 1) / BLOCK_SIZE, c->block,
+                         now_ms() - c->fetch_start);
+            c->block = NULL;
+        }
+        if (c->filling && c->remain == 0) {
+            end_block_fetch(c);
+        }
+
+        if (c->pos > c->end) {
+            if (c->filling) {
+                end_block_fetch(c);     // the rest is not needed
+            }
+            release_fetch(c);
+            if (c->flight != NULL) {
+                end_flight(c->reactor->flights, c->flight, 1, 1);
+                c->flight = NULL;
+                c->flight_leader = 0;
+            }
+            c->body_done = 1;
+            return next_request(c);
+        }
+        if (!c->filling) {
+            long index = c->pos / BLOCK_SIZE;
+            cache_obj_t *block = find_block(c->reactor->cache, c->tag,
+                                            c->blocks, index);
+            if (block == NULL) {
+                return fetch_blocks(c, index);
+            }
+            send_block(c, block);
+            continue;
+        }
 
-    cache_node_t *node = cache->sentinel->next;
-    while (node != cache->sentinel) {
-        if (!strcmp(node->tag, tag)) {
-            // move this node to the head of list
-            remove_node(node);
-            insert_node(cache, node);
+        // straight into the block being filled, or short of a block
+        // start into the connection buffer
+        if (c->block == NULL && c->fill % BLOCK_SIZE == 0) {
+            c->block = create_object(block_len(c->blocks,
+                                               c->fill / BLOCK_SIZE));
+        }
+        char *dst = c->buf;
+        size_t room = BLOCK_SIZE - c->fill % BLOCK_SIZE;
+        if (c->block != NULL) {
+            dst = c->block->data + c->block->size;
+            room = c->block->capacity - c->block->size;
+        } else if (room > c->bufcap) {
+            room = c->bufcap;
+        }
+        if (room > c->remain) {
+            room = c->remain;
+        }
 
-            // release lock
-            reader_epilogue(cache);
-            return node->content;
-        } 
-        node = node->next;
+        ssize_t n = read(c->upstream.fd, dst, room);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return STEP_AGAIN;
+            }
+            n = 0;
+        }
+        if (n == 0) {
+            // the client was promised more than can be sent now
+            log_msg(LOG_WARN, "%s: origin closed in a range", c->tag);
+            return STEP_CLOSE;
+        }
+        touch_timeout(c);
+        add_stat(&c->reactor->counts[COUNT_ORIGIN_BYTES], n);
+        fill_blocks(c, dst, n);
     }
+}
 
-    // release lock
-    reader_epilogue(cache);
-    return NULL;
+// blocks from index on are not cached: ask the origin for them, up to the
+// next one that is or the end of the range
+int fetch_blocks(conn_t *c, long index) {
+    long last = c->end / BLOCK_SIZE, next = index + 1;
+    for (; next <= last; ++next) {
+        cache_obj_t *block = find_block(c->reactor->cache, c->tag,
+                                        c->blocks, next);
+        if (block != NULL) {
+            release_object(block);
+            break;
+        }
+    }
+    if (!c->fetching && (c->shed || !take_fetch(c))) {
+        log_msg(LOG_WARN, "%s: too busy to fetch a range", c->tag);
+        return STEP_CLOSE;
+    }
+    c->fill = index * BLOCK_SIZE;
+    c->fill_last = next * BLOCK_SIZE < c->blocks->total ?
+        next * BLOCK_SIZE - 1 : c->blocks->total - 1;
+    c->service = HIST_MISS;
+    reset_outvec(&c->request);
+    build_request(c);
+    return begin_fetch(c);
 }
 
+// n body bytes from the origin at data, the free tail of c->block or the
+// connection buffer: into the block they belong to, when the fetch has
+// seen its start, and on to the client as far as it asked for them. At
+// most one block fills up per call: reads stop at block ends, and what
+// came with a response header is shorter than a block
+void fill_blocks(conn_t *c, const char *data, size_t n) {
+    while (n > 0) {
+        long index = c->fill / BLOCK_SIZE;
+        size_t cnt = (index + 1) * BLOCK_SIZE - c->fill;
+        if (cnt > n) {
+            cnt = n;
+        }
+        if (c->block == NULL && c->fill % BLOCK_SIZE == 0) {
+            c->block = create_object(block_len(c->blocks, index));
+        }
+        const char *p = data;
+        if (c->block != NULL) {
+            char *dst = c->block->data + c->block->size;
+            if (dst != data) {
+                memcpy(dst, data, cnt);
+            }
+            c->block->size += cnt;
+            p = dst;
+        }
 
+        long from = c->fill > c->pos ? c->fill : c->pos;
+        long to = c->fill + cnt <= c->end ? c->fill + cnt : c->end + 1;
+        if (to > from) {
+            relay_out(c, p + (from - c->fill), to - from);
+            c->pos = to;
+        }
+        c->fill += cnt;
+        c->remain -= cnt;
+        data += cnt;
+        n -= cnt;
+    }
+}
 
-void writer_prelogue(cache_t *cache) {
-    P(&cache->wcntlock); // get lock for wcnt
-    if (cache->wcnt == 0) { // first writer
-        P(&cache->rlock); // block later reader
+// what the client needs of a cached block, sent from the cache
+void send_block(conn_t *c, cache_obj_t *block) {
+    long off = c->pos % BLOCK_SIZE;
+    long n = block->size - off;
+    if (n > c->end + 1 - c->pos) {
+        n = c->end + 1 - c->pos;
     }
-    cache->wcnt++;
-    V(&cache->wcntlock); // release wcntlock for next writer enter
+    ref_outvec(&c->out, block->data + off, n);
+    add_stat(&c->reactor->counts[COUNT_CACHE_BYTES], n);
+    c->pos += n;
+    c->obj = block;     // released once sent
+}
 
-    P(&cache->wlock); // single writer can write 
+// the origin sent what was asked, or the client needs no more of it: an
+// incomplete block is dropped, the connection pooled if it can be
+void end_block_fetch(conn_t *c) {
+    if (c->block != NULL) {
+        release_object(c->block);
+        c->block = NULL;
+    }
+    if (c->remain == 0 && !c->junk && c->resp.keep_alive) {
+        unwatch_fd(&c->reactor->poller, c->upstream.fd, 0);
+        put_pool(c->reactor->pool, c->hostName, c->port, c->upstream.fd);
+        c->upstream.fd = -1;
+    } else {
+        close_watcher(c->reactor, &c->upstream);
+    }
+    c->filling = 0;
+    c->reused = c->junk = 0;
+}
+
+void drop_blocks(conn_t *c) {
+    if (c->block != NULL) {
+        release_object(c->block);
+        c->block = NULL;
+    }
+    if (c->blocks != NULL) {
+        release_object(c->blocks);
+        c->blocks = NULL;
+    }
+    c->filling = 0;
+}
+
+// s since the origin last vouched for a cached object
+long cached_age(cache_obj_t *obj) {
+    long date = atomic_load(&obj->date);
+    return date > 0 ? (wall_ms() - date) / 1000 : 0;
 }
 
-void writer_epilogue(cache_t *cache) {
-    V(&cache->wlock); // writer done
 
-    P(&cache->wcntlock);
-    cache->wcnt--;
-    if (cache->wcnt == 0) { // last writer, release lock for reader
-        V(&cache->rlock);
+// Cache-Control max-age of a new object; without one it stays fresh for
+// good, as everything did before
+void set_freshness(cache_obj_t *obj, const http_response_t *resp) {
+    obj->ttl = resp->max_age >= 0 ? resp->max_age * 1000 : -1;
+    obj->swr = resp->swr * 1000;
+    long now = wall_ms();
+    atomic_store(&obj->date, now);
+    atomic_store(&obj->expires, obj->ttl >= 0 ? now + obj->ttl : 0);
+}
+
+// make the request for the origin conditional on c->stale's validators,
+// which are sent from the pinned object
+void add_validators(conn_t *c) {
+    const char *data = c->stale->data;
+    const char *eoh = memmem(data, c->stale->size, "\r\n\r\n", 4);
+    size_t hdrlen = eoh != NULL ? eoh + 4 - data : 0;
+
+    size_t n;
+    const char *v;
+    if ((v = find_header(data, hdrlen, "ETag", &n)) != NULL) {
+        copy_outvec(&c->request, "If-None-Match: ", 15);
+        ref_outvec(&c->request, v, n);
+        copy_outvec(&c->request, "\r\n", 2);
+    }
+    if ((v = find_header(data, hdrlen, "Last-Modified", &n)) != NULL) {
+        copy_outvec(&c->request, "If-Modified-Since: ", 19);
+        ref_outvec(&c->request, v, n);
+        copy_outvec(&c->request, "\r\n", 2);
+    }
+}
+
+// the client gets the stale hit right away; the revalidation runs on a
+// connection of its own, without a client, that closes once it is done
+void start_refresh(conn_t *c) {
+    conn_t *r = new_conn(c->reactor);
+    if (!take_fetch(r)) {
+        // busy, a later hit tries again
+        atomic_store(&c->obj->refreshing, 0);
+        free_conn(r);
+        return ;
+    }
+    r->client_dead = 1;
+    r->refresh = 1;
+    strcpy(r->hostName, c->hostName);
+    strcpy(r->port, c->port);
+    strcpy(r->tag, c->tag);
+    r->http11 = c->http11;
+    // its request is built from a copy of the client's
+    r->rbuf = (char*) Malloc(c->rused);
+    memcpy(r->rbuf, c->rbuf, c->rused);
+    r->rlen = r->rused = r->rcap = c->rused;
+    r->parser = c->parser;
+    r->stale = c->obj;
+    atomic_fetch_add(&r->stale->refcnt, 1);
+    build_request(r);
+
+    int rc = begin_fetch(r);
+    if (rc == STEP_NEXT) {
+        drive_conn(r);
+    } else if (rc == STEP_CLOSE) {
+        close_conn(r);
     }
-    V(&cache->wcntlock);
 }
 
-void reader_prelogue(cache_t *cache) {
-    P(&cache->rlock); // first get rlock, if there exist one or more 
-                     // writer, blocked
+void drop_stale(conn_t *c) {
+    if (c->stale == NULL) {
+        return ;
+    }
+    if (c->refresh) {
+        // done, a later hit may start the next refresh
+        atomic_store(&c->stale->refreshing, 0);
+    }
+    release_object(c->stale);
+    c->stale = NULL;
+}
+
+// check the parsed request and find what it is for
+int process_client(conn_t *c) {
+    const char *buf = c->rbuf;
+    req_parser_t *p = &c->parser;
+    span_t host, port, path;
+
+    if (!span_is(buf, p->method, "GET")) {
+        log_msg(LOG_WARN, "Doesn't support method: %.*s",
+                (int)p->method.len, buf + p->method.off);
+        return 0;
+    }
+    if (!split_url(buf, p->url, &host, &port, &path) ||
+        !copy_span(c->hostName, sizeof(c->hostName), buf, host) ||
+        !copy_span(c->port, sizeof(c->port), buf, port)) {
+        log_msg(LOG_WARN, "URL format error: %.*s",
+                (int)p->url.len, buf + p->url.off);
+        return 0;
+    }
+    // a fragment never goes to a server, and '#' is what sets the tags of
+    // blocks apart from those of URLs (blocks.c)
+    if (memchr(buf + p->url.off, '#', p->url.len) != NULL) {
+        log_msg(LOG_WARN, "URL has a '#': %.*s",
+                (int)p->url.len, buf + p->url.off);
+        return 0;
+    }
+    if (port.len == 0) {
+        strcpy(c->port, "80");
+    }
+    int n = snprintf(c->tag, MAXLINE, "%s:%s%.*s", c->hostName, c->port,
+                     (int)path.len, buf + path.off);
+    if (n >= MAXLINE) {
+        log_msg(LOG_WARN, "URL is too long");
+        return 0;
+    }
 
-    P(&cache->rcntlock);
-    if (cache->rcnt == 0) {  // first reader, block writing
-        P(&cache->wlock); 
+    // speak HTTP/1.1 to the origin only for HTTP/1.1 clients, they are
+    // the ones able to take a chunked response as it is relayed
+    c->http11 = span_is(buf, p->version, "HTTP/1.1");
+
+    int closeFlag = 0, ifRange = 0;
+    c->range.len = 0;
+    c->personal = c->authorized = 0;
+    c->solo = 0;
+    for (int i = 0; i < p->nheaders; ++i) {
+        span_t name = p->headers[i].name, value = p->headers[i].value;
+        if ((span_is(buf, name, "Connection") ||
+             span_is(buf, name, "Proxy-Connection")) &&
+            value_has_token(buf + value.off, buf + value.off + value.len,
+                            "close")) {
+            closeFlag = 1;
+        } else if (span_is(buf, name, "Range")) {
+            c->range = value;
+        } else if (span_is(buf, name, "If-Range")) {
+            ifRange = c->personal = 1;
+        } else if (span_is(buf, name, "Authorization")) {
+            c->personal = c->authorized = 1;
+        } else if (span_is(buf, name, "If-None-Match") ||
+                   span_is(buf, name, "If-Modified-Since") ||
+                   span_is(buf, name, "Cookie")) {
+            c->personal = 1;
+        }
+    }
+    // a range on condition gets the whole body, which is never wrong
+    if (ifRange) {
+        c->range.len = 0;
     }
-    cache->rcnt++;
-    V(&cache->rcntlock);
-    V(&cache->rlock); // release rlock for reading
+    // an HTTP/1.0 client would need a "Connection: keep-alive" in every
+    // response, including cached ones, so it gets one request per
+    // connection as before
+    c->keep_alive = c->http11 && !closeFlag;
+
+    log_msg(LOG_INFO, "%s", c->tag);
+    return 1;
 }
 
-void reader_epilogue(cache_t *cache) {
-    P(&cache->rcntlock);
-    cache->rcnt--;
-    if (cache->rcnt == 0) { // last reader, release wlock for writing 
-        V(&cache->wlock);
+// the request for the origin: the client's header lines go out from
+// rbuf as they are, runs of them in one piece, and only what the proxy
+// changes is written anew
+void build_request(conn_t *c) {
+    const char *buf = c->rbuf;
+    req_parser_t *p = &c->parser;
+    outvec_t *v = &c->request;
+    span_t host, port, path;
+    split_url(buf, p->url, &host, &port, &path);    // process_client() checked it
+
+    copy_outvec(v, "GET ", 4);
+    ref_outvec(v, buf + path.off, path.len);
+    copy_outvec(v, c->http11 ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n", 11);
+
+    int hostFlag = 0;
+    for (int i = 0; i < p->nheaders; ++i) {
+        span_t name = p->headers[i].name;
+        if (span_is(buf, name, "Host")) {
+            hostFlag = 1;
+        } else if (span_is(buf, name, "User-Agent")) {
+            ref_outvec(v, user_agent_hdr, strlen(user_agent_hdr));
+            continue;
+        } else if (span_is(buf, name, "Connection") ||
+                   span_is(buf, name, "Proxy-Connection") ||
+                   span_is(buf, name, "Keep-Alive")) {
+            continue;   // hop-by-hop, the upstream connection is our own
+        } else if ((c->stale != NULL || c->blocks != NULL) &&
+                   (span_is(buf, name, "If-None-Match") ||
+                    span_is(buf, name, "If-Modified-Since"))) {
+            continue;   // ours replace the client's, blocks take no 304
+        } else if ((c->refresh || c->blocks != NULL) &&
+                   (span_is(buf, name, "Range") ||
+                    span_is(buf, name, "If-Range"))) {
+            continue;   // the blocks missing are asked for instead, a
+                        // refresh is for the whole object
+        } else if ((c->refresh || c->blocks != NULL) &&
+                   (span_is(buf, name, "Cookie") ||
+                    span_is(buf, name, "Authorization"))) {
+            continue;   // what they fetch is shared, not one client's
+        }
+        // other headers, forward them unchanged
+        ref_outvec(v, buf + p->headers[i].line.off, p->headers[i].line.len);
+    }
+    if (!hostFlag) {
+        // brower doesn't send Host header, add default one
+        printf_outvec(v, "Host: %s\r\n", c->hostName);
     }
-    V(&cache->rcntlock);
+    if (c->stale != NULL) {
+        add_validators(c);
+    }
+    if (c->blocks != NULL) {
+        printf_outvec(v, "Range: bytes=%ld-%ld\r\n", c->fill, c->fill_last);
+    }
+    // ask the origin to keep the connection open for the pool
+    copy_outvec(v, "Connection: keep-alive\r\n\r\n", 26);
 }
 
+/* NUL terminated copy of a span, 0 if it does not fit in size bytes */
+int copy_span(char *dst, size_t size, const char *buf, span_t s) {
+    if (s.len >= size) {
+        return 0;
+    }
+    memcpy(dst, buf + s.off, s.len);
+    dst[s.len] = '\0';
+    return 1;
+}
 
-int Epoll_create1(int flags) {
-    int epollfd = epoll_create1(flags);
-    if (epollfd == -1) {
-        perror("epoll_create1");
-        exit(EXIT_FAILURE);
+void init_fdqueue(fdqueue_t *q) {
+    for (size_t i = 0; i < FDQUEUE_SIZE; ++i) {
+        atomic_init(&q->slots[i].seq, i);
     }
-    return epollfd;
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
 }
 
-int Epoll_wait(int epfd, struct epoll_event *events,
-                      int maxevents, int timeout) {
-    int nfds = epoll_wait(epfd, events, maxevents, timeout);
-    if (nfds == -1) {
-        perror("epoll_wait");
-        exit(EXIT_FAILURE);
+int push_fdqueue(fdqueue_t *q, int fd, long queued) {
+    fdslot_t *slot;
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    while (1) {
+        slot = &q->slots[pos & (FDQUEUE_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            // slot is free for pos, claim it
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos,
+                    pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return 0;   // consumers haven't freed it yet, queue is full
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
     }
-    return nfds;
+    slot->fd = fd;
+    slot->queued = queued;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 1;
 }
-            
-int Epoll_ctl(int epfd, int op, int fd,
-                     struct epoll_event *event) {
-    if (epoll_ctl(epfd, op, fd, event) == -1) {
-        perror("epoll_ctl");
-        exit(EXIT_FAILURE);
+
+int pop_fdqueue(fdqueue_t *q, long *queued) {
+    fdslot_t *slot;
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    while (1) {
+        slot = &q->slots[pos & (FDQUEUE_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            // slot holds the fd for pos, claim it
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos,
+                    pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return -1;  // nothing queued
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
     }
-    return 0;
+    int fd = slot->fd;
+    *queued = slot->queued;
+    // free the slot for the producer one lap later
+    atomic_store_explicit(&slot->seq, pos + FDQUEUE_SIZE, memory_order_release);
+    return fd;
+}
+
+/* a snapshot, may be stale by the time it is used */
+size_t fdqueue_len(fdqueue_t *q) {
+    size_t enq = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    size_t deq = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    return enq > deq ? enq - deq : 0;
 }
@@ -0,0 +1,129 @@
+#!/bin/bash
+#
+# rangetest.sh - Range requests answered from the cache
+#
+#     Once an object is cached, a Range request gets a 206 with the
+#     bytes asked for and their Content-Range, and a range past the end
+#     a 416. Both for an object kept whole and for one kept in blocks.
+#
+#     usage: ./rangetest.sh
+#
+
+PORT_START=20000
+MAX_RAND=12000
+MAX_TRIES=50
+
+function wait_for_port {
+    for i in `seq 1 ${MAX_TRIES}`; do
+        (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "Error: nothing listens on port $1"
+    return 1
+}
+
+function pick_port {
+    while true; do
+        port=$((PORT_START + RANDOM % MAX_RAND))
+        (exec 3<>/dev/tcp/127.0.0.1/${port}) 2>/dev/null || { echo ${port}; return; }
+    done
+}
+
+function cleanup {
+    kill ${PROXY_PID} ${ORIGIN_PID} 2>/dev/null
+    wait 2>/dev/null
+    rm -rf ${TMP}
+}
+
+TMP=`mktemp -d /tmp/rangetest.XXXXXX`
+trap cleanup EXIT
+
+# /small fits in one object, /large takes blocks; the origin serves
+# ranges too, which the proxy asks for to fill blocks
+cat > ${TMP}/origin.py <<'EOF'
+import http.server, re, sys
+SIZES = {"/small": 5000, "/large": 300000}
+def body(path):
+    return bytes(i % 251 for i in range(SIZES[path]))
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    def log_message(self, *args):
+        pass
+    def do_GET(self):
+        data = body(self.path)
+        m = re.match(r"bytes=(\d+)-(\d*)$", self.headers.get("Range") or "")
+        if m:
+            first = int(m.group(1))
+            last = min(int(m.group(2) or len(data) - 1), len(data) - 1)
+            self.send_response(206)
+            self.send_header("Content-Range",
+                             "bytes %d-%d/%d" % (first, last, len(data)))
+            data = data[first:last + 1]
+        else:
+            self.send_response(200)
+        self.send_header("Accept-Ranges", "bytes")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+if __name__ == "__main__":
+    http.server.ThreadingHTTPServer(("127.0.0.1", int(sys.argv[1])),
+                                    Handler).serve_forever()
+EOF
+
+ORIGIN_PORT=`pick_port`
+python3 ${TMP}/origin.py ${ORIGIN_PORT} &
+ORIGIN_PID=$!
+PROXY_PORT=`pick_port`
+while [ ${PROXY_PORT} = ${ORIGIN_PORT} ]; do
+    PROXY_PORT=`pick_port`
+done
+./proxy ${PROXY_PORT} >/dev/null 2>&1 &
+PROXY_PID=$!
+wait_for_port ${ORIGIN_PORT} || exit 1
+wait_for_port ${PROXY_PORT} || exit 1
+
+STATUS=0
+
+# check PATH RANGE CODE CONTENT-RANGE [FIRST LAST]: the status, the
+# Content-Range and, for a 206, a hit with the bytes FIRST to LAST
+function check {
+    curl -s -x 127.0.0.1:${PROXY_PORT} -H "Range: $2" -D ${TMP}/head \
+        -o ${TMP}/body http://127.0.0.1:${ORIGIN_PORT}$1
+    local code=`head -1 ${TMP}/head | cut -d' ' -f2`
+    local range=`grep -i '^Content-Range:' ${TMP}/head | cut -d' ' -f2- |
+        tr -d '\r'`
+    if [ "${code}" != $3 ] || [ "${range}" != "$4" ]; then
+        echo "Fail: $1 $2 got ${code} \"${range}\", not $3 \"$4\""
+        STATUS=1
+        return
+    fi
+    if [ $3 = 206 ] && ! grep -qi '^X-Cache: HIT' ${TMP}/head; then
+        echo "Fail: $1 $2 was not answered from the cache"
+        STATUS=1
+    fi
+    if [ $3 = 206 ]; then
+        (cd ${TMP}; python3 -c "import sys, origin
+sys.stdout.buffer.write(origin.body('$1')[$5:$6 + 1])") > ${TMP}/want
+        if ! cmp -s ${TMP}/body ${TMP}/want; then
+            echo "Fail: $1 $2 got the wrong bytes"
+            STATUS=1
+        fi
+    fi
+}
+
+for path in /small /large; do
+    curl -s -x 127.0.0.1:${PROXY_PORT} -o /dev/null \
+        http://127.0.0.1:${ORIGIN_PORT}${path}
+done
+sleep 0.5   # the blocks of /large are cached as they pass
+
+check /small "bytes=100-199" 206 "bytes 100-199/5000" 100 199
+check /small "bytes=-50" 206 "bytes 4950-4999/5000" 4950 4999
+check /small "bytes=4990-" 206 "bytes 4990-4999/5000" 4990 4999
+check /small "bytes=5000-" 416 "bytes */5000"
+check /large "bytes=40000-40099" 206 "bytes 40000-40099/300000" 40000 40099
+check /large "bytes=-10" 206 "bytes 299990-299999/300000" 299990 299999
+check /large "bytes=300000-" 416 "bytes */300000"
+
+[ ${STATUS} = 0 ] && echo "rangetest: ok"
+exit ${STATUS}
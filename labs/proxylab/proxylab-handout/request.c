@@ -0,0 +1,268 @@
+/*
+ * request.c - incremental parser for client request headers
+ *
+ * A line ends at the first CR or LF; a CR must be followed by a LF. The
+ * scan for it also notes the first ':' of the line, which ends a header
+ * name, so every byte of the header is looked at once. On x86-64 that
+ * scan compares 16 bytes at a time (SSE2 is always there), or 32 if the
+ * CPU has AVX2; elsewhere, and for the tail of the buffer, a byte at a
+ * time.
+ */
+#include <stdarg.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "request.h"
+
+static size_t scan_line(const char *buf, size_t i, size_t len, long *colon);
+static size_t scan_bytes(const char *buf, size_t i, size_t len, long *colon);
+static int parse_request_line(req_parser_t *p, const char *buf, size_t eol);
+static int parse_header_line(req_parser_t *p, const char *buf, size_t eol,
+                             size_t next);
+static void reserve_strbuf(strbuf_t *sb, size_t n);
+#ifdef __x86_64__
+static size_t scan_sse2(const char *buf, size_t i, size_t len, long *colon);
+static size_t scan_avx2(const char *buf, size_t i, size_t len, long *colon);
+#endif
+
+void init_request(req_parser_t *p) {
+    p->line = p->scan = 0;
+    p->colon = -1;
+    p->in_headers = 0;
+    p->end = 0;
+    p->nheaders = 0;
+}
+
+int parse_request(req_parser_t *p, const char *buf, size_t len) {
+    while (1) {
+        size_t eol = scan_line(buf, p->scan, len, &p->colon);
+        if (eol == len) {
+            p->scan = len;
+            return PARSE_AGAIN;
+        }
+        size_t next = eol + 1;
+        if (buf[eol] == '\r') {
+            if (next == len) {
+                p->scan = eol;  // look at the CR again with its LF
+                return PARSE_AGAIN;
+            }
+            if (buf[next] != '\n') {
+                return PARSE_ERROR;
+            }
+            next++;
+        }
+
+        if (!p->in_headers) {
+            // empty lines before the request line are ignored
+            if (eol > p->line && !parse_request_line(p, buf, eol)) {
+                return PARSE_ERROR;
+            }
+        } else if (eol == p->line) {
+            p->end = next;
+            return PARSE_DONE;
+        } else if (!parse_header_line(p, buf, eol, next)) {
+            return PARSE_ERROR;
+        }
+        p->line = p->scan = next;
+        p->colon = -1;
+    }
+}
+
+// "method SP url SP version" in buf[p->line, eol)
+int parse_request_line(req_parser_t *p, const char *buf, size_t eol) {
+    const char *line = buf + p->line, *end = buf + eol;
+    const char *sp1 = memchr(line, ' ', end - line);
+    if (sp1 == NULL || sp1 == line) {
+        return 0;
+    }
+    const char *sp2 = memchr(sp1 + 1, ' ', end - sp1 - 1);
+    if (sp2 == NULL || sp2 == sp1 + 1 || sp2 + 1 == end ||
+        memchr(sp2 + 1, ' ', end - sp2 - 1) != NULL) {
+        return 0;
+    }
+    p->method = (span_t){ p->line, sp1 - line };
+    p->url = (span_t){ sp1 + 1 - buf, sp2 - sp1 - 1 };
+    p->version = (span_t){ sp2 + 1 - buf, end - sp2 - 1 };
+    p->in_headers = 1;
+    return 1;
+}
+
+// "name: value" in buf[p->line, eol), the colon found by the scan; the
+// next line starts at next
+int parse_header_line(req_parser_t *p, const char *buf, size_t eol,
+                      size_t next) {
+    size_t colon = p->colon;
+    if (p->colon < 0 || colon == p->line || p->nheaders == MAX_REQ_HEADERS) {
+        return 0;
+    }
+    // no blanks in a name, which also rejects folded lines
+    for (size_t i = p->line; i < colon; ++i) {
+        if (buf[i] == ' ' || buf[i] == '\t') {
+            return 0;
+        }
+    }
+    size_t v = colon + 1, e = eol;
+    while (v < e && (buf[v] == ' ' || buf[v] == '\t')) {
+        v++;
+    }
+    while (e > v && (buf[e - 1] == ' ' || buf[e - 1] == '\t')) {
+        e--;
+    }
+    req_header_t *h = &p->headers[p->nheaders++];
+    h->name = (span_t){ p->line, colon - p->line };
+    h->value = (span_t){ v, e - v };
+    h->line = (span_t){ p->line, next - p->line };
+    return 1;
+}
+
+int split_url(const char *buf, span_t url, span_t *host, span_t *port,
+              span_t *path) {
+    const char *u = buf + url.off, *end = u + url.len;
+    if (url.len < 7 || strncasecmp(u, "http://", 7)) {
+        return 0;
+    }
+    const char *a = u + 7;
+    const char *slash = memchr(a, '/', end - a);
+    if (slash == NULL) {
+        return 0;
+    }
+    const char *colon = memchr(a, ':', slash - a);
+    const char *hend = colon != NULL ? colon : slash;
+    *host = (span_t){ a - buf, hend - a };
+    *port = colon != NULL ? (span_t){ colon + 1 - buf, slash - colon - 1 }
+                          : (span_t){ slash - buf, 0 };
+    *path = (span_t){ slash - buf, end - slash };
+    return host->len > 0;
+}
+
+int span_is(const char *buf, span_t s, const char *name) {
+    return s.len == strlen(name) && !strncasecmp(buf + s.off, name, s.len);
+}
+
+
+// first CR or LF in buf[i, len), or len; *colon becomes the first ':'
+// before it unless it is set already
+size_t scan_line(const char *buf, size_t i, size_t len, long *colon) {
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2")) {
+        return scan_avx2(buf, i, len, colon);
+    }
+    return scan_sse2(buf, i, len, colon);
+#else
+    return scan_bytes(buf, i, len, colon);
+#endif
+}
+
+size_t scan_bytes(const char *buf, size_t i, size_t len, long *colon) {
+    for (; i < len; ++i) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            return i;
+        }
+        if (buf[i] == ':' && *colon < 0) {
+            *colon = i;
+        }
+    }
+    return len;
+}
+
+#ifdef __x86_64__
+size_t scan_sse2(const char *buf, size_t i, size_t len, long *colon) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i co = _mm_set1_epi8(':');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned eol = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        if (*colon < 0) {
+            unsigned col = _mm_movemask_epi8(_mm_cmpeq_epi8(v, co));
+            if (eol) {
+                col &= (eol & -eol) - 1;    // only those before the end
+            }
+            if (col) {
+                *colon = i + __builtin_ctz(col);
+            }
+        }
+        if (eol) {
+            return i + __builtin_ctz(eol);
+        }
+    }
+    return scan_bytes(buf, i, len, colon);
+}
+
+__attribute__((target("avx2")))
+size_t scan_avx2(const char *buf, size_t i, size_t len, long *colon) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i co = _mm256_set1_epi8(':');
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned eol = _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr),
+                            _mm256_cmpeq_epi8(v, lf)));
+        if (*colon < 0) {
+            unsigned col = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, co));
+            if (eol) {
+                col &= (eol & -eol) - 1;
+            }
+            if (col) {
+                *colon = i + __builtin_ctz(col);
+            }
+        }
+        if (eol) {
+            return i + __builtin_ctz(eol);
+        }
+    }
+    // the tail is legacy SSE code, which is slow while the upper halves
+    // of the ymm registers are dirty
+    _mm256_zeroupper();
+    return scan_sse2(buf, i, len, colon);
+}
+#endif
+
+
+void init_strbuf(strbuf_t *sb, size_t cap) {
+    sb->data = (char*) Malloc(cap);
+    sb->len = 0;
+    sb->cap = cap;
+}
+
+void reserve_strbuf(strbuf_t *sb, size_t n) {
+    if (sb->len + n <= sb->cap) {
+        return ;
+    }
+    while (sb->len + n > sb->cap) {
+        sb->cap *= 2;
+    }
+    sb->data = (char*) Realloc(sb->data, sb->cap);
+}
+
+void append_strbuf(strbuf_t *sb, const void *p, size_t n) {
+    reserve_strbuf(sb, n);
+    memcpy(sb->data + sb->len, p, n);
+    sb->len += n;
+}
+
+void printf_strbuf(strbuf_t *sb, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf_strbuf(sb, fmt, ap);
+    va_end(ap);
+}
+
+void vprintf_strbuf(strbuf_t *sb, const char *fmt, va_list ap) {
+    va_list again;
+    va_copy(again, ap);
+    int n = vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, ap);
+    if (n < 0) {
+        app_error("vsnprintf error");
+    }
+    if (sb->len + n >= sb->cap) {
+        // did not fit with its NUL, again with room for it
+        reserve_strbuf(sb, n + 1);
+        vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, again);
+    }
+    va_end(again);
+    sb->len += n;
+}
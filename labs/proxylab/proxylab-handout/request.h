@@ -0,0 +1,77 @@
+/*
+ * request.h - incremental parser for client request headers
+ *
+ * The parser never copies: the request line and every header come back
+ * as (offset, length) views into the connection's read buffer, so the
+ * buffer may move (grow) between calls. It picks up where it stopped
+ * when more bytes arrive, rescanning nothing, and finds line ends and
+ * the colon of each header line 16 or 32 bytes at a time with SSE2 or
+ * AVX2. strbuf_t is a byte buffer that grows as needed, for what the
+ * proxy writes itself.
+ */
+#ifndef __REQUEST_H__
+#define __REQUEST_H__
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "csapp.h"
+
+#define MAX_REQ_HEADERS 100
+
+/* buf[off, off + len) */
+typedef struct {
+    uint32_t off, len;
+} span_t;
+
+typedef struct {
+    span_t name;
+    span_t value;           // blanks around it trimmed
+    span_t line;            // all of it, line end included
+} req_header_t;
+
+enum parse_result {
+    PARSE_DONE,             // blank line seen, request header complete
+    PARSE_AGAIN,            // need more bytes
+    PARSE_ERROR,            // malformed, or more than MAX_REQ_HEADERS
+};
+
+typedef struct {
+    size_t line;            // start of the line being parsed
+    size_t scan;            // where scanning it resumes
+    long colon;             // first ':' seen in it, -1 if none yet
+    int in_headers;         // request line is done
+    size_t end;             // PARSE_DONE: bytes up to the blank line
+    span_t method, url, version;
+    int nheaders;
+    req_header_t headers[MAX_REQ_HEADERS];
+} req_parser_t;
+
+void init_request(req_parser_t *p);
+
+/* parse buf[0, len), of which all but the bytes that arrived since the
+ * last call have been seen before */
+int parse_request(req_parser_t *p, const char *buf, size_t len);
+
+/* split an absolute http:// URL into host, port (empty if absent) and
+ * path (starting at its '/'), return 0 if it is not one */
+int split_url(const char *buf, span_t url, span_t *host, span_t *port,
+              span_t *path);
+
+/* case-insensitive comparison of a span with a NUL terminated name */
+int span_is(const char *buf, span_t s, const char *name);
+
+
+/* growable byte buffer */
+typedef struct {
+    char *data;
+    size_t len, cap;
+} strbuf_t;
+
+void init_strbuf(strbuf_t *sb, size_t cap);
+void append_strbuf(strbuf_t *sb, const void *p, size_t n);
+void printf_strbuf(strbuf_t *sb, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void vprintf_strbuf(strbuf_t *sb, const char *fmt, va_list ap);
+
+#endif /* __REQUEST_H__ */
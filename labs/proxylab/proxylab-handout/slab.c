@@ -0,0 +1,204 @@
+/*
+ * slab.c - fixed size-class allocator for cached objects
+ *
+ * A class page hands out its chunks in address order the first time
+ * round and keeps the ones given back on its own free list, so emptying
+ * a page never means hunting its chunks down in a shared list. Pages of
+ * a class with chunks to spare are linked together; a full page leaves
+ * that list and an empty one goes back to the arena. Runs of pages are
+ * found in the bitmap of taken pages, which is a single word.
+ */
+#include "slab.h"
+
+static const size_t class_size[SLAB_CLASSES] = {
+    64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+};
+
+static int size_class(size_t n);
+static int take_pages(slab_t *slab, int k);
+static void put_pages(slab_t *slab, int p, int k);
+static void link_partial(slab_t *slab, int cls, int p);
+static void unlink_partial(slab_t *slab, int cls, int p);
+
+void init_slab(slab_t *slab, size_t size) {
+    slab->npages = size / SLAB_PAGE_SIZE;
+    if (slab->npages < 1 || slab->npages > SLAB_MAX_PAGES) {
+        app_error("slab arena size out of range");
+    }
+    // populated up front, the arena is resident for good
+    slab->base = Mmap(NULL, (size_t)slab->npages * SLAB_PAGE_SIZE,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    slab->used_pages = 0;
+    for (int i = 0; i < SLAB_MAX_PAGES; ++i) {
+        slab->pages[i].cls = -1;
+    }
+    for (int i = 0; i < SLAB_CLASSES; ++i) {
+        slab->partial[i] = -1;
+    }
+    memset(slab->stats, 0, sizeof(slab->stats));
+    Sem_init(&slab->lock, 0, 1);
+}
+
+size_t slab_footprint(size_t n) {
+    int cls = size_class(n);
+    if (cls >= 0) {
+        return class_size[cls];
+    }
+    return (n + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE * SLAB_PAGE_SIZE;
+}
+
+void *slab_alloc(slab_t *slab, size_t n) {
+    int cls = size_class(n);
+    char *ptr = NULL;
+
+    P(&slab->lock);
+    if (cls < 0) {
+        int k = slab_footprint(n) / SLAB_PAGE_SIZE;
+        int p = take_pages(slab, k);
+        if (p < 0) {
+            V(&slab->lock);
+            return NULL;
+        }
+        slab->pages[p].cls = SLAB_RUN;
+        slab->pages[p].npages = k;
+        slab->stats[SLAB_RUN].pages += k;
+        ptr = slab->base + (size_t)p * SLAB_PAGE_SIZE;
+        cls = SLAB_RUN;
+    } else {
+        int p = slab->partial[cls];
+        if (p < 0) {
+            if ((p = take_pages(slab, 1)) < 0) {
+                V(&slab->lock);
+                return NULL;
+            }
+            slab_page_t *pg = &slab->pages[p];
+            pg->cls = cls;
+            pg->used = pg->carved = 0;
+            pg->free = NULL;
+            link_partial(slab, cls, p);
+            slab->stats[cls].pages++;
+        }
+
+        slab_page_t *pg = &slab->pages[p];
+        if (pg->free != NULL) {
+            ptr = pg->free;
+            pg->free = *(void**)ptr;
+        } else {
+            ptr = slab->base + (size_t)p * SLAB_PAGE_SIZE +
+                pg->carved++ * class_size[cls];
+        }
+        if (++pg->used == SLAB_PAGE_SIZE / class_size[cls]) {
+            unlink_partial(slab, cls, p);
+        }
+    }
+    slab->stats[cls].live++;
+    slab->stats[cls].bytes += n;
+    slab->stats[cls].footprint += slab_footprint(n);
+    V(&slab->lock);
+    return ptr;
+}
+
+void slab_free(slab_t *slab, void *p, size_t n) {
+    int idx = ((char*)p - slab->base) / SLAB_PAGE_SIZE;
+    slab_page_t *pg = &slab->pages[idx];
+
+    P(&slab->lock);
+    int cls = pg->cls;
+    if (cls == SLAB_RUN) {
+        slab->stats[SLAB_RUN].pages -= pg->npages;
+        put_pages(slab, idx, pg->npages);
+    } else {
+        int full = pg->used == SLAB_PAGE_SIZE / class_size[cls];
+        *(void**)p = pg->free;
+        pg->free = p;
+        if (--pg->used == 0) {
+            // every class fits twice in a page, so it was on the list
+            unlink_partial(slab, cls, idx);
+            slab->stats[cls].pages--;
+            put_pages(slab, idx, 1);
+        } else if (full) {
+            link_partial(slab, cls, idx);
+        }
+    }
+    slab->stats[cls].live--;
+    slab->stats[cls].bytes -= n;
+    slab->stats[cls].footprint -= slab_footprint(n);
+    V(&slab->lock);
+}
+
+void sum_slab_stats(slab_t *slab, slab_stats_t *stats) {
+    P(&slab->lock);
+    for (int i = 0; i <= SLAB_CLASSES; ++i) {
+        stats[i].live += slab->stats[i].live;
+        stats[i].bytes += slab->stats[i].bytes;
+        stats[i].footprint += slab->stats[i].footprint;
+        stats[i].pages += slab->stats[i].pages;
+    }
+    V(&slab->lock);
+}
+
+size_t slab_class_size(int cls) {
+    return class_size[cls];
+}
+
+
+// smallest class that holds n bytes, -1 if it takes whole pages
+int size_class(size_t n) {
+    for (int i = 0; i < SLAB_CLASSES; ++i) {
+        if (n <= class_size[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// caller holds slab->lock; -1 if there are no k free pages in a row.
+// Single class pages are taken from the top and runs from the bottom,
+// so that scattered small objects don't break up the room for runs
+int take_pages(slab_t *slab, int k) {
+    uint64_t mask = k == 64 ? ~0UL : (1UL << k) - 1;
+    if (k == 1) {
+        for (int p = slab->npages - 1; p >= 0; --p) {
+            if ((slab->used_pages & (1UL << p)) == 0) {
+                slab->used_pages |= 1UL << p;
+                return p;
+            }
+        }
+        return -1;
+    }
+    for (int p = 0; p + k <= slab->npages; ++p) {
+        if ((slab->used_pages & (mask << p)) == 0) {
+            slab->used_pages |= mask << p;
+            return p;
+        }
+    }
+    return -1;
+}
+
+void put_pages(slab_t *slab, int p, int k) {
+    uint64_t mask = k == 64 ? ~0UL : (1UL << k) - 1;
+    slab->used_pages &= ~(mask << p);
+    slab->pages[p].cls = -1;
+}
+
+void link_partial(slab_t *slab, int cls, int p) {
+    slab->pages[p].prev = -1;
+    slab->pages[p].next = slab->partial[cls];
+    if (slab->partial[cls] >= 0) {
+        slab->pages[slab->partial[cls]].prev = p;
+    }
+    slab->partial[cls] = p;
+}
+
+void unlink_partial(slab_t *slab, int cls, int p) {
+    slab_page_t *pg = &slab->pages[p];
+    if (pg->prev >= 0) {
+        slab->pages[pg->prev].next = pg->next;
+    } else {
+        slab->partial[cls] = pg->next;
+    }
+    if (pg->next >= 0) {
+        slab->pages[pg->next].prev = pg->prev;
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * slab.h - fixed size-class allocator for cached objects
+ *
+ * Every cache shard owns an arena of SLAB_PAGE_SIZE pages, mapped and
+ * touched once at startup, so the cache budget is memory the proxy
+ * actually holds and churn can't fragment the heap. Small allocations
+ * come from pages carved into chunks of one size class; anything larger
+ * than the biggest class takes a run of whole pages. Pages go back to
+ * the arena as soon as nothing in them is in use.
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stdint.h>
+
+#include "csapp.h"
+
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_MAX_PAGES 64   /* pages per arena, one bit each in a word */
+#define SLAB_CLASSES 11     /* chunk sizes, 64 up to SLAB_PAGE_SIZE / 2 */
+#define SLAB_RUN SLAB_CLASSES   /* stats slot of page runs */
+
+/* what a page of the arena is used for */
+typedef struct {
+    int cls;                // size class, SLAB_RUN or -1 if free
+    int npages;             // SLAB_RUN: pages in the run it starts
+    int used;               // class: chunks handed out
+    int carved;             // class: chunks ever cut from the page
+    void *free;             // class: chunks given back
+    int prev, next;         // class: pages with room left, -1 ends
+} slab_page_t;
+
+typedef struct {
+    long live;              // allocations in use
+    long bytes;             // bytes asked for by them
+    long footprint;         // bytes they take from the arena
+    long pages;             // pages the class holds
+} slab_stats_t;
+
+typedef struct slab_t slab_t;
+struct slab_t {
+    char *base;
+    int npages;
+    uint64_t used_pages;    // bit per page taken
+    slab_page_t pages[SLAB_MAX_PAGES];
+    int partial[SLAB_CLASSES];  // first page of a class with room
+    slab_stats_t stats[SLAB_CLASSES + 1];
+    sem_t lock;             // objects are freed by whoever drops them last
+};
+
+/* map an arena of size bytes, rounded down to whole pages */
+void init_slab(slab_t *slab, size_t size);
+
+/* bytes of the arena an allocation of n bytes takes */
+size_t slab_footprint(size_t n);
+
+/* NULL if the arena has no room for n bytes */
+void *slab_alloc(slab_t *slab, size_t n);
+void slab_free(slab_t *slab, void *p, size_t n);
+
+/* add the arena's per-class counters to stats[SLAB_CLASSES + 1] */
+void sum_slab_stats(slab_t *slab, slab_stats_t *stats);
+size_t slab_class_size(int cls);
+
+#endif /* __SLAB_H__ */
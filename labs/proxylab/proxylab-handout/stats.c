@@ -0,0 +1,153 @@
+/*
+ * stats.c - counters, latency histograms and their report
+ *
+ * Bucket b < HIST_SUB holds the value b. Above, a value whose top bit
+ * is bit m goes to group m - HIST_SUB_BITS + 1, at the HIST_SUB_BITS
+ * bits below its top one; the bucket stands for the highest value it
+ * covers.
+ */
+#include "stats.h"
+
+static int hist_index(long v);
+static long hist_value(int i);
+
+void init_hist(hist_t *h) {
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        atomic_init(&h->counts[i], 0);
+    }
+    atomic_init(&h->n, 0);
+    atomic_init(&h->sum, 0);
+    atomic_init(&h->max, 0);
+}
+
+void add_stat(atomic_long *counter, long n) {
+    atomic_store_explicit(counter, n +
+        atomic_load_explicit(counter, memory_order_relaxed),
+        memory_order_relaxed);
+}
+
+void record_hist(hist_t *h, long us) {
+    if (us < 0) {
+        us = 0;     // the clock went back
+    }
+    add_stat(&h->counts[hist_index(us)], 1);
+    add_stat(&h->n, 1);
+    add_stat(&h->sum, us);
+    if (us > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, us, memory_order_relaxed);
+    }
+}
+
+void merge_hist(hist_sum_t *sum, hist_t *h) {
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        sum->counts[i] += atomic_load_explicit(&h->counts[i],
+                                               memory_order_relaxed);
+    }
+    sum->n += atomic_load_explicit(&h->n, memory_order_relaxed);
+    sum->sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+    long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    if (max > sum->max) {
+        sum->max = max;
+    }
+}
+
+long hist_percentile(const hist_sum_t *sum, double q) {
+    // the buckets are read one by one while they are written, so n
+    // may be a little off their total
+    long total = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        total += sum->counts[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    long rank = (long)(q * total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += sum->counts[i];
+        if (seen >= rank) {
+            long v = hist_value(i);
+            return v < sum->max ? v : sum->max;
+        }
+    }
+    return sum->max;
+}
+
+void begin_report(report_t *r, strbuf_t *sb, int json) {
+    r->sb = sb;
+    r->json = json;
+    r->n = 0;
+    if (json) {
+        append_strbuf(sb, "{", 1);
+    }
+}
+
+void report_long(report_t *r, const char *name, long v) {
+    if (r->json) {
+        printf_strbuf(r->sb, "%s\n  \"%s\": %ld", r->n ? "," : "", name, v);
+    } else {
+        printf_strbuf(r->sb, "%s %ld\n", name, v);
+    }
+    r->n++;
+}
+
+void report_double(report_t *r, const char *name, double v) {
+    if (r->json) {
+        printf_strbuf(r->sb, "%s\n  \"%s\": %.4f", r->n ? "," : "", name, v);
+    } else {
+        printf_strbuf(r->sb, "%s %.4f\n", name, v);
+    }
+    r->n++;
+}
+
+void report_hist(report_t *r, const char *name, const hist_sum_t *h) {
+    static const struct {
+        const char *suffix;
+        double q;
+    } points[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 },
+    };
+    char key[128];
+    snprintf(key, sizeof(key), "%s_count", name);
+    report_long(r, key, h->n);
+    snprintf(key, sizeof(key), "%s_mean_us", name);
+    report_long(r, key, h->n ? h->sum / h->n : 0);
+    for (int i = 0; i < sizeof(points) / sizeof(points[0]); ++i) {
+        snprintf(key, sizeof(key), "%s_%s_us", name, points[i].suffix);
+        report_long(r, key, hist_percentile(h, points[i].q));
+    }
+    snprintf(key, sizeof(key), "%s_max_us", name);
+    report_long(r, key, h->max);
+}
+
+void end_report(report_t *r) {
+    if (r->json) {
+        append_strbuf(r->sb, "\n}\n", 3);
+    }
+}
+
+
+int hist_index(long v) {
+    if (v < HIST_SUB) {
+        return v;
+    }
+    if (v >= 1L << HIST_MAX_BITS) {
+        v = (1L << HIST_MAX_BITS) - 1;
+    }
+    int top = 63 - __builtin_clzl(v);
+    int shift = top - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)(v >> shift) - HIST_SUB;
+}
+
+// the highest value bucket i covers
+long hist_value(int i) {
+    if (i < HIST_SUB) {
+        return i;
+    }
+    int shift = i / HIST_SUB - 1;
+    long low = (long)(i % HIST_SUB + HIST_SUB) << shift;
+    return low + (1L << shift) - 1;
+}
@@ -0,0 +1,62 @@
+/*
+ * stats.h - counters, latency histograms and their report
+ *
+ * Every counter and histogram has one writer, the reactor it belongs
+ * to, so adding to it is a relaxed load and store, no locked
+ * instruction; a report merges the ones of all reactors when asked.
+ * Histograms are HDR style: values in us, exact below HIST_SUB, then
+ * HIST_SUB linear buckets per power of two, so a percentile is within
+ * 1/HIST_SUB of the true value anywhere in the range.
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdatomic.h>
+
+#include "csapp.h"
+#include "request.h"
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40    /* up to 2^40 us, about 12 days */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    atomic_long counts[HIST_BUCKETS];
+    atomic_long n, sum, max;
+} hist_t;
+
+/* histograms merged for a report */
+typedef struct {
+    long counts[HIST_BUCKETS];
+    long n, sum, max;
+} hist_sum_t;
+
+void init_hist(hist_t *h);
+
+/* by the owner only */
+void add_stat(atomic_long *counter, long n);
+void record_hist(hist_t *h, long us);
+
+void merge_hist(hist_sum_t *sum, hist_t *h);
+
+/* the value q (0..1) of the recorded ones are at or below, in us */
+long hist_percentile(const hist_sum_t *sum, double q);
+
+
+/* a report: "name value" lines, or a flat JSON object */
+typedef struct {
+    strbuf_t *sb;
+    int json;
+    int n;                  // values so far
+} report_t;
+
+void begin_report(report_t *r, strbuf_t *sb, int json);
+void report_long(report_t *r, const char *name, long v);
+void report_double(report_t *r, const char *name, double v);
+
+/* name_count, name_mean_us, name_p50_us ... name_max_us */
+void report_hist(report_t *r, const char *name, const hist_sum_t *h);
+void end_report(report_t *r);
+
+#endif /* __STATS_H__ */
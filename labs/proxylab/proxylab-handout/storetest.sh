@@ -0,0 +1,107 @@
+#!/bin/bash
+#
+# storetest.sh - responses a shared cache must not keep
+#
+#     Every URL is fetched twice through the proxy. A response with
+#     Cache-Control no-store or private, one setting a cookie, and one to
+#     a request with an Authorization that is not public must reach the
+#     origin both times and never come back as a hit; a plain one is a
+#     hit the second time.
+#
+#     usage: ./storetest.sh
+#
+
+PORT_START=20000
+MAX_RAND=12000
+MAX_TRIES=50
+
+function wait_for_port {
+    for i in `seq 1 ${MAX_TRIES}`; do
+        (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "Error: nothing listens on port $1"
+    return 1
+}
+
+function pick_port {
+    while true; do
+        port=$((PORT_START + RANDOM % MAX_RAND))
+        (exec 3<>/dev/tcp/127.0.0.1/${port}) 2>/dev/null || { echo ${port}; return; }
+    done
+}
+
+function cleanup {
+    kill ${PROXY_PID} ${ORIGIN_PID} 2>/dev/null
+    wait 2>/dev/null
+    rm -rf ${TMP}
+}
+
+TMP=`mktemp -d /tmp/storetest.XXXXXX`
+trap cleanup EXIT
+
+# the path says which header the response gets; requests are logged
+cat > ${TMP}/origin.py <<'EOF'
+import http.server, sys
+HEADERS = {
+    "/plain": ("Cache-Control", "max-age=60"),
+    "/nostore": ("Cache-Control", "no-store"),
+    "/private": ("Cache-Control", "private"),
+    "/cookie": ("Set-Cookie", "id=1"),
+    "/auth": ("Cache-Control", "max-age=60"),
+}
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    def log_message(self, *args):
+        pass
+    def do_GET(self):
+        with open(sys.argv[2], "a") as log:
+            log.write(self.path + "\n")
+        body = b"a response\n"
+        self.send_response(200)
+        self.send_header(*HEADERS[self.path])
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+http.server.ThreadingHTTPServer(("127.0.0.1", int(sys.argv[1])),
+                                Handler).serve_forever()
+EOF
+
+ORIGIN_PORT=`pick_port`
+python3 ${TMP}/origin.py ${ORIGIN_PORT} ${TMP}/origin.log &
+ORIGIN_PID=$!
+PROXY_PORT=`pick_port`
+while [ ${PROXY_PORT} = ${ORIGIN_PORT} ]; do
+    PROXY_PORT=`pick_port`
+done
+./proxy ${PROXY_PORT} >/dev/null 2>&1 &
+PROXY_PID=$!
+wait_for_port ${ORIGIN_PORT} || exit 1
+wait_for_port ${PROXY_PORT} || exit 1
+
+STATUS=0
+
+# check PATH FETCHES [HEADER]: two requests, FETCHES of which the origin
+# must see; only what the origin did not see may be a hit
+function check {
+    for i in 1 2; do
+        curl -s -x 127.0.0.1:${PROXY_PORT} ${3:+-H "$3"} -D ${TMP}/head$i \
+            -o ${TMP}/body http://127.0.0.1:${ORIGIN_PORT}$1
+    done
+    local fetches=`grep -c "^$1\$" ${TMP}/origin.log`
+    local hits=`cat ${TMP}/head1 ${TMP}/head2 | grep -ci '^X-Cache: HIT'`
+    if [ "${fetches}" != $2 ] || [ $((fetches + hits)) != 2 ]; then
+        echo "Fail: $1 reached the origin ${fetches} times and hit ${hits}," \
+             "not $2 and $((2 - $2))"
+        STATUS=1
+    fi
+}
+
+check /plain 1
+check /nostore 2
+check /private 2
+check /cookie 2
+check /auth 2 "Authorization: Basic dXNlcjpwdw=="
+
+[ ${STATUS} = 0 ] && echo "storetest: ok"
+exit ${STATUS}
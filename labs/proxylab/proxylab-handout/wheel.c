@@ -0,0 +1,110 @@
+/*
+ * wheel.c - hierarchical timer wheel
+ *
+ * A timer due delta ticks after w->now goes to level l, the lowest with
+ * delta < WHEEL_SLOTS^(l+1), in slot (expires >> l*WHEEL_BITS) mod
+ * WHEEL_SLOTS. That slot of level l is emptied at the first tick of the
+ * span it stands for, which is never after the timer's deadline.
+ */
+#include "wheel.h"
+
+static void put_timer(wheel_t *w, wtimer_t *t);
+static void cascade(wheel_t *w, int level, int idx);
+
+void init_wheel(wheel_t *w, long now_ms) {
+    memset(w->slots, 0, sizeof(w->slots));
+    w->start = now_ms;
+    w->now = 0;
+}
+
+void add_timer(wheel_t *w, wtimer_t *t, long now_ms, long delay) {
+    // rounded up, a timer never fires early
+    long expires = (now_ms - w->start + delay + WHEEL_TICK - 1) / WHEEL_TICK;
+    if (t->slot != NULL) {
+        if (t->expires == expires) {
+            return ;    // re-armed within the same tick
+        }
+        del_timer(t);
+    }
+    t->expires = expires;
+    put_timer(w, t);
+}
+
+void del_timer(wtimer_t *t) {
+    if (t->slot == NULL) {
+        return ;
+    }
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else {
+        *t->slot = t->next;
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    }
+    t->slot = NULL;
+}
+
+void advance_wheel(wheel_t *w, long now_ms) {
+    long target = (now_ms - w->start) / WHEEL_TICK;
+    while (w->now <= target) {
+        long tick = w->now;
+        // a level that went round takes the next slot of the one above
+        if ((tick & (WHEEL_SLOTS - 1)) == 0) {
+            for (int l = 1; l < WHEEL_LEVELS; ++l) {
+                int idx = (tick >> (l * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+                cascade(w, l, idx);
+                if (idx != 0) {
+                    break;
+                }
+            }
+        }
+        w->now = tick + 1;
+
+        // one at a time, the callbacks may change the list
+        wtimer_t **slot = &w->slots[0][tick & (WHEEL_SLOTS - 1)];
+        wtimer_t *t;
+        while ((t = *slot) != NULL) {
+            del_timer(t);
+            t->cb(t);
+        }
+    }
+}
+
+
+void put_timer(wheel_t *w, wtimer_t *t) {
+    long delta = t->expires - w->now;
+    if (delta < 0) {
+        t->expires = w->now;    // overdue, the next tick runs it
+        delta = 0;
+    }
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >= 1L << ((level + 1) * WHEEL_BITS)) {
+        level++;
+    }
+    long max = (1L << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+    if (delta > max) {
+        t->expires = w->now + max;
+    }
+    int idx = (t->expires >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+    wtimer_t **slot = &w->slots[level][idx];
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->prev = t;
+    }
+    *slot = t;
+}
+
+// move the timers of a slot to the levels below
+void cascade(wheel_t *w, int level, int idx) {
+    wtimer_t *t = w->slots[level][idx];
+    w->slots[level][idx] = NULL;
+    while (t != NULL) {
+        wtimer_t *next = t->next;
+        put_timer(w, t);
+        t = next;
+    }
+}
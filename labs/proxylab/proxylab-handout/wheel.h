@@ -0,0 +1,53 @@
+/*
+ * wheel.h - hierarchical timer wheel
+ *
+ * Time is counted in WHEEL_TICK ms ticks. Level 0 has a slot for each of
+ * the next WHEEL_SLOTS ticks; each level above covers WHEEL_SLOTS times
+ * the span of the one below, one slot per span of that level. A timer is
+ * put in the lowest level whose span reaches its deadline, and whenever
+ * a level has gone round once, the next slot of the level above is
+ * emptied into the levels below. Adding and deleting a timer is O(1),
+ * and a tick only looks at the timers due in it, plus the ones cascaded
+ * down.
+ *
+ * A wheel belongs to one thread, nothing here is locked.
+ */
+#ifndef __WHEEL_H__
+#define __WHEEL_H__
+
+#include "csapp.h"
+
+#define WHEEL_TICK 100      /* ms */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4      /* 64^4 ticks, about 19 days */
+
+typedef struct wtimer_t wtimer_t;
+typedef void wtimer_cb(wtimer_t *t);
+
+struct wtimer_t {
+    wtimer_t *prev, *next;  // slot list
+    wtimer_t **slot;        // NULL if not armed
+    long expires;           // tick
+    wtimer_cb *cb;
+    void *data;
+};
+
+typedef struct {
+    wtimer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    long start;             // ms, tick 0
+    long now;               // next tick to run, all before it have
+} wheel_t;
+
+void init_wheel(wheel_t *w, long now_ms);
+
+/* run t->cb once delay ms from now have passed, replacing an earlier
+ * deadline of t */
+void add_timer(wheel_t *w, wtimer_t *t, long now_ms, long delay);
+void del_timer(wtimer_t *t);
+
+/* run the callbacks of all timers due by now_ms; a callback may add or
+ * delete any timer */
+void advance_wheel(wheel_t *w, long now_ms);
+
+#endif /* __WHEEL_H__ */